@@ -0,0 +1,941 @@
+/* bmp_bench.c : Mediciones de los kernels de bmp_tool sobre imagenes sinteticas y de punta a punta.
+   Compilar: gcc -std=c11 -Wall -Wextra -O2 -pthread bmp_bench.c -o bmp_bench -lm   (con libbmp.c/.h en el mismo directorio)
+   Ejecutar: ./bmp_bench                                  (64x64 .. 16384x16384; con 16k tarda decenas de minutos)
+             ./bmp_bench --max=4096 --filter=conv --json=base.json
+             ./bmp_bench --compare base.json nuevo.json   (mediana de cada caso, antes/despues)
+   Opciones: --sizes=64,256,... --max=N --filter=texto --min-time=s --min-reps=n --max-reps=n
+             --cpu=nivel --label=texto --tmp=directorio
+             --threads=1,2,4,...   (cada caso con cada numero de hilos y tabla de aceleracion)
+   Cada caso corre una vez de calentamiento y luego se repite hasta juntar min-time segundos (y al menos
+   min-reps repeticiones). Se informa la mediana: MPix/s, GB/s (bytes de imagen leidos + escritos, nominal)
+   y ciclos de TSC por pixel.
+*/
+
+#include "libbmp.c" // entero, no enlazado: se usan internos (now_seconds, g_kernels)
+
+#include <errno.h> // errno
+
+#define BENCH_MAX_REPS 1000
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_THREADS 16
+
+typedef struct
+{
+    int w, h;
+    Pixel24 *src;     // imagen sintetica original
+    Pixel24 *work;    // copia sobre la que trabajan las operaciones en el lugar
+    uint8_t *planes;  // tres planos de w*h (conversiones de color, umbrales)
+    BMPInfoHeader ih; // cabecera para guardar
+    char in_path[512], out_path[512], prefix[512];
+} BenchCtx;
+
+typedef struct
+{
+    const char *name;
+    int restore;                // copiar src en work antes de cada repeticion (fuera de la medicion)
+    double bpp;                 // bytes de imagen leidos + escritos por pixel
+    int (*setup)(BenchCtx *c);  // opcional, fuera de la medicion
+    int (*run)(BenchCtx *c);    // 1 = ok
+} BenchCase;
+
+typedef struct
+{
+    char name[64];
+    int w, h, reps;
+    double median, min, mean, stddev; // segundos
+    double mpix_s, gb_s, cycles_px;   // cycles_px < 0 si no hay TSC
+    int threads;
+} BenchResult;
+
+typedef struct
+{
+    int sizes[BENCH_MAX_SIZES], nsizes;
+    int threads[BENCH_MAX_THREADS], nthreads; // 0 = los de BMP_THREADS, sin barrido
+    int max_size;
+    const char *filter, *json, *label, *tmp;
+    double min_time;
+    int min_reps, max_reps;
+} BenchOpts;
+
+static uint64_t bench_tsc(void)
+{
+#if BMP_X86
+    return (uint64_t)__builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Imagen sintetica repetible: degradados por canal mas ruido, para que histogramas, bordes y
+// filtros tengan trabajo parecido al de una foto.
+static void bench_fill(Pixel24 *img, int w, int h)
+{
+    uint32_t s = 0x9E3779B9u;
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            s = s * 1664525u + 1013904223u;
+            int noise = (int)((s >> 24) & 31) - 16;
+            Pixel24 *p = &img[(size_t)y * w + x];
+            p->b = clamp_int_to_u8((int)((int64_t)x * 255 / w) + noise);
+            p->g = clamp_int_to_u8((int)((int64_t)y * 255 / h) - noise);
+            p->r = clamp_int_to_u8((int)((int64_t)(x + y) * 255 / (w + h)) + noise / 2);
+        }
+    }
+}
+
+// --- Casos ---
+
+static const float bench_sobel_x[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
+static const float bench_sobel_y[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
+static const float bench_laplacian[3][3] = {{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}};
+
+static int setup_input_file(BenchCtx *c)
+{
+    return save_bmp24(c->in_path, &c->ih, c->src);
+}
+
+static int run_load(BenchCtx *c)
+{
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    Pixel24 *img = NULL;
+    if (!load_bmp24(c->in_path, &fh, &ih, &img))
+        return 0;
+    bmp_free(img);
+    return 1;
+}
+
+static int run_save(BenchCtx *c)
+{
+    return save_bmp24(c->out_path, &c->ih, c->src);
+}
+
+static int run_gray601(BenchCtx *c)
+{
+    to_grayscale(c->work, c->w, c->h);
+    return 1;
+}
+
+static int run_gray709(BenchCtx *c)
+{
+    to_grayscale_ex(c->work, c->w, c->h, LUMA_BT709);
+    return 1;
+}
+
+static int run_gray2020(BenchCtx *c)
+{
+    to_grayscale_ex(c->work, c->w, c->h, LUMA_BT2020);
+    return 1;
+}
+
+static int run_gray_avg(BenchCtx *c)
+{
+    to_grayscale_ex(c->work, c->w, c->h, LUMA_AVERAGE);
+    return 1;
+}
+
+static int run_gray_ref(BenchCtx *c)
+{
+    to_grayscale_reference(c->work, c->w, c->h);
+    return 1;
+}
+
+static int run_conv_sobel_x(BenchCtx *c)
+{
+    convolve3x3(c->work, c->w, c->h, bench_sobel_x);
+    return 1;
+}
+
+static int run_conv_sobel_y(BenchCtx *c)
+{
+    convolve3x3(c->work, c->w, c->h, bench_sobel_y);
+    return 1;
+}
+
+static int run_conv_laplacian(BenchCtx *c)
+{
+    convolve3x3(c->work, c->w, c->h, bench_laplacian);
+    return 1;
+}
+
+static int run_lut_gamma(BenchCtx *c)
+{
+    PointLUT lut;
+    lut_identity(&lut);
+    lut_gamma(&lut, 2.2, LUT_CH_ALL);
+    apply_lut24(c->work, c->w, c->h, &lut);
+    return 1;
+}
+
+static int run_lut_per_channel(BenchCtx *c)
+{
+    PointLUT lut;
+    lut_identity(&lut);
+    lut_levels(&lut, 10, 240, 1.1, 0, 255, LUT_CH_R);
+    lut_brightness_contrast(&lut, 10, 1.2, LUT_CH_B);
+    apply_lut24(c->work, c->w, c->h, &lut);
+    return 1;
+}
+
+static int run_histogram(BenchCtx *c)
+{
+    Histogram24 hist;
+    return compute_histogram24(c->src, c->w, c->h, &hist);
+}
+
+static int run_equalize_luma(BenchCtx *c)
+{
+    return equalize_histogram24(c->work, c->w, c->h, 0);
+}
+
+static int run_equalize_channels(BenchCtx *c)
+{
+    return equalize_histogram24(c->work, c->w, c->h, 1);
+}
+
+static int run_clahe(BenchCtx *c)
+{
+    return clahe24(c->work, c->w, c->h, 8, 8, 2.0);
+}
+
+static int run_otsu(BenchCtx *c)
+{
+    uint32_t hist[256] = {0};
+    size_t n = (size_t)c->w * (size_t)c->h;
+    extract_luma_plane(c->src, c->w, c->h, c->planes);
+    for (size_t i = 0; i < n; ++i)
+        hist[c->planes[i]]++;
+    threshold_plane(c->planes, c->w, c->h, otsu_threshold(hist), c->planes + n);
+    return 1;
+}
+
+static int run_adaptive_mean(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    extract_luma_plane(c->src, c->w, c->h, c->planes);
+    return adaptive_threshold(c->planes, c->w, c->h, 15, ADAPT_MEAN, 10, c->planes + n);
+}
+
+static int run_adaptive_gauss(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    extract_luma_plane(c->src, c->w, c->h, c->planes);
+    return adaptive_threshold(c->planes, c->w, c->h, 15, ADAPT_GAUSSIAN, 10, c->planes + n);
+}
+
+static int bench_resize(BenchCtx *c, int dw, int dh, int filter)
+{
+    Pixel24 *out = NULL;
+    if (dw < 1 || dh < 1)
+        return 0;
+    if (!resize_bmp24(c->src, c->w, c->h, dw, dh, filter, &out))
+        return 0;
+    bmp_free(out);
+    return 1;
+}
+
+static int run_resize_box(BenchCtx *c)
+{
+    return bench_resize(c, c->w / 2, c->h / 2, RESIZE_BOX);
+}
+
+static int run_resize_bilinear(BenchCtx *c)
+{
+    return bench_resize(c, c->w * 7 / 10, c->h * 7 / 10, RESIZE_BILINEAR);
+}
+
+static int run_resize_lanczos(BenchCtx *c)
+{
+    return bench_resize(c, c->w * 7 / 10, c->h * 7 / 10, RESIZE_LANCZOS3);
+}
+
+static int run_pyramid(BenchCtx *c)
+{
+    return build_pyramid_from_pixels(c->src, &c->ih, c->prefix, 0);
+}
+
+static int bench_rotate(BenchCtx *c, int mode)
+{
+    Pixel24 *out = NULL;
+    if (!rotate_bmp24(c->src, c->w, c->h, mode, &out))
+        return 0;
+    bmp_free(out);
+    return 1;
+}
+
+static int run_rotate90(BenchCtx *c)
+{
+    return bench_rotate(c, ROTATE_90);
+}
+
+static int run_transpose(BenchCtx *c)
+{
+    return bench_rotate(c, ROTATE_TRANSPOSE);
+}
+
+static int run_flip_h(BenchCtx *c)
+{
+    flip_horizontal(c->work, c->w, c->h);
+    return 1;
+}
+
+static int run_flip_v(BenchCtx *c)
+{
+    return flip_vertical(c->work, c->w, c->h);
+}
+
+static int run_rotate180(BenchCtx *c)
+{
+    rotate180(c->work, c->w, c->h);
+    return 1;
+}
+
+static int run_morph_open(BenchCtx *c)
+{
+    return morph_bmp24(c->work, c->w, c->h, 5, 5, MORPH_OPEN);
+}
+
+static int run_morph_erode_big(BenchCtx *c)
+{
+    return morph_bmp24(c->work, c->w, c->h, 31, 31, MORPH_ERODE);
+}
+
+static int run_bilateral(BenchCtx *c)
+{
+    return bilateral_filter_bmp24(c->work, c->w, c->h, 4.0, 25.0, 0);
+}
+
+static int run_unsharp(BenchCtx *c)
+{
+    return unsharp_mask_bmp24(c->work, c->w, c->h, 2.0, 1.0, 3);
+}
+
+static int run_to_ycbcr(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    bgr_to_ycbcr(c->src, n, c->planes, c->planes + n, c->planes + 2 * n, YCC_BT601, 1);
+    return 1;
+}
+
+static int run_from_ycbcr(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    ycbcr_to_bgr(c->planes, c->planes + n, c->planes + 2 * n, n, c->work, YCC_BT601, 1);
+    return 1;
+}
+
+static int run_to_hsv(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    bgr_to_hsv(c->src, n, c->planes, c->planes + n, c->planes + 2 * n);
+    return 1;
+}
+
+static int run_from_hsv(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    hsv_to_bgr(c->planes, c->planes + n, c->planes + 2 * n, n, c->work);
+    return 1;
+}
+
+static int run_to_lab(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    bgr_to_lab(c->src, n, c->planes, c->planes + n, c->planes + 2 * n);
+    return 1;
+}
+
+static int run_from_lab(BenchCtx *c)
+{
+    size_t n = (size_t)c->w * (size_t)c->h;
+    lab_to_bgr(c->planes, c->planes + n, c->planes + 2 * n, n, c->work);
+    return 1;
+}
+
+static int run_hue_sat(BenchCtx *c)
+{
+    return adjust_hue_saturation(c->work, c->w, c->h, 30.0, 1.2);
+}
+
+static int bench_conv_luma_cb(Pixel24 *gray, int width, int height, void *ctx)
+{
+    convolve3x3(gray, width, height, (const float(*)[3])ctx);
+    return 1;
+}
+
+static int run_luma_conv(BenchCtx *c)
+{
+    return filter_luma_only(c->work, c->w, c->h, YCC_BT601, bench_conv_luma_cb, (void *)bench_laplacian);
+}
+
+// De punta a punta: archivo -> operacion -> archivo
+static int run_e2e_gray(BenchCtx *c)
+{
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    Pixel24 *img = NULL;
+    if (!load_bmp24(c->in_path, &fh, &ih, &img))
+        return 0;
+    to_grayscale(img, ih.biWidth, ih.biHeight);
+    int ok = save_bmp24(c->out_path, &ih, img);
+    bmp_free(img);
+    return ok;
+}
+
+static int run_e2e_sobel(BenchCtx *c)
+{
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    Pixel24 *img = NULL;
+    if (!load_bmp24(c->in_path, &fh, &ih, &img))
+        return 0;
+    to_grayscale(img, ih.biWidth, ih.biHeight);
+    convolve3x3(img, ih.biWidth, ih.biHeight, bench_sobel_x);
+    int ok = save_bmp24(c->out_path, &ih, img);
+    bmp_free(img);
+    return ok;
+}
+
+static int run_e2e_resize(BenchCtx *c)
+{
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    Pixel24 *img = NULL, *out = NULL;
+    if (!load_bmp24(c->in_path, &fh, &ih, &img))
+        return 0;
+    int dw = ih.biWidth / 2, dh = ih.biHeight / 2;
+    int ok = resize_bmp24(img, ih.biWidth, ih.biHeight, dw, dh, RESIZE_AUTO, &out);
+    bmp_free(img);
+    if (!ok)
+        return 0;
+    ih.biWidth = dw;
+    ih.biHeight = dh;
+    ok = save_bmp24(c->out_path, &ih, out);
+    bmp_free(out);
+    return ok;
+}
+
+// Carga desigual sintetica: las filas del primer octavo cuestan 16 veces mas (como una region de
+// interes o un filtro adaptativo). Con una banda por hilo el que toma ese octavo marca el tiempo;
+// con teselas los demas hilos le roban el resto.
+static void bench_skewed_band(void *ctx, int band, int y0, int y1)
+{
+    BenchCtx *c = (BenchCtx *)ctx;
+    (void)band;
+    for (int y = y0; y < y1; ++y)
+    {
+        Pixel24 *row = &c->work[(size_t)y * c->w];
+        for (int k = y < c->h / 8 ? 16 : 1; k > 0; --k)
+            for (int x = 0; x < c->w; ++x)
+                row[x].r = (uint8_t)(row[x].r * 3 + row[x].g + k);
+    }
+}
+
+static int run_skewed_bands(BenchCtx *c)
+{
+    run_bands(c->h, bmp_num_threads(), bench_skewed_band, c);
+    return 1;
+}
+
+static int run_skewed_tiles(BenchCtx *c)
+{
+    run_bands(c->h, sched_tiles(c->h), bench_skewed_band, c);
+    return 1;
+}
+
+static const BenchCase bench_cases[] = {
+    {"load_bmp24", 0, 6.0, setup_input_file, run_load},
+    {"save_bmp24", 0, 6.0, NULL, run_save},
+    {"to_grayscale", 1, 6.0, NULL, run_gray601},
+    {"to_grayscale_bt709", 1, 6.0, NULL, run_gray709},
+    {"to_grayscale_bt2020", 1, 6.0, NULL, run_gray2020},
+    {"to_grayscale_average", 1, 6.0, NULL, run_gray_avg},
+    {"to_grayscale_reference", 1, 6.0, NULL, run_gray_ref},
+    {"convolve3x3_sobel_x", 1, 6.0, NULL, run_conv_sobel_x},
+    {"convolve3x3_sobel_y", 1, 6.0, NULL, run_conv_sobel_y},
+    {"convolve3x3_laplacian", 1, 6.0, NULL, run_conv_laplacian},
+    {"apply_lut24_gamma", 1, 6.0, NULL, run_lut_gamma},
+    {"apply_lut24_per_channel", 1, 6.0, NULL, run_lut_per_channel},
+    {"compute_histogram24", 0, 3.0, NULL, run_histogram},
+    {"equalize_luma", 1, 6.0, NULL, run_equalize_luma},
+    {"equalize_per_channel", 1, 6.0, NULL, run_equalize_channels},
+    {"clahe24_8x8", 1, 6.0, NULL, run_clahe},
+    {"threshold_otsu", 0, 4.0, NULL, run_otsu},
+    {"adaptive_threshold_mean", 0, 4.0, NULL, run_adaptive_mean},
+    {"adaptive_threshold_gauss", 0, 4.0, NULL, run_adaptive_gauss},
+    {"resize_box_half", 0, 3.75, NULL, run_resize_box},
+    {"resize_bilinear_0.7", 0, 4.47, NULL, run_resize_bilinear},
+    {"resize_lanczos3_0.7", 0, 4.47, NULL, run_resize_lanczos},
+    {"build_pyramid", 0, 4.0, NULL, run_pyramid},
+    {"rotate_90", 0, 6.0, NULL, run_rotate90},
+    {"transpose", 0, 6.0, NULL, run_transpose},
+    {"flip_horizontal", 1, 6.0, NULL, run_flip_h},
+    {"flip_vertical", 1, 6.0, NULL, run_flip_v},
+    {"rotate180", 1, 6.0, NULL, run_rotate180},
+    {"morph_open_5x5", 1, 6.0, NULL, run_morph_open},
+    {"morph_erode_31x31", 1, 6.0, NULL, run_morph_erode_big},
+    {"bilateral_4_25", 1, 6.0, NULL, run_bilateral},
+    {"unsharp_2_1.0_3", 1, 6.0, NULL, run_unsharp},
+    {"sched_skewed_bands", 1, 6.0, NULL, run_skewed_bands},
+    {"sched_skewed_tiles", 1, 6.0, NULL, run_skewed_tiles},
+    {"bgr_to_ycbcr", 0, 6.0, NULL, run_to_ycbcr},
+    {"ycbcr_to_bgr", 0, 6.0, NULL, run_from_ycbcr},
+    {"bgr_to_hsv", 0, 6.0, NULL, run_to_hsv},
+    {"hsv_to_bgr", 0, 6.0, NULL, run_from_hsv},
+    {"bgr_to_lab", 0, 6.0, NULL, run_to_lab},
+    {"lab_to_bgr", 0, 6.0, NULL, run_from_lab},
+    {"hue_saturation", 1, 6.0, NULL, run_hue_sat},
+    {"luma_only_laplacian", 1, 6.0, NULL, run_luma_conv},
+    {"e2e_load_gray_save", 0, 12.0, setup_input_file, run_e2e_gray},
+    {"e2e_load_sobel_save", 0, 12.0, setup_input_file, run_e2e_sobel},
+    {"e2e_load_resize_save", 0, 6.75, setup_input_file, run_e2e_resize},
+};
+
+// --- Medicion ---
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_one(const BenchCase *bc, BenchCtx *c, const BenchOpts *o, BenchResult *r)
+{
+    static double times[BENCH_MAX_REPS];
+    static double cycles[BENCH_MAX_REPS];
+    size_t bytes = sizeof(Pixel24) * (size_t)c->w * (size_t)c->h;
+
+    if (bc->setup && !bc->setup(c))
+        return 0;
+    // Calentamiento: paginas tocadas, tablas perezosas (HSV/Lab) inicializadas, caches llenas
+    if (bc->restore)
+        memcpy(c->work, c->src, bytes);
+    if (!bc->run(c))
+        return 0;
+
+    int reps = 0;
+    double total = 0.0;
+    while (reps < o->max_reps && (reps < o->min_reps || total < o->min_time))
+    {
+        if (bc->restore)
+            memcpy(c->work, c->src, bytes);
+        uint64_t c0 = bench_tsc();
+        double t0 = now_seconds();
+        int ok = bc->run(c);
+        double t1 = now_seconds();
+        uint64_t c1 = bench_tsc();
+        if (!ok)
+            return 0;
+        times[reps] = t1 - t0;
+        cycles[reps] = (double)(c1 - c0);
+        total += times[reps];
+        ++reps;
+    }
+
+    double sum = 0.0, sq = 0.0;
+    for (int i = 0; i < reps; ++i)
+        sum += times[i];
+    r->mean = sum / reps;
+    for (int i = 0; i < reps; ++i)
+        sq += (times[i] - r->mean) * (times[i] - r->mean);
+    r->stddev = reps > 1 ? sqrt(sq / (reps - 1)) : 0.0;
+    qsort(times, (size_t)reps, sizeof(double), cmp_double);
+    qsort(cycles, (size_t)reps, sizeof(double), cmp_double);
+    r->median = times[reps / 2];
+    r->min = times[0];
+    r->reps = reps;
+    r->w = c->w;
+    r->h = c->h;
+    snprintf(r->name, sizeof(r->name), "%s", bc->name);
+    double px = (double)c->w * (double)c->h;
+    r->mpix_s = px / r->median / 1e6;
+    r->gb_s = px * bc->bpp / r->median / 1e9;
+    r->cycles_px = BMP_X86 ? cycles[reps / 2] / px : -1.0;
+    r->threads = bmp_num_threads();
+    return 1;
+}
+
+static void bench_ctx_free(BenchCtx *c)
+{
+    free(c->src);
+    free(c->work);
+    free(c->planes);
+    c->src = c->work = NULL;
+    c->planes = NULL;
+}
+
+static int bench_ctx_init(BenchCtx *c, int size, const char *tmp)
+{
+    size_t n = (size_t)size * (size_t)size;
+    memset(c, 0, sizeof(*c));
+    c->w = c->h = size;
+    c->src = (Pixel24 *)malloc(sizeof(Pixel24) * n);
+    c->work = (Pixel24 *)malloc(sizeof(Pixel24) * n);
+    c->planes = (uint8_t *)malloc(3 * n);
+    if (!c->src || !c->work || !c->planes)
+    {
+        bench_ctx_free(c);
+        return 0;
+    }
+    bench_fill(c->src, size, size);
+    memcpy(c->work, c->src, sizeof(Pixel24) * n);
+
+    c->ih.biSize = 40;
+    c->ih.biWidth = size;
+    c->ih.biHeight = size;
+    c->ih.biPlanes = 1;
+    c->ih.biBitCount = 24;
+    c->ih.biXPelsPerMeter = c->ih.biYPelsPerMeter = 2835;
+    snprintf(c->in_path, sizeof(c->in_path), "%s/bmp_bench_%d_in.bmp", tmp, (int)getpid());
+    snprintf(c->out_path, sizeof(c->out_path), "%s/bmp_bench_%d_out.bmp", tmp, (int)getpid());
+    snprintf(c->prefix, sizeof(c->prefix), "%s/bmp_bench_%d_pyr", tmp, (int)getpid());
+    return 1;
+}
+
+static void bench_cleanup_files(const BenchCtx *c)
+{
+    char name[600];
+    remove(c->in_path);
+    remove(c->out_path);
+    for (int k = 1; k < 32; ++k)
+    {
+        snprintf(name, sizeof(name), "%s_%d.bmp", c->prefix, k);
+        if (remove(name) != 0 && errno == ENOENT)
+            break;
+    }
+}
+
+static void bench_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// Un resultado por linea, con las claves siempre en el mismo orden: --compare lo lee con sscanf.
+static int bench_write_json(const char *path, const BenchOpts *o, const BenchResult *res, int nres)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "No se pudo crear %s\n", path);
+        return 0;
+    }
+    fprintf(f, "{\"tool\": \"bmp_bench\", \"label\": ");
+    bench_json_string(f, o->label ? o->label : "");
+    fprintf(f, ", \"cpu\": \"%s\", \"threads\": %d, \"min_time_s\": %g, \"results\": [\n",
+            cpu_level_name(g_kernels.level), bmp_num_threads(), o->min_time);
+    for (int i = 0; i < nres; ++i)
+    {
+        const BenchResult *r = &res[i];
+        fprintf(f,
+                "{\"name\": \"%s\", \"width\": %d, \"height\": %d, \"reps\": %d, \"median_s\": %.9f, "
+                "\"min_s\": %.9f, \"mean_s\": %.9f, \"stddev_s\": %.9f, \"mpix_s\": %.3f, \"gb_s\": %.4f, ",
+                r->name, r->w, r->h, r->reps, r->median, r->min, r->mean, r->stddev, r->mpix_s, r->gb_s);
+        if (r->cycles_px >= 0.0)
+            fprintf(f, "\"cycles_per_pixel\": %.3f, ", r->cycles_px);
+        else
+            fprintf(f, "\"cycles_per_pixel\": null, ");
+        fprintf(f, "\"threads\": %d}", r->threads);
+        fprintf(f, "%s\n", i + 1 < nres ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    return fclose(f) == 0;
+}
+
+// --- Comparacion entre dos corridas ---
+
+typedef struct
+{
+    char name[64];
+    int w, h;
+    double median;
+} BenchEntry;
+
+static int bench_read_json(const char *path, BenchEntry **out, int *count)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "No se pudo abrir %s\n", path);
+        return 0;
+    }
+    int cap = 64, n = 0;
+    BenchEntry *e = (BenchEntry *)malloc(sizeof(BenchEntry) * (size_t)cap);
+    char line[1024];
+    while (e && fgets(line, sizeof(line), f))
+    {
+        BenchEntry t;
+        int reps;
+        if (sscanf(line, "{\"name\": \"%63[^\"]\", \"width\": %d, \"height\": %d, \"reps\": %d, \"median_s\": %lf",
+                   t.name, &t.w, &t.h, &reps, &t.median) != 5)
+            continue;
+        if (n == cap)
+        {
+            cap *= 2;
+            BenchEntry *ne = (BenchEntry *)realloc(e, sizeof(BenchEntry) * (size_t)cap);
+            if (!ne)
+                break;
+            e = ne;
+        }
+        e[n++] = t;
+    }
+    fclose(f);
+    if (!e)
+    {
+        fprintf(stderr, "Sin memoria para leer %s\n", path);
+        return 0;
+    }
+    *out = e;
+    *count = n;
+    return 1;
+}
+
+static int bench_compare(const char *base_path, const char *new_path)
+{
+    BenchEntry *a = NULL, *b = NULL;
+    int na = 0, nb = 0;
+    if (!bench_read_json(base_path, &a, &na) || !bench_read_json(new_path, &b, &nb))
+    {
+        free(a);
+        return 1;
+    }
+    printf("%-28s %11s %12s %12s %9s\n", "caso", "tamano", "base (ms)", "nuevo (ms)", "acelera");
+    int matched = 0;
+    double log_sum = 0.0;
+    for (int i = 0; i < nb; ++i)
+    {
+        for (int j = 0; j < na; ++j)
+        {
+            if (strcmp(a[j].name, b[i].name) != 0 || a[j].w != b[i].w || a[j].h != b[i].h)
+                continue;
+            double sp = a[j].median / b[i].median;
+            char size[32];
+            snprintf(size, sizeof(size), "%dx%d", b[i].w, b[i].h);
+            printf("%-28s %11s %12.3f %12.3f %8.2fx%s\n", b[i].name, size, a[j].median * 1e3, b[i].median * 1e3, sp,
+                   sp < 0.95 ? "  (mas lento)" : "");
+            log_sum += log(sp);
+            ++matched;
+            break;
+        }
+    }
+    if (matched)
+        printf("Media geometrica de %d casos: %.3fx\n", matched, exp(log_sum / matched));
+    else
+        printf("No hay casos en comun.\n");
+    free(a);
+    free(b);
+    return 0;
+}
+
+// --- Programa ---
+
+// Lista "a,b,c" de enteros en [lo, hi]; 0 si esta vacia o mal formada.
+static int bench_parse_list(const char *list, int *v, int max, int *n, long lo, long hi)
+{
+    *n = 0;
+    while (*list && *n < max)
+    {
+        char *end;
+        long x = strtol(list, &end, 10);
+        if (end == list || x < lo || x > hi)
+            return 0;
+        v[(*n)++] = (int)x;
+        list = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            return 0;
+    }
+    return *n > 0;
+}
+
+static int bench_parse_sizes(const char *list, BenchOpts *o)
+{
+    return bench_parse_list(list, o->sizes, BENCH_MAX_SIZES, &o->nsizes, 3, 65535);
+}
+
+// Aceleracion de cada caso respecto de la primera cantidad de hilos del barrido.
+static void bench_print_scaling(const BenchOpts *o, const BenchResult *res, int nres)
+{
+    printf("\nEscalado respecto de %d hilo(s):\n%-28s %11s %11s", o->threads[0], "caso", "tamano", "base ms");
+    for (int t = 1; t < o->nthreads; ++t)
+    {
+        char head[16];
+        snprintf(head, sizeof(head), "%dh", o->threads[t]);
+        printf(" %7s", head);
+    }
+    printf("\n");
+    for (int i = 0; i < nres; ++i)
+    {
+        const BenchResult *base = &res[i];
+        if (base->threads != o->threads[0])
+            continue;
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", base->w, base->h);
+        printf("%-28s %11s %11.3f", base->name, size, base->median * 1e3);
+        for (int t = 1; t < o->nthreads; ++t)
+        {
+            const BenchResult *r = NULL;
+            for (int k = 0; k < nres && !r; ++k)
+                if (res[k].threads == o->threads[t] && res[k].w == base->w && res[k].h == base->h &&
+                    strcmp(res[k].name, base->name) == 0)
+                    r = &res[k];
+            if (r)
+                printf(" %6.2fx", base->median / r->median);
+            else
+                printf(" %7s", "-");
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    BenchOpts o;
+    memset(&o, 0, sizeof(o));
+    bench_parse_sizes("64,256,1024,4096,16384", &o);
+    o.max_size = 1 << 30;
+    o.min_time = 0.25;
+    o.min_reps = 5;
+    o.max_reps = 200;
+    o.tmp = "/tmp";
+    int cpu_max = -1;
+
+    for (int a = 1; a < argc; ++a)
+    {
+        const char *arg = argv[a];
+        if (strcmp(arg, "--compare") == 0 && a + 2 < argc)
+            return bench_compare(argv[a + 1], argv[a + 2]);
+        else if (strncmp(arg, "--sizes=", 8) == 0)
+        {
+            if (!bench_parse_sizes(arg + 8, &o))
+            {
+                fprintf(stderr, "Lista de tamanos invalida: %s\n", arg + 8);
+                return 1;
+            }
+        }
+        else if (strncmp(arg, "--threads=", 10) == 0)
+        {
+            if (!bench_parse_list(arg + 10, o.threads, BENCH_MAX_THREADS, &o.nthreads, 1, 256))
+            {
+                fprintf(stderr, "Lista de hilos invalida: %s\n", arg + 10);
+                return 1;
+            }
+        }
+        else if (strncmp(arg, "--max=", 6) == 0)
+            o.max_size = atoi(arg + 6);
+        else if (strncmp(arg, "--filter=", 9) == 0)
+            o.filter = arg + 9;
+        else if (strncmp(arg, "--json=", 7) == 0)
+            o.json = arg + 7;
+        else if (strncmp(arg, "--label=", 8) == 0)
+            o.label = arg + 8;
+        else if (strncmp(arg, "--tmp=", 6) == 0)
+            o.tmp = arg + 6;
+        else if (strncmp(arg, "--min-time=", 11) == 0)
+            o.min_time = atof(arg + 11);
+        else if (strncmp(arg, "--min-reps=", 11) == 0)
+            o.min_reps = atoi(arg + 11);
+        else if (strncmp(arg, "--max-reps=", 11) == 0)
+            o.max_reps = atoi(arg + 11);
+        else if (strncmp(arg, "--cpu=", 6) == 0)
+        {
+            cpu_max = cpu_level_from_name(arg + 6);
+            if (cpu_max < 0)
+            {
+                fprintf(stderr, "Nivel de CPU desconocido: %s\n", arg + 6);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Argumento desconocido: %s\n", arg);
+            return 1;
+        }
+    }
+    if (o.min_reps < 1)
+        o.min_reps = 1;
+    if (o.max_reps > BENCH_MAX_REPS)
+        o.max_reps = BENCH_MAX_REPS;
+    if (o.max_reps < o.min_reps)
+        o.max_reps = o.min_reps;
+
+    cpu_dispatch_init(cpu_max);
+    const int ncases = (int)(sizeof(bench_cases) / sizeof(bench_cases[0]));
+    int passes = o.nthreads > 0 ? o.nthreads : 1;
+    BenchResult *res = (BenchResult *)malloc(sizeof(BenchResult) * (size_t)ncases * BENCH_MAX_SIZES * passes);
+    if (!res)
+    {
+        fprintf(stderr, "Sin memoria.\n");
+        return 1;
+    }
+    int nres = 0, failures = 0;
+
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        if (o.nthreads > 0)
+        {
+            // El planificador ajusta su conjunto de hilos en la proxima operacion
+            bmp_set_num_threads(o.threads[pass]);
+        }
+        printf("CPU: %s, hilos: %d, min-time %.2f s, min-reps %d\n", cpu_level_name(g_kernels.level), bmp_num_threads(),
+               o.min_time, o.min_reps);
+        printf("%-28s %11s %5s %11s %7s %9s %8s %9s\n", "caso", "tamano", "reps", "mediana ms", "desv %", "MPix/s",
+               "GB/s", "ciclos/px");
+        for (int s = 0; s < o.nsizes; ++s)
+        {
+            int size = o.sizes[s];
+            if (size > o.max_size)
+                continue;
+            BenchCtx c;
+            if (!bench_ctx_init(&c, size, o.tmp))
+            {
+                printf("%dx%d: sin memoria, se omite\n", size, size);
+                continue;
+            }
+            char size_txt[32];
+            snprintf(size_txt, sizeof(size_txt), "%dx%d", size, size);
+            for (int i = 0; i < ncases; ++i)
+            {
+                const BenchCase *bc = &bench_cases[i];
+                if (o.filter && !strstr(bc->name, o.filter))
+                    continue;
+                BenchResult *r = &res[nres];
+                if (!bench_one(bc, &c, &o, r))
+                {
+                    printf("%-28s %11s  fallo (memoria o E/S)\n", bc->name, size_txt);
+                    ++failures;
+                    continue;
+                }
+                ++nres;
+                printf("%-28s %11s %5d %11.3f %7.1f %9.1f %8.2f", r->name, size_txt, r->reps, r->median * 1e3,
+                       100.0 * r->stddev / r->mean, r->mpix_s, r->gb_s);
+                if (r->cycles_px >= 0.0)
+                    printf(" %9.2f\n", r->cycles_px);
+                else
+                    printf(" %9s\n", "-");
+                fflush(stdout);
+            }
+            bench_cleanup_files(&c);
+            bench_ctx_free(&c);
+        }
+    }
+    if (o.nthreads > 1)
+        bench_print_scaling(&o, res, nres);
+
+    int ok = 1;
+    if (o.json)
+    {
+        ok = bench_write_json(o.json, &o, res, nres);
+        if (ok)
+            printf("Resultados en %s\n", o.json);
+    }
+    free(res);
+    return (ok && !failures) ? 0 : 1;
+}
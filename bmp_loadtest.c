@@ -0,0 +1,402 @@
+/* bmp_loadtest.c : Carga sobre el servidor de bmp_tool (--daemon) y latencias p50/p99 por concurrencia.
+   Compilar: gcc -std=c11 -Wall -Wextra -O2 -pthread bmp_loadtest.c libbmp.c -o bmp_loadtest -lm
+   Ejecutar: ./bmp_tool --daemon=/tmp/bmp.sock &
+             ./bmp_loadtest --socket=/tmp/bmp.sock --input=foto.bmp --ops="gray" --concurrency=1,2,4,8
+             ./bmp_loadtest --spawn=./bmp_tool --input=foto.bmp --ops="gray"   (un proceso por trabajo, referencia)
+   Opciones: --requests=n (por nivel) --out=none|fd|ruta --fd (la entrada viaja como memfd, sin ruta)
+             --shm (cada hilo pasa un segmento BmpShm que se filtra en el lugar; con --spawn via fd:N)
+             --json=archivo (una linea por nivel)
+   Cada hilo abre su conexion, hace un trabajo de calentamiento y luego envia trabajos de a uno,
+   midiendo desde el envio hasta la respuesta.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create
+#endif
+
+#include "libbmp.h"
+
+#include <stdio.h>      // printf, fprintf, snprintf
+#include <stdlib.h>     // malloc, free, qsort, atoi
+#include <string.h>     // strcmp, strncmp, strchr
+#include <time.h>       // clock_gettime
+#include <pthread.h>    // pthread_create, pthread_join
+#include <spawn.h>      // posix_spawn
+#include <unistd.h>     // close, write
+#include <sys/mman.h>   // memfd_create
+#include <sys/socket.h> // socket, sendmsg, SCM_RIGHTS
+#include <sys/un.h>     // sockaddr_un
+#include <sys/wait.h>   // waitpid
+
+extern char **environ;
+
+#define LT_MAX_LEVELS 16
+#define LT_MAX_ARGS 64
+
+typedef struct
+{
+    const char *socket_path, *spawn_bin, *input, *ops, *out, *json;
+    int use_fd, use_shm;
+    const Pixel24 *pixels; // imagen de entrada decodificada (--shm)
+    int width, height;
+    int levels[LT_MAX_LEVELS], nlevels;
+    int requests;
+} LoadOpts;
+
+typedef struct
+{
+    const LoadOpts *o;
+    int in_fd; // memfd con el BMP (--fd), compartido entre hilos
+    int count; // trabajos medidos de este hilo
+    double *lat;
+    int errors;
+    BmpShm seg; // --shm: segmento propio del hilo
+} LoadWorker;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+static int connect_daemon(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (s >= 0 && connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(s);
+        s = -1;
+    }
+    return s;
+}
+
+// Un trabajo por el socket: el mensaje y los descriptores viajan juntos en un solo sendmsg.
+static int daemon_job(int s, const char *msg, const int *fds, int nfds)
+{
+    union
+    {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int) * 2)];
+    } ctrl;
+    struct iovec iov;
+    iov.iov_base = (void *)msg;
+    iov.iov_len = strlen(msg);
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0)
+    {
+        memset(&ctrl, 0, sizeof(ctrl));
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)nfds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * (size_t)nfds);
+    }
+    if (sendmsg(s, &mh, MSG_NOSIGNAL) < 0)
+        return 0;
+    char reply[256];
+    ssize_t n = recv(s, reply, sizeof(reply) - 1, 0);
+    if (n <= 0)
+        return 0;
+    reply[n] = '\0';
+    if (strncmp(reply, "OK", 2) != 0)
+    {
+        fprintf(stderr, "Servidor: %s\n", reply);
+        return 0;
+    }
+    return 1;
+}
+
+// Referencia sin servidor: bmp_tool op entrada salida [parametros] en un proceso nuevo.
+// Con --shm entrada y salida son "fd:N" (el proceso hijo hereda el descriptor del segmento).
+static int spawn_job(const LoadOpts *o, const char *shm_arg)
+{
+    char ops[1024];
+    snprintf(ops, sizeof(ops), "%s", o->ops);
+    char *tok[LT_MAX_ARGS];
+    int nt = 0;
+    char *save = NULL;
+    for (char *t = strtok_r(ops, " ", &save); t && nt < LT_MAX_ARGS; t = strtok_r(NULL, " ", &save))
+        tok[nt++] = t;
+    if (nt == 0)
+        return 0;
+    char *argv[LT_MAX_ARGS + 4];
+    int a = 0;
+    argv[a++] = (char *)o->spawn_bin;
+    argv[a++] = tok[0];
+    argv[a++] = (char *)(shm_arg ? shm_arg : o->input);
+    argv[a++] = (char *)(shm_arg ? shm_arg : (strcmp(o->out, "none") == 0 ? "/dev/null" : o->out));
+    for (int i = 1; i < nt; ++i)
+        argv[a++] = tok[i];
+    argv[a] = NULL;
+    pid_t pid;
+    int status = 0;
+    if (posix_spawn(&pid, o->spawn_bin, NULL, NULL, argv, environ) != 0 || waitpid(pid, &status, 0) < 0)
+        return 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void *load_worker(void *arg)
+{
+    LoadWorker *w = (LoadWorker *)arg;
+    const LoadOpts *o = w->o;
+    int s = -1, out_fd = -1, fds[2], nfds = 0;
+    char msg[2048], shm_arg[32];
+    size_t img_bytes = sizeof(Pixel24) * (size_t)o->width * (size_t)o->height;
+    if (o->use_shm)
+    {
+        if (!bmp_shm_create(&w->seg, o->width, o->height, NULL))
+        {
+            w->errors = w->count + 1;
+            return NULL;
+        }
+        memcpy(w->seg.pixels, o->pixels, img_bytes);
+        snprintf(shm_arg, sizeof(shm_arg), "fd:%d", w->seg.fd);
+    }
+    if (o->socket_path)
+    {
+        s = connect_daemon(o->socket_path);
+        if (s < 0)
+        {
+            perror("No se pudo conectar al servidor");
+            w->errors = w->count + 1;
+            return NULL;
+        }
+        if (o->use_fd)
+            fds[nfds++] = w->in_fd;
+        if (o->use_shm)
+            fds[nfds++] = w->seg.fd;
+        if (strcmp(o->out, "fd") == 0)
+        {
+            out_fd = memfd_create("bmp_loadtest_out", 0);
+            fds[nfds++] = out_fd;
+        }
+        if (o->use_shm)
+            snprintf(msg, sizeof(msg), "shm shm %s", o->ops);
+        else
+            snprintf(msg, sizeof(msg), "%s %s %s", o->use_fd ? "fd" : o->input, o->out, o->ops);
+    }
+
+    for (int i = -1; i < w->count; ++i) // i = -1: calentamiento, no se mide
+    {
+        // Si la cadena cambio las dimensiones del segmento, se restaura fuera de la medicion
+        if (o->use_shm && (w->seg.hdr->width != o->width || w->seg.hdr->height != o->height))
+        {
+            bmp_shm_set_size(&w->seg, o->width, o->height);
+            memcpy(w->seg.pixels, o->pixels, img_bytes);
+        }
+        double t0 = now_seconds();
+        int ok = s >= 0 ? daemon_job(s, msg, fds, nfds) : spawn_job(o, o->use_shm ? shm_arg : NULL);
+        double dt = now_seconds() - t0;
+        if (!ok)
+            w->errors++;
+        if (i >= 0)
+            w->lat[i] = dt;
+    }
+    if (out_fd >= 0)
+        close(out_fd);
+    if (s >= 0)
+        close(s);
+    if (o->use_shm)
+    {
+        bmp_shm_detach(&w->seg);
+        close(w->seg.fd);
+    }
+    return NULL;
+}
+
+static int parse_levels(const char *text, LoadOpts *o)
+{
+    o->nlevels = 0;
+    while (*text && o->nlevels < LT_MAX_LEVELS)
+    {
+        int v = atoi(text);
+        if (v < 1)
+            return 0;
+        o->levels[o->nlevels++] = v;
+        const char *comma = strchr(text, ',');
+        if (!comma)
+            break;
+        text = comma + 1;
+    }
+    return o->nlevels > 0;
+}
+
+// Copia el archivo de entrada a un memfd: el servidor lo mapea sin tocar el disco (admite sellos:
+// el servidor solo mapea un descriptor que pueda sellar contra achicarse).
+static int make_input_memfd(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror("No se pudo abrir la entrada");
+        return -1;
+    }
+    int fd = memfd_create("bmp_loadtest_in", MFD_ALLOW_SEALING);
+    char buf[1 << 16];
+    size_t n;
+    while (fd >= 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        if (write(fd, buf, n) != (ssize_t)n)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    fclose(f);
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    LoadOpts o;
+    memset(&o, 0, sizeof(o));
+    o.ops = "gray";
+    o.out = "none";
+    o.requests = 400;
+    parse_levels("1,2,4,8", &o);
+    for (int a = 1; a < argc; ++a)
+    {
+        if (strncmp(argv[a], "--socket=", 9) == 0)
+            o.socket_path = argv[a] + 9;
+        else if (strncmp(argv[a], "--spawn=", 8) == 0)
+            o.spawn_bin = argv[a] + 8;
+        else if (strncmp(argv[a], "--input=", 8) == 0)
+            o.input = argv[a] + 8;
+        else if (strncmp(argv[a], "--ops=", 6) == 0)
+            o.ops = argv[a] + 6;
+        else if (strncmp(argv[a], "--out=", 6) == 0)
+            o.out = argv[a] + 6;
+        else if (strncmp(argv[a], "--json=", 7) == 0)
+            o.json = argv[a] + 7;
+        else if (strcmp(argv[a], "--fd") == 0)
+            o.use_fd = 1;
+        else if (strcmp(argv[a], "--shm") == 0)
+            o.use_shm = 1;
+        else if (strncmp(argv[a], "--requests=", 11) == 0)
+            o.requests = atoi(argv[a] + 11);
+        else if (strncmp(argv[a], "--concurrency=", 14) == 0 && parse_levels(argv[a] + 14, &o))
+        {
+        }
+        else
+        {
+            fprintf(stderr, "Argumento desconocido: %s\n", argv[a]);
+            return 1;
+        }
+    }
+    if (!o.input || (!o.socket_path == !o.spawn_bin) || o.requests < 1)
+    {
+        fprintf(stderr, "Uso: bmp_loadtest (--socket=ruta | --spawn=bmp_tool) --input=foto.bmp [opciones]\n");
+        return 1;
+    }
+    if (o.spawn_bin && (o.use_fd || strcmp(o.out, "fd") == 0 || strchr(o.ops, '+')))
+    {
+        fprintf(stderr, "Con --spawn solo hay una operacion, y entrada/salida por ruta o --shm.\n");
+        return 1;
+    }
+    Pixel24 *pixels = NULL;
+    if (o.use_shm)
+    {
+        BMPHeader fh;
+        BMPInfoHeader ih;
+        if (o.use_fd || !load_bmp24(o.input, &fh, &ih, &pixels))
+        {
+            fprintf(stderr, "--shm necesita una entrada BMP legible (y no va con --fd).\n");
+            return 1;
+        }
+        o.pixels = pixels;
+        o.width = ih.biWidth;
+        o.height = ih.biHeight;
+    }
+    int in_fd = o.use_fd ? make_input_memfd(o.input) : -1;
+    if (o.use_fd && in_fd < 0)
+        return 1;
+    FILE *jf = o.json ? fopen(o.json, "a") : NULL;
+
+    printf("%s: %s, trabajo \"%s\"%s, %d trabajos por nivel\n",
+           o.socket_path ? "servidor" : "un proceso por trabajo", o.socket_path ? o.socket_path : o.spawn_bin, o.ops,
+           o.use_shm ? " en segmento compartido" : (o.use_fd ? " con memfd" : ""), o.requests);
+    printf("%5s %7s %9s %9s %9s %9s %10s %6s\n", "hilos", "trab.", "p50 ms", "p90 ms", "p99 ms", "max ms",
+           "trab./s", "err");
+    int failed = 0;
+    for (int l = 0; l < o.nlevels; ++l)
+    {
+        int c = o.levels[l];
+        double *lat = (double *)malloc(sizeof(double) * (size_t)o.requests);
+        LoadWorker *w = (LoadWorker *)calloc((size_t)c, sizeof(LoadWorker));
+        pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)c);
+        if (!lat || !w || !tids)
+        {
+            fprintf(stderr, "Sin memoria para el nivel %d.\n", c);
+            return 1;
+        }
+        // Reparto de los trabajos: cada hilo escribe en su tramo de lat
+        int given = 0;
+        for (int i = 0; i < c; ++i)
+        {
+            w[i].o = &o;
+            w[i].in_fd = in_fd;
+            w[i].count = o.requests / c + (i < o.requests % c);
+            w[i].lat = lat + given;
+            given += w[i].count;
+        }
+        double t0 = now_seconds();
+        for (int i = 0; i < c; ++i)
+            pthread_create(&tids[i], NULL, load_worker, &w[i]);
+        int errors = 0;
+        for (int i = 0; i < c; ++i)
+        {
+            pthread_join(tids[i], NULL);
+            errors += w[i].errors;
+        }
+        double wall = now_seconds() - t0;
+        qsort(lat, (size_t)o.requests, sizeof(double), cmp_double);
+        double p50 = percentile(lat, o.requests, 0.50) * 1e3, p90 = percentile(lat, o.requests, 0.90) * 1e3;
+        double p99 = percentile(lat, o.requests, 0.99) * 1e3, mx = lat[o.requests - 1] * 1e3;
+        printf("%5d %7d %9.3f %9.3f %9.3f %9.3f %10.1f %6d\n", c, o.requests, p50, p90, p99, mx, o.requests / wall,
+               errors);
+        if (jf)
+        {
+            const char *transport = o.use_shm ? "shm" : (o.use_fd ? "memfd" : "path");
+            fprintf(jf,
+                    "{\"mode\": \"%s\", \"transport\": \"%s\", \"ops\": \"%s\", \"concurrency\": %d, "
+                    "\"requests\": %d, \"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f, "
+                    "\"jobs_per_s\": %.2f, \"errors\": %d}\n",
+                    o.socket_path ? "daemon" : "spawn", transport, o.ops, c, o.requests, p50, p90, p99, mx,
+                    o.requests / wall, errors);
+        }
+        failed |= errors != 0;
+        free(lat);
+        free(w);
+        free(tids);
+    }
+    if (jf)
+        fclose(jf);
+    if (in_fd >= 0)
+        close(in_fd);
+    bmp_free(pixels);
+    return failed ? 1 : 0;
+}
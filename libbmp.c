@@ -0,0 +1,5997 @@
+/* libbmp.c : Implementacion de libbmp (API y forma de compilar en libbmp.h).
+   Las rutas SIMD (SSE2, SSSE3, SSE4.1, AVX2, AVX-512BW) se eligen en tiempo de ejecucion con
+   cpu_dispatch_init(); no hace falta -march.
+*/
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L // clock_gettime con -std=c11
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // syscall (perf_event_open) con -std=c11
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT
+#endif
+
+#include "libbmp.h"
+
+#include <stdio.h>  // fopen, fread, fwrite, printf, scanf
+#include <stdlib.h> // malloc, free, exit
+#include <stdint.h> // uint8_t, uint16_t, uint32_t
+#include <stddef.h> // ptrdiff_t
+#include <string.h> // memset
+#include <math.h>   // pow, floor
+#include <time.h>    // clock_gettime
+#include <pthread.h> // pthread_create, pthread_join
+#include <sched.h>   // sched_yield
+#include <unistd.h>  // sysconf, read, syscall, ftruncate
+#include <fcntl.h>    // O_CREAT, O_RDWR (shm_open), O_DIRECT, posix_fadvise
+#include <errno.h>    // EINTR, EINVAL
+#include <sys/mman.h> // mmap, shm_open
+#include <sys/stat.h> // fstat
+#include <sys/resource.h> // getrusage (fallos de pagina en --stats)
+#if defined(__linux__)
+#include <linux/perf_event.h> // contadores de hardware para --stats
+#include <sys/syscall.h>      // __NR_perf_event_open
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define BMP_X86 1
+#include <immintrin.h> // SSE2 .. AVX-512BW; cada variante se compila con su atributo target
+#else
+#define BMP_X86 0
+#endif
+
+// Función para recortar un entero a [0,255]
+static inline uint8_t clamp_int_to_u8(int v)
+{
+    if (v < 0)
+        return 0;
+    if (v > 255)
+        return 255;
+    return (uint8_t)v;
+}
+
+// --- Memoria ---
+// Todos los bloques pasan por g_alloc: por defecto malloc/free, o el asignador del llamador.
+// Con BMP_HUGEPAGES=1 los bloques del tamano de una imagen (>= HUGE_MIN) del asignador por defecto
+// salen de mmap alineados a 2 MB con madvise(MADV_HUGEPAGE): el nucleo los llena con paginas
+// grandes, un fallo y una entrada de TLB por cada 2 MB en lugar de 512. BMP_HUGEPAGES=populate
+// ademas los llena al reservarlos (MADV_POPULATE_WRITE, o tocando una vez cada 2 MB si el nucleo
+// no lo tiene), salvo con BMP_NUMA: ahi cada nodo tiene que tocar primero sus filas.
+#define HUGE_PAGE (2u << 20)
+#define HUGE_MIN (8u << 20)
+#define HUGE_SLOTS 64 // bloques grandes vivos a la vez; los demas van por malloc
+
+typedef struct
+{
+    void *ptr; // NULL = libre
+    size_t len;
+} HugeBlock;
+
+static int g_huge_mode; // 0 apagado, 1 madvise, 2 madvise y llenado previo
+static int g_huge_live; // atomico: bloques en g_huge_blocks
+static HugeBlock g_huge_blocks[HUGE_SLOTS];
+static pthread_mutex_t g_huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_huge_once = PTHREAD_ONCE_INIT;
+
+static int numa_enabled(void);
+
+static void huge_init_once(void)
+{
+    const char *env = getenv("BMP_HUGEPAGES");
+    if (env && strcmp(env, "populate") == 0)
+        g_huge_mode = 2;
+    else if (env && atoi(env) > 0)
+        g_huge_mode = 1;
+}
+
+// Bloque de size bytes alineado a 2 MB, o NULL (el llamador sigue con malloc).
+static void *huge_alloc(size_t size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    size_t len = (size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    size_t map_len = len + HUGE_PAGE; // holgura para alinear
+    uint8_t *base = (uint8_t *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == (uint8_t *)MAP_FAILED)
+        return NULL;
+    uint8_t *p = (uint8_t *)(((uintptr_t)base + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (p > base)
+        munmap(base, (size_t)(p - base));
+    if (base + map_len > p + len)
+        munmap(p + len, (size_t)(base + map_len - (p + len)));
+    madvise(p, len, MADV_HUGEPAGE); // si THP esta apagado queda como un mmap comun
+
+    pthread_mutex_lock(&g_huge_lock);
+    int slot = -1;
+    for (int i = 0; i < HUGE_SLOTS && slot < 0; ++i)
+        if (!g_huge_blocks[i].ptr)
+            slot = i;
+    if (slot >= 0)
+    {
+        g_huge_blocks[slot].ptr = p;
+        g_huge_blocks[slot].len = len;
+        __atomic_fetch_add(&g_huge_live, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_huge_lock);
+    if (slot < 0)
+    {
+        munmap(p, len);
+        return NULL;
+    }
+
+    if (g_huge_mode == 2 && !numa_enabled())
+    {
+#if defined(MADV_POPULATE_WRITE)
+        if (madvise(p, len, MADV_POPULATE_WRITE) != 0)
+#endif
+            for (size_t off = 0; off < len; off += HUGE_PAGE)
+                p[off] = 0;
+    }
+    return p;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+// 1 si ptr era un bloque de huge_alloc (y ya se devolvio).
+static int huge_release(void *ptr)
+{
+    size_t len = 0;
+    pthread_mutex_lock(&g_huge_lock);
+    for (int i = 0; i < HUGE_SLOTS && !len; ++i)
+        if (g_huge_blocks[i].ptr == ptr)
+        {
+            len = g_huge_blocks[i].len;
+            g_huge_blocks[i].ptr = NULL;
+            __atomic_fetch_sub(&g_huge_live, 1, __ATOMIC_RELEASE);
+        }
+    pthread_mutex_unlock(&g_huge_lock);
+    if (len)
+        munmap(ptr, len);
+    return len != 0;
+}
+
+static void *default_alloc(size_t size, void *user)
+{
+    (void)user;
+    pthread_once(&g_huge_once, huge_init_once);
+    void *p = g_huge_mode && size >= HUGE_MIN ? huge_alloc(size) : NULL;
+    return p ? p : malloc(size);
+}
+
+static void default_release(void *ptr, void *user)
+{
+    (void)user;
+    if (__atomic_load_n(&g_huge_live, __ATOMIC_ACQUIRE) > 0 && huge_release(ptr))
+        return;
+    free(ptr);
+}
+
+static BmpAllocator g_alloc = {default_alloc, default_release, NULL};
+
+int libbmp_version(void)
+{
+    return LIBBMP_VERSION;
+}
+
+void bmp_set_allocator(const BmpAllocator *allocator)
+{
+    if (allocator && allocator->alloc && allocator->release)
+        g_alloc = *allocator;
+    else
+    {
+        g_alloc.alloc = default_alloc;
+        g_alloc.release = default_release;
+        g_alloc.user = NULL;
+    }
+}
+
+void *bmp_malloc(size_t size)
+{
+    return g_alloc.alloc(size ? size : 1, g_alloc.user);
+}
+
+void bmp_free(void *ptr)
+{
+    if (ptr)
+        g_alloc.release(ptr, g_alloc.user);
+}
+
+static void *bmp_calloc(size_t count, size_t size)
+{
+    if (size && count > (size_t)-1 / size)
+        return NULL;
+    void *p = bmp_malloc(count * size);
+    if (p)
+        memset(p, 0, count * size);
+    return p;
+}
+
+// --- Despacho de kernels por CPU ---
+// Los bucles internos se llaman a traves de g_kernels. La tabla arranca con las versiones
+// escalares y cpu_dispatch_init() la completa con las variantes del mejor nivel disponible
+// (o del forzado con --cpu=). Todas las variantes dan el mismo resultado, byte a byte.
+struct ColorMatrix;
+
+typedef struct
+{
+    int level;
+    void (*gray_bt601)(Pixel24 *pixels, size_t n);
+    void (*gray_bt709)(Pixel24 *pixels, size_t n);
+    void (*gray_bt2020)(Pixel24 *pixels, size_t n);
+    // n bytes BGR (multiplo de 3); uniform = las tres tablas son iguales
+    void (*lut_apply)(uint8_t *p, size_t n, const struct PointLUT *lut, int uniform);
+    // Interior (x = 1 .. width-2) de una fila de la convolucion 3x3; src apunta a la fila central
+    void (*conv3x3_row)(const uint8_t *src, uint8_t *dst, int width, const float *k, float sumk);
+    void (*minmax_rows)(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t n, int is_max);
+    void (*accum_u8_u16)(uint16_t *acc, const uint8_t *row, size_t n);
+    void (*unpack_bgr)(const Pixel24 *src, size_t n, uint8_t *b, uint8_t *g, uint8_t *r);
+    void (*pack_bgr)(const uint8_t *b, const uint8_t *g, const uint8_t *r, size_t n, Pixel24 *dst);
+    void (*color_matrix)(const struct ColorMatrix *cm, const uint8_t *i0, const uint8_t *i1, const uint8_t *i2,
+                         uint8_t *o0, uint8_t *o1, uint8_t *o2, size_t n);
+} KernelTable;
+
+extern KernelTable g_kernels;
+
+// Numero de hilos de trabajo: BMP_THREADS si esta definida, si no los nucleos en linea. Se lee
+// una sola vez (getenv + sysconf cuestan unos microsegundos y esto se consulta en cada run_bands);
+// para cambiarlo despues, bmp_set_num_threads.
+static int g_num_threads; // atomico; 0 = aun sin leer
+
+static int clamp_threads(int n)
+{
+    return n < 1 ? 1 : (n > 256 ? 256 : n);
+}
+
+int bmp_num_threads(void)
+{
+    int n = __atomic_load_n(&g_num_threads, __ATOMIC_RELAXED);
+    if (n > 0)
+        return n;
+    const char *env = getenv("BMP_THREADS");
+    n = clamp_threads(env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    __atomic_store_n(&g_num_threads, n, __ATOMIC_RELAXED); // varios hilos a la vez leen lo mismo
+    return n;
+}
+
+// n <= 0 vuelve a leer BMP_THREADS en la proxima consulta. El planificador ajusta su conjunto de
+// hilos en la proxima operacion.
+void bmp_set_num_threads(int n)
+{
+    __atomic_store_n(&g_num_threads, n > 0 ? clamp_threads(n) : 0, __ATOMIC_RELAXED);
+}
+
+// Reloj monotono en segundos (para las mediciones de rendimiento).
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Espera activa corta, luego ceder la CPU y por ultimo dormir: con menos nucleos que hilos (o con
+// la etapa esperada bloqueada en el disco) girar solo quitaria tiempo a quien hay que esperar.
+static void sched_backoff(int *spins)
+{
+    int n = (*spins)++;
+    if (n < 64)
+    {
+#if BMP_X86
+        _mm_pause();
+#endif
+    }
+    else if (n < 128)
+        sched_yield();
+    else
+    {
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = 50000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+// Cola acotada sin locks, varios productores y varios consumidores (esquema de D. Vyukov): cada
+// celda lleva un numero de secuencia que dice si esta libre para la vuelta actual del productor
+// o ya tiene dato para la del consumidor; cada lado reserva su posicion con un CAS.
+typedef struct
+{
+    size_t seq;
+    intptr_t value; // tareas del planificador
+} MpmcCell;
+
+typedef struct
+{
+    MpmcCell *cells;
+    size_t mask;
+    char pad0[64];
+    size_t tail; // proxima posicion a escribir
+    char pad1[64];
+    size_t head; // proxima posicion a leer
+    char pad2[64];
+} MpmcQueue;
+
+static int mpmc_queue_init(MpmcQueue *q, size_t capacity)
+{
+    size_t cap = 2;
+    while (cap < capacity)
+        cap <<= 1;
+    memset(q, 0, sizeof(*q));
+    q->cells = (MpmcCell *)bmp_malloc(cap * sizeof(MpmcCell));
+    if (!q->cells)
+        return 0;
+    for (size_t i = 0; i < cap; ++i)
+        q->cells[i].seq = i;
+    q->mask = cap - 1;
+    return 1;
+}
+
+static int mpmc_queue_push(MpmcQueue *q, intptr_t value)
+{
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        MpmcCell *c = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)pos;
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                c->value = value;
+                __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (dif < 0)
+            return 0; // llena
+        else
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+}
+
+static int mpmc_queue_pop(MpmcQueue *q, intptr_t *value)
+{
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        MpmcCell *c = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *value = c->value;
+                __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (dif < 0)
+            return 0; // vacia
+        else
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+}
+
+// --- Topologia NUMA (opcional) ---
+// BMP_NUMA=1 lee los nodos de /sys/devices/system/node; BMP_NUMA=sim:N reparte las CPU permitidas
+// en N nodos contiguos (para probar la colocacion en una maquina de un solo nodo). Encendida, cada
+// hilo del planificador queda fijado a las CPU de su nodo, las teselas que encola un hilo externo
+// tienen como nodo de casa el de sus filas y los buffers de imagen nuevos se tocan primero desde
+// ese nodo: el nucleo pone cada pagina en el nodo del hilo que la escribe primero. Apagada (por
+// defecto) el planificador se comporta igual que sin esta seccion.
+#define NUMA_MAX_NODES 16
+#define NUMA_TOUCH_MIN (1u << 20) // buffers mas chicos no se reparten
+
+typedef struct
+{
+    int enabled;
+    int simulated;
+    int nnodes;
+    size_t page;
+#if defined(__linux__)
+    cpu_set_t cpus[NUMA_MAX_NODES];
+#endif
+    uint64_t local, remote; // atomicos: teselas ejecutadas en su nodo de casa / en otro
+} NumaTopology;
+
+static NumaTopology g_numa;
+static pthread_once_t g_numa_once = PTHREAD_ONCE_INIT;
+
+#if defined(__linux__)
+// "0-3,8-11" -> conjunto de CPU; devuelve cuantas tiene.
+static int numa_parse_cpulist(const char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*s && *s != '\n')
+    {
+        char *end;
+        long a = strtol(s, &end, 10), b = a;
+        if (end == s)
+            break;
+        if (*end == '-')
+        {
+            s = end + 1;
+            b = strtol(s, &end, 10);
+            if (end == s)
+                break;
+        }
+        for (long c = a; c <= b && c < CPU_SETSIZE; ++c)
+            CPU_SET((int)c, set);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(set);
+}
+#endif
+
+static void numa_init_once(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    g_numa.page = page > 0 ? (size_t)page : 4096;
+#if defined(__linux__)
+    const char *env = getenv("BMP_NUMA");
+    cpu_set_t allowed;
+    if (!env || !*env || strcmp(env, "0") == 0 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    int ncpu = CPU_COUNT(&allowed), n = 0;
+    if (strncmp(env, "sim:", 4) == 0)
+    {
+        n = atoi(env + 4);
+        if (n < 1)
+            n = 1;
+        if (n > NUMA_MAX_NODES)
+            n = NUMA_MAX_NODES;
+        for (int k = 0; k < n; ++k)
+            CPU_ZERO(&g_numa.cpus[k]);
+        for (int c = 0, i = 0; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &allowed))
+                CPU_SET(c, &g_numa.cpus[(int)((int64_t)i++ * n / ncpu)]);
+        // Con menos CPU que nodos, los nodos vacios usan todas
+        for (int k = 0; k < n; ++k)
+            if (CPU_COUNT(&g_numa.cpus[k]) == 0)
+                g_numa.cpus[k] = allowed;
+        g_numa.simulated = 1;
+    }
+    else
+    {
+        for (int id = 0; id < 1024 && n < NUMA_MAX_NODES; ++id)
+        {
+            char path[64], list[4096];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            FILE *f = fopen(path, "r");
+            if (!f)
+                continue;
+            int got = fgets(list, sizeof(list), f) != NULL;
+            fclose(f);
+            if (!got || numa_parse_cpulist(list, &g_numa.cpus[n]) == 0)
+                continue;
+            CPU_AND(&g_numa.cpus[n], &g_numa.cpus[n], &allowed);
+            if (CPU_COUNT(&g_numa.cpus[n]) > 0) // nodos solo de memoria o fuera de la afinidad: no
+                n++;
+        }
+        if (n == 0)
+        {
+            fprintf(stderr, "BMP_NUMA: no se pudo leer la topologia; se sigue sin NUMA.\n");
+            return;
+        }
+    }
+    g_numa.nnodes = n;
+    g_numa.enabled = 1;
+#endif
+}
+
+static int numa_enabled(void)
+{
+    pthread_once(&g_numa_once, numa_init_once);
+    return g_numa.enabled;
+}
+
+// Nodo de la CPU donde corre el hilo (0 si no se sabe).
+static int numa_current_node(void)
+{
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+    for (int k = 0; cpu >= 0 && k < g_numa.nnodes; ++k)
+        if (CPU_ISSET(cpu, &g_numa.cpus[k]))
+            return k;
+#endif
+    return 0;
+}
+
+static void numa_pin_thread(int node)
+{
+#if defined(__linux__)
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &g_numa.cpus[node]);
+#else
+    (void)node;
+#endif
+}
+
+// Nodo de casa de las filas [y0, y1) de una imagen de height filas: se reparte en franjas contiguas.
+static int numa_home_node(int height, int y0, int y1)
+{
+    return (int)(((int64_t)y0 + y1) / 2 * g_numa.nnodes / height);
+}
+
+// --- Planificador con robo de trabajo ---
+// Un conjunto unico de hilos (bmp_num_threads() - 1: el que falta es el hilo que espera) ejecuta
+// todas las tareas de la biblioteca. Cada hilo que encola tiene su cola de Chase-Lev: el dueno mete
+// y saca por abajo sin locks (LIFO: lo recien encolado sigue en cache) y los demas roban por arriba
+// con un CAS. Las operaciones se parten en mas teselas que hilos, asi una tesela cara no deja a los
+// demas ociosos como el reparto fijo en una banda por hilo. Quien espera un grupo ejecuta tareas
+// mientras tanto, por eso se pueden anidar (imagenes de un lote que a su vez reparten filas).
+// Con NUMA cada nodo tiene ademas un buzon (cola MPMC) para las teselas que un hilo externo encola
+// con casa en ese nodo, y al robar se prueba primero el propio nodo.
+#define SCHED_DEQUE_CAP 4096 // potencia de 2; con la cola llena la tarea corre en el acto
+#define SCHED_MAX_DEQUES 512 // hilos del conjunto mas hilos externos que encolan
+#define SCHED_TILES_PER_THREAD 4
+#define SCHED_SPINS 128 // vueltas sin trabajo antes de dormir
+
+typedef struct
+{
+    int64_t top; // lo mueven los ladrones
+    char pad0[56];
+    int64_t bottom; // solo lo mueve el dueno
+    char pad1[56];
+    BmpTask **buf; // se reserva la primera vez y se conserva al liberar la cola
+    int in_use;    // atomico: la cola tiene dueno
+    int node;      // atomico: nodo NUMA del dueno (0 sin NUMA)
+    int worker;    // el dueno es un hilo del conjunto (solo lo lee el dueno)
+    int depth;     // tareas que el dueno esta ejecutando (solo el dueno)
+} SchedDeque;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;   // hilos activos sin trabajo
+    pthread_cond_t parked; // hilos de mas tras bajar BMP_THREADS
+    pthread_key_t key;     // SchedDeque del hilo actual
+    int nworkers;          // hilos creados (bajo lock)
+    int active;            // atomico: cuantos de ellos toman tareas
+    int ndeques;           // atomico: colas a recorrer al robar
+    int sleepers;          // atomico, cambia bajo lock
+    unsigned epoch;        // atomico: sube con cada tarea encolada
+    SchedDeque deques[SCHED_MAX_DEQUES];
+    MpmcQueue inbox[NUMA_MAX_NODES]; // solo con NUMA
+} Scheduler;
+
+static Scheduler g_sched;
+static pthread_once_t g_sched_once = PTHREAD_ONCE_INIT;
+
+static int sched_deque_push(SchedDeque *d, BmpTask *t)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    if (b - __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= SCHED_DEQUE_CAP)
+        return 0;
+    __atomic_store_n(&d->buf[b & (SCHED_DEQUE_CAP - 1)], t, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE); // publica la tarea a los ladrones
+    return 1;
+}
+
+static BmpTask *sched_deque_take(SchedDeque *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    BmpTask *task = NULL;
+    if (t <= b)
+    {
+        task = __atomic_load_n(&d->buf[b & (SCHED_DEQUE_CAP - 1)], __ATOMIC_RELAXED);
+        if (t == b)
+        {
+            // Ultima tarea: se la disputa con los ladrones
+            if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                task = NULL;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return task;
+}
+
+static BmpTask *sched_deque_steal(SchedDeque *d)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+    BmpTask *task = __atomic_load_n(&d->buf[t & (SCHED_DEQUE_CAP - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL; // se la llevo otro
+    return task;
+}
+
+static void stats_thread_attach(SchedDeque *d);
+static void stats_thread_detach(SchedDeque *d);
+
+// Al terminar un hilo externo su cola (ya vacia) queda libre para otro.
+static void sched_release_deque(void *arg)
+{
+    stats_thread_detach((SchedDeque *)arg);
+    __atomic_store_n(&((SchedDeque *)arg)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void sched_init_once(void)
+{
+    pthread_mutex_init(&g_sched.lock, NULL);
+    pthread_cond_init(&g_sched.wake, NULL);
+    pthread_cond_init(&g_sched.parked, NULL);
+    pthread_key_create(&g_sched.key, sched_release_deque);
+    for (int k = 0; numa_enabled() && k < g_numa.nnodes; ++k)
+        if (!mpmc_queue_init(&g_sched.inbox[k], SCHED_DEQUE_CAP))
+        {
+            fprintf(stderr, "BMP_NUMA: sin memoria para los buzones; se sigue sin NUMA.\n");
+            g_numa.enabled = 0;
+        }
+}
+
+// Cola del hilo actual; la primera vez toma una libre. NULL si no quedan: sus tareas corren en el acto.
+static SchedDeque *sched_my_deque(void)
+{
+    pthread_once(&g_sched_once, sched_init_once);
+    SchedDeque *d = (SchedDeque *)pthread_getspecific(g_sched.key);
+    if (d)
+        return d;
+    for (int i = 0; i < SCHED_MAX_DEQUES; ++i)
+    {
+        d = &g_sched.deques[i];
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&d->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        if (!d->buf)
+        {
+            BmpTask **buf = (BmpTask **)calloc(SCHED_DEQUE_CAP, sizeof(BmpTask *));
+            if (!buf)
+            {
+                sched_release_deque(d);
+                return NULL;
+            }
+            __atomic_store_n(&d->buf, buf, __ATOMIC_RELEASE);
+        }
+        int n = __atomic_load_n(&g_sched.ndeques, __ATOMIC_RELAXED);
+        while (n < i + 1 &&
+               !__atomic_compare_exchange_n(&g_sched.ndeques, &n, i + 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+        d->worker = 0;
+        d->depth = 0;
+        __atomic_store_n(&d->node, g_numa.enabled ? numa_current_node() : 0, __ATOMIC_RELAXED);
+        pthread_setspecific(g_sched.key, d);
+        return d;
+    }
+    return NULL;
+}
+
+static BmpTask *sched_inbox_pop(int node)
+{
+    intptr_t v;
+    return mpmc_queue_pop(&g_sched.inbox[node], &v) ? (BmpTask *)v : NULL;
+}
+
+// Primero la cola propia; si esta vacia se roba de las demas empezando por una al azar. Con NUMA
+// el orden es: cola propia, buzon del nodo, colas del nodo y recien entonces buzones y colas de los
+// otros nodos (asi una tesela solo cruza de nodo si en el suyo nadie la toma).
+static BmpTask *sched_find(SchedDeque *me, unsigned *seed)
+{
+    BmpTask *t = me ? sched_deque_take(me) : NULL;
+    int n = __atomic_load_n(&g_sched.ndeques, __ATOMIC_ACQUIRE);
+    if (t || n == 0)
+        return t;
+    int numa = g_numa.enabled;
+    int node = me ? __atomic_load_n(&me->node, __ATOMIC_RELAXED) : 0;
+    if (numa && (t = sched_inbox_pop(node)) != NULL)
+        return t;
+    *seed = *seed * 1103515245u + 12345u;
+    int start = (int)((*seed >> 16) % (unsigned)n);
+    for (int pass = 0; pass <= numa && !t; ++pass)
+    {
+        for (int k = 1; pass == 1 && k < g_numa.nnodes && !t; ++k)
+            t = sched_inbox_pop((node + k) % g_numa.nnodes);
+        for (int i = 0; i < n && !t; ++i)
+        {
+            SchedDeque *d = &g_sched.deques[(start + i) % n];
+            if (d != me && __atomic_load_n(&d->buf, __ATOMIC_ACQUIRE) &&
+                (!numa || (__atomic_load_n(&d->node, __ATOMIC_RELAXED) == node) == (pass == 0)))
+                t = sched_deque_steal(d);
+        }
+    }
+    return t;
+}
+
+static void sched_run(BmpTask *t)
+{
+    BmpTaskGroup *g = t->group; // t puede dejar de existir cuando el grupo llega a 0
+    SchedDeque *d = (SchedDeque *)pthread_getspecific(g_sched.key);
+    stats_thread_attach(d); // hilos creados antes de --stats abren sus contadores aqui
+    if (d)
+        d->depth++;
+    t->run(t);
+    if (d)
+        d->depth--;
+    __atomic_fetch_sub(&g->pending, 1, __ATOMIC_ACQ_REL);
+}
+
+static void *sched_worker_main(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    SchedDeque *me = sched_my_deque();
+    if (me)
+        me->worker = 1;
+    if (me && g_numa.enabled)
+    {
+        // Los hilos se reparten entre los nodos por turno y cada uno queda en las CPU del suyo
+        __atomic_store_n(&me->node, id % g_numa.nnodes, __ATOMIC_RELAXED);
+        numa_pin_thread(id % g_numa.nnodes);
+    }
+    unsigned seed = 2654435761u * (unsigned)(id + 1);
+    int spins = 0;
+    for (;;)
+    {
+        unsigned epoch = __atomic_load_n(&g_sched.epoch, __ATOMIC_SEQ_CST);
+        int active = id < __atomic_load_n(&g_sched.active, __ATOMIC_RELAXED);
+        BmpTask *t = active ? sched_find(me, &seed) : NULL;
+        if (t)
+        {
+            sched_run(t);
+            spins = 0;
+            continue;
+        }
+        if (active && spins < SCHED_SPINS)
+        {
+            sched_backoff(&spins);
+            continue;
+        }
+        // Dormir hasta la proxima tarea: quien encola ve sleepers > 0 o este hilo ve otra epoca
+        pthread_mutex_lock(&g_sched.lock);
+        if (id >= __atomic_load_n(&g_sched.active, __ATOMIC_RELAXED))
+            pthread_cond_wait(&g_sched.parked, &g_sched.lock);
+        else
+        {
+            __atomic_fetch_add(&g_sched.sleepers, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&g_sched.epoch, __ATOMIC_SEQ_CST) == epoch)
+                pthread_cond_wait(&g_sched.wake, &g_sched.lock);
+            __atomic_fetch_sub(&g_sched.sleepers, 1, __ATOMIC_SEQ_CST);
+        }
+        pthread_mutex_unlock(&g_sched.lock);
+        spins = 0;
+    }
+    return NULL;
+}
+
+// Ajusta el conjunto a bmp_num_threads() - 1 hilos: crea los que falten y aparca los de mas.
+static void sched_start(void)
+{
+    pthread_once(&g_sched_once, sched_init_once);
+    int want = bmp_num_threads() - 1;
+    if (want == __atomic_load_n(&g_sched.active, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&g_sched.lock);
+    while (g_sched.nworkers < want)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, sched_worker_main, (void *)(intptr_t)g_sched.nworkers) != 0)
+            break; // se sigue con los que haya
+        pthread_detach(tid);
+        g_sched.nworkers++;
+    }
+    __atomic_store_n(&g_sched.active, want < g_sched.nworkers ? want : g_sched.nworkers, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&g_sched.parked);
+    pthread_mutex_unlock(&g_sched.lock);
+}
+
+// Teselas para repartir n filas (o bloques): varias por hilo para equilibrar la carga.
+static int sched_tiles(int n)
+{
+    int threads = bmp_num_threads();
+    int tiles = threads > 1 ? threads * SCHED_TILES_PER_THREAD : 1;
+    return tiles < n ? tiles : (n > 0 ? n : 1);
+}
+
+// 1 si el hilo actual es del conjunto o esta ejecutando una tarea (p. ej. el hilo principal que
+// ayuda con una imagen de un lote): sus teselas se quedan en su nodo.
+static int sched_in_task(void)
+{
+    pthread_once(&g_sched_once, sched_init_once);
+    SchedDeque *d = (SchedDeque *)pthread_getspecific(g_sched.key);
+    return d && (d->worker || d->depth > 0);
+}
+
+// Nodo del hilo actual para el planificador.
+static int sched_node(void)
+{
+    SchedDeque *d = sched_my_deque();
+    return d ? __atomic_load_n(&d->node, __ATOMIC_RELAXED) : numa_current_node();
+}
+
+// 1 si las teselas que lance el hilo actual deben repartirse por nodo segun sus filas: con NUMA y
+// desde un hilo externo (que puede haber cambiado de CPU desde la ultima vez).
+static int sched_spread_rows(void)
+{
+    if (!numa_enabled() || sched_in_task())
+        return 0;
+    SchedDeque *d = sched_my_deque();
+    if (d)
+        __atomic_store_n(&d->node, numa_current_node(), __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Cuenta una tesela con casa en home ejecutada por el hilo actual (resumen de --stats).
+static void numa_count(int home)
+{
+    __atomic_fetch_add(sched_node() == home ? &g_numa.local : &g_numa.remote, 1, __ATOMIC_RELAXED);
+}
+
+// Encola t; con NUMA y node >= 0 de otro nodo va al buzon de ese nodo.
+static void sched_spawn_on(BmpTaskGroup *g, BmpTask *t, int node)
+{
+    sched_start();
+    t->group = g;
+    __atomic_fetch_add(&g->pending, 1, __ATOMIC_RELAXED);
+    SchedDeque *d = sched_my_deque();
+    int queued = 0;
+    if (g_numa.enabled && node >= 0 && (!d || node != __atomic_load_n(&d->node, __ATOMIC_RELAXED)))
+        queued = mpmc_queue_push(&g_sched.inbox[node], (intptr_t)t);
+    if (!queued && (!d || !sched_deque_push(d, t)))
+    {
+        sched_run(t);
+        return;
+    }
+    __atomic_fetch_add(&g_sched.epoch, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_sched.sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        // Lo de un buzon lo debe ver un hilo de ese nodo: se despiertan todos
+        pthread_mutex_lock(&g_sched.lock);
+        if (queued)
+            pthread_cond_broadcast(&g_sched.wake);
+        else
+            pthread_cond_signal(&g_sched.wake);
+        pthread_mutex_unlock(&g_sched.lock);
+    }
+}
+
+void bmp_task_spawn(BmpTaskGroup *g, BmpTask *t)
+{
+    sched_spawn_on(g, t, -1);
+}
+
+int bmp_task_help(void)
+{
+    unsigned seed = (unsigned)(uintptr_t)&seed;
+    BmpTask *t = sched_find(sched_my_deque(), &seed);
+    if (t)
+        sched_run(t);
+    return t != NULL;
+}
+
+int bmp_task_pending(const BmpTaskGroup *g)
+{
+    return __atomic_load_n(&g->pending, __ATOMIC_ACQUIRE);
+}
+
+void bmp_task_wait(BmpTaskGroup *g)
+{
+    int spins = 0;
+    while (bmp_task_pending(g) > 0)
+    {
+        if (bmp_task_help())
+            spins = 0;
+        else
+            sched_backoff(&spins);
+    }
+}
+
+// --- Paralelismo por bandas de filas ---
+// Cada banda recibe su indice para poder dejar resultados parciales que luego se reducen.
+typedef void (*BandFn)(void *ctx, int band, int y0, int y1);
+
+typedef struct
+{
+    BmpTask task;
+    BandFn fn;
+    void *ctx;
+    int band, y0, y1;
+    int node; // nodo de casa; -1 sin NUMA
+} BandTask;
+
+static void band_task_run(BmpTask *t)
+{
+    BandTask *bt = (BandTask *)t;
+    if (bt->node >= 0)
+        numa_count(bt->node);
+    bt->fn(bt->ctx, bt->band, bt->y0, bt->y1);
+}
+
+// Divide [0, height) en nbands bandas contiguas y las ejecuta como tareas del planificador. La
+// banda 0 corre en el hilo llamador, que despues ayuda con las que sigan en cola. Con NUMA y un
+// llamador externo cada banda va al nodo de sus filas y el llamador solo ayuda; desde un hilo del
+// conjunto todas quedan en su nodo (p. ej. las filas de una imagen de un lote).
+void run_bands(int height, int nbands, BandFn fn, void *ctx)
+{
+    if (nbands > height)
+        nbands = height;
+    BandTask *tasks = nbands > 1 ? (BandTask *)bmp_malloc(sizeof(BandTask) * (size_t)nbands) : NULL;
+    if (!tasks)
+    {
+        if (height > 0)
+            fn(ctx, 0, 0, height);
+        return;
+    }
+
+    BmpTaskGroup group;
+    group.pending = 0;
+    int spread = sched_spread_rows();
+    int home = numa_enabled() && !spread ? sched_node() : -1;
+    // Al reves: el llamador saca de abajo la banda 1 y los ladrones se llevan las del final
+    for (int b = nbands - 1; b >= 0; --b)
+    {
+        tasks[b].task.run = band_task_run;
+        tasks[b].fn = fn;
+        tasks[b].ctx = ctx;
+        tasks[b].band = b;
+        tasks[b].y0 = (int)((int64_t)height * b / nbands);
+        tasks[b].y1 = (int)((int64_t)height * (b + 1) / nbands);
+        tasks[b].node = spread ? numa_home_node(height, tasks[b].y0, tasks[b].y1) : home;
+        if (spread)
+            sched_spawn_on(&group, &tasks[b].task, tasks[b].node);
+        else if (b > 0)
+            bmp_task_spawn(&group, &tasks[b].task);
+    }
+    if (!spread)
+        band_task_run(&tasks[0].task);
+    bmp_task_wait(&group);
+    bmp_free(tasks);
+}
+
+// Dos pasadas por teselas con dependencias: la tesela j de la segunda lee las filas
+// [y0 - halo, y1 + halo) que escribio la primera y arranca en cuanto terminan las teselas que las
+// cubren, sin barrera entre pasadas. La segunda puede escribir lo que leyo la primera en sus filas.
+typedef struct HaloRun HaloRun;
+
+typedef struct
+{
+    BmpTask task;
+    HaloRun *run;
+    int stage, tile;
+    int deps; // atomico: teselas de la primera pasada que faltan
+} HaloTask;
+
+struct HaloRun
+{
+    BandFn fn[2];
+    void *ctx[2];
+    int height, ntiles, halo;
+    int spread, home; // como en run_bands: casa segun las filas, o home (-1 sin NUMA)
+    HaloTask *tasks;  // ntiles de la primera pasada y luego ntiles de la segunda
+    BmpTaskGroup group;
+};
+
+static int halo_tile_y(const HaloRun *hr, int t)
+{
+    return (int)((int64_t)hr->height * t / hr->ntiles);
+}
+
+static int halo_tile_node(const HaloRun *hr, int t)
+{
+    return hr->spread ? numa_home_node(hr->height, halo_tile_y(hr, t), halo_tile_y(hr, t + 1)) : hr->home;
+}
+
+// 1 si la tesela j de la segunda pasada lee filas de la tesela i de la primera. Para un j dado
+// las i que cumplen son contiguas alrededor de j (y al reves).
+static int halo_reads(const HaloRun *hr, int j, int i)
+{
+    return halo_tile_y(hr, j) - hr->halo < halo_tile_y(hr, i + 1) &&
+           halo_tile_y(hr, j + 1) + hr->halo > halo_tile_y(hr, i);
+}
+
+static void halo_task_run(BmpTask *t)
+{
+    HaloTask *ht = (HaloTask *)t;
+    HaloRun *hr = ht->run;
+    int i = ht->tile;
+    if (hr->home >= 0 || hr->spread)
+        numa_count(halo_tile_node(hr, i));
+    hr->fn[ht->stage](hr->ctx[ht->stage], i, halo_tile_y(hr, i), halo_tile_y(hr, i + 1));
+    if (ht->stage == 1)
+        return;
+    for (int dir = -1; dir <= 1; dir += 2)
+    {
+        for (int j = dir < 0 ? i : i + 1; j >= 0 && j < hr->ntiles && halo_reads(hr, j, i); j += dir)
+        {
+            HaloTask *next = &hr->tasks[hr->ntiles + j];
+            if (__atomic_fetch_sub(&next->deps, 1, __ATOMIC_ACQ_REL) == 1)
+                sched_spawn_on(&hr->group, &next->task, hr->spread ? halo_tile_node(hr, j) : -1);
+        }
+    }
+}
+
+static void run_bands_halo(int height, int ntiles, BandFn fn1, void *ctx1, BandFn fn2, void *ctx2, int halo)
+{
+    if (ntiles > height)
+        ntiles = height;
+    HaloTask *tasks = ntiles > 1 ? (HaloTask *)bmp_malloc(sizeof(HaloTask) * 2 * (size_t)ntiles) : NULL;
+    if (!tasks)
+    {
+        if (height > 0)
+        {
+            fn1(ctx1, 0, 0, height);
+            fn2(ctx2, 0, 0, height);
+        }
+        return;
+    }
+
+    HaloRun hr;
+    hr.fn[0] = fn1;
+    hr.fn[1] = fn2;
+    hr.ctx[0] = ctx1;
+    hr.ctx[1] = ctx2;
+    hr.height = height;
+    hr.ntiles = ntiles;
+    hr.halo = halo;
+    hr.spread = sched_spread_rows();
+    hr.home = numa_enabled() && !hr.spread ? sched_node() : -1;
+    hr.tasks = tasks;
+    hr.group.pending = 0;
+    for (int k = 0; k < 2 * ntiles; ++k)
+    {
+        HaloTask *ht = &tasks[k];
+        ht->task.run = halo_task_run;
+        ht->run = &hr;
+        ht->stage = k / ntiles;
+        ht->tile = k % ntiles;
+        ht->deps = 0;
+        if (ht->stage == 0)
+            continue;
+        for (int dir = -1; dir <= 1; dir += 2)
+            for (int i = dir < 0 ? ht->tile : ht->tile + 1; i >= 0 && i < ntiles && halo_reads(&hr, ht->tile, i);
+                 i += dir)
+                ht->deps++;
+    }
+    for (int t = ntiles - 1; t >= 0; --t)
+        sched_spawn_on(&hr.group, &tasks[t].task, hr.spread ? halo_tile_node(&hr, t) : -1);
+    bmp_task_wait(&hr.group);
+    bmp_free(tasks);
+}
+
+// Con NUMA y un llamador externo, las paginas de un buffer nuevo de rows filas de row_bytes se
+// escriben primero desde el nodo de casa de sus filas (las mismas franjas que run_bands), asi
+// quedan donde luego se procesan aunque el llenado lo haga un solo hilo. Cada pagina la toca una
+// sola tesela: la que contiene su comienzo. Solo sirve con paginas que el proceso aun no toco (un
+// bloque que malloc recicla queda donde estaba); desde un hilo del conjunto no hace falta.
+typedef struct
+{
+    uint8_t *p;
+    size_t row_bytes;
+} TouchJob;
+
+static void numa_touch_band(void *ctx, int band, int y0, int y1)
+{
+    TouchJob *job = (TouchJob *)ctx;
+    (void)band;
+    size_t a = (size_t)y0 * job->row_bytes, b = (size_t)y1 * job->row_bytes;
+    uintptr_t base = (uintptr_t)job->p;
+    uintptr_t first = (base + a + g_numa.page - 1) & ~(uintptr_t)(g_numa.page - 1);
+    if (y0 == 0)
+        job->p[0] = 0;
+    for (uintptr_t q = first; q < base + b; q += g_numa.page)
+        *(volatile uint8_t *)q = 0;
+}
+
+static void numa_first_touch(void *p, size_t row_bytes, int rows)
+{
+    if (!p || rows < 2 || row_bytes * (size_t)rows < NUMA_TOUCH_MIN || !sched_spread_rows())
+        return;
+    TouchJob job;
+    job.p = (uint8_t *)p;
+    job.row_bytes = row_bytes;
+    run_bands(rows, sched_tiles(rows), numa_touch_band, &job);
+}
+
+// --- Instrumentacion por etapas (--stats) ---
+// Las funciones publicas marcan su trabajo con stats_begin/stats_end. Apagada (por defecto) cada
+// etapa cuesta una comparacion contra g_stats.enabled. Encendida mide tiempo de pared, bytes
+// leidos/escritos, pixeles y fallos de pagina (getrusage: todo el proceso), y donde el kernel lo
+// permite ciclos, instrucciones, fallos de LLC y de dTLB con perf_event_open. Los contadores son
+// por hilo (los del conjunto no terminan nunca, asi que inherit no sumaria nada): cada dueno de
+// una cola del planificador abre los suyos y una etapa suma los de todos, igual que los fallos de
+// pagina son de todo el proceso. Las etapas anidadas (p. ej. convolve3x3 dentro de
+// filter_luma_only) se cuentan en ambas: los tiempos son inclusivos.
+#define STATS_MAX_STAGES 48
+#define STATS_HW_COUNTERS 4 // ciclos, instrucciones, fallos de LLC, fallos de dTLB (lecturas)
+
+typedef struct
+{
+    const char *name;
+    uint64_t calls, bytes_in, bytes_out, pixels, faults;
+    double seconds;
+    uint64_t hw[STATS_HW_COUNTERS];
+} StatsStage;
+
+typedef struct
+{
+    int enabled;
+    int hw_ok[STATS_HW_COUNTERS]; // 0 = contador no disponible
+    // Contadores del dueno de cada cola (validos si thread_open; -1 = ese no se pudo abrir) y lo
+    // que sumaron los hilos que ya terminaron. Todo bajo g_stats_lock.
+    int thread_fd[SCHED_MAX_DEQUES][STATS_HW_COUNTERS];
+    int thread_open[SCHED_MAX_DEQUES];
+    uint64_t hw_done[STATS_HW_COUNTERS];
+    int nstages;
+    StatsStage stages[STATS_MAX_STAGES];
+    FILE *jsonl; // NULL = tabla resumen al salir
+} StatsState;
+
+typedef struct
+{
+    int stage; // -1 = instrumentacion apagada
+    double t0;
+    uint64_t faults0;
+    uint64_t hw0[STATS_HW_COUNTERS];
+} StatsSpan;
+
+static StatsState g_stats;
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *const stats_hw_names[STATS_HW_COUNTERS] = {"cycles", "instructions", "llc_misses",
+                                                               "dtlb_misses"};
+
+#if defined(__linux__)
+static const uint32_t stats_hw_types[STATS_HW_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                           PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+static const uint64_t stats_hw_configs[STATS_HW_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+#endif
+
+// Contador de usuario del hilo que llama (en cualquier CPU); -1 si no se puede.
+static int stats_perf_open(int i)
+{
+#if defined(__linux__)
+    struct perf_event_attr pa;
+    memset(&pa, 0, sizeof(pa));
+    pa.size = sizeof(pa);
+    pa.type = stats_hw_types[i];
+    pa.config = stats_hw_configs[i];
+    pa.exclude_kernel = 1;
+    pa.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &pa, 0, -1, -1, 0);
+#else
+    (void)i;
+    return -1;
+#endif
+}
+
+static uint64_t stats_read_fd(int fd)
+{
+    uint64_t v = 0;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != (ssize_t)sizeof(v))
+        return 0;
+    return v;
+}
+
+// El hilo dueno de d abre sus contadores la primera vez que corre algo con --stats encendido.
+static void stats_thread_attach(SchedDeque *d)
+{
+    if (!g_stats.enabled || !d)
+        return;
+    int k = (int)(d - g_sched.deques);
+    if (__atomic_load_n(&g_stats.thread_open[k], __ATOMIC_ACQUIRE))
+        return;
+    int fd[STATS_HW_COUNTERS];
+    for (int i = 0; i < STATS_HW_COUNTERS; ++i)
+        fd[i] = g_stats.hw_ok[i] ? stats_perf_open(i) : -1;
+    pthread_mutex_lock(&g_stats_lock);
+    memcpy(g_stats.thread_fd[k], fd, sizeof(fd));
+    __atomic_store_n(&g_stats.thread_open[k], 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+// Al terminar el hilo su cuenta final pasa a hw_done y la cola queda lista para otro dueno.
+static void stats_thread_detach(SchedDeque *d)
+{
+    int k = (int)(d - g_sched.deques);
+    if (!__atomic_load_n(&g_stats.thread_open[k], __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&g_stats_lock);
+    for (int i = 0; i < STATS_HW_COUNTERS; ++i)
+    {
+        int fd = g_stats.thread_fd[k][i];
+        g_stats.hw_done[i] += stats_read_fd(fd);
+        if (fd >= 0)
+            close(fd);
+        g_stats.thread_fd[k][i] = -1;
+    }
+    __atomic_store_n(&g_stats.thread_open[k], 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+// Suma de todos los hilos; se llama con g_stats_lock tomado.
+static void stats_read_hw(uint64_t v[STATS_HW_COUNTERS])
+{
+    int n = __atomic_load_n(&g_sched.ndeques, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < STATS_HW_COUNTERS; ++i)
+    {
+        v[i] = g_stats.hw_done[i];
+        for (int k = 0; g_stats.hw_ok[i] && k < n; ++k)
+            if (g_stats.thread_open[k])
+                v[i] += stats_read_fd(g_stats.thread_fd[k][i]);
+    }
+}
+
+// Fallos de pagina (menores y mayores) del proceso hasta ahora.
+static uint64_t stats_read_faults(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return (uint64_t)ru.ru_minflt + (uint64_t)ru.ru_majflt;
+}
+
+static int stats_stage_index(const char *name)
+{
+    for (int i = 0; i < g_stats.nstages; ++i)
+        if (g_stats.stages[i].name == name || strcmp(g_stats.stages[i].name, name) == 0)
+            return i;
+    if (g_stats.nstages == STATS_MAX_STAGES)
+        return -1;
+    StatsStage *st = &g_stats.stages[g_stats.nstages];
+    memset(st, 0, sizeof(*st));
+    st->name = name;
+    return g_stats.nstages++;
+}
+
+static void stats_begin_slow(StatsSpan *sp, const char *name)
+{
+    stats_thread_attach(sched_my_deque()); // el hilo que llama tambien cuenta
+    pthread_mutex_lock(&g_stats_lock);
+    sp->stage = stats_stage_index(name);
+    stats_read_hw(sp->hw0);
+    pthread_mutex_unlock(&g_stats_lock);
+    sp->faults0 = stats_read_faults();
+    sp->t0 = now_seconds();
+}
+
+static void stats_end_slow(StatsSpan *sp, uint64_t bytes_in, uint64_t bytes_out, uint64_t pixels)
+{
+    double dt = now_seconds() - sp->t0;
+    uint64_t faults = stats_read_faults() - sp->faults0;
+    uint64_t hw[STATS_HW_COUNTERS];
+    pthread_mutex_lock(&g_stats_lock);
+    stats_read_hw(hw);
+    StatsStage *st = &g_stats.stages[sp->stage];
+    st->calls++;
+    st->seconds += dt;
+    st->bytes_in += bytes_in;
+    st->bytes_out += bytes_out;
+    st->pixels += pixels;
+    st->faults += faults;
+    for (int i = 0; i < STATS_HW_COUNTERS; ++i)
+        st->hw[i] += hw[i] - sp->hw0[i];
+    if (g_stats.jsonl)
+    {
+        fprintf(g_stats.jsonl,
+                "{\"stage\": \"%s\", \"pid\": %d, \"seconds\": %.9f, \"bytes_in\": %llu, \"bytes_out\": %llu, "
+                "\"pixels\": %llu, \"page_faults\": %llu",
+                st->name, (int)getpid(), dt, (unsigned long long)bytes_in, (unsigned long long)bytes_out,
+                (unsigned long long)pixels, (unsigned long long)faults);
+        for (int i = 0; i < STATS_HW_COUNTERS; ++i)
+        {
+            if (g_stats.hw_ok[i])
+                fprintf(g_stats.jsonl, ", \"%s\": %llu", stats_hw_names[i], (unsigned long long)(hw[i] - sp->hw0[i]));
+            else
+                fprintf(g_stats.jsonl, ", \"%s\": null", stats_hw_names[i]);
+        }
+        fprintf(g_stats.jsonl, "}\n");
+        fflush(g_stats.jsonl);
+    }
+    pthread_mutex_unlock(&g_stats_lock);
+}
+
+static inline void stats_begin(StatsSpan *sp, const char *name)
+{
+    sp->stage = -1;
+    if (g_stats.enabled)
+        stats_begin_slow(sp, name);
+}
+
+static inline void stats_end(StatsSpan *sp, uint64_t bytes_in, uint64_t bytes_out, uint64_t pixels)
+{
+    if (sp->stage >= 0)
+        stats_end_slow(sp, bytes_in, bytes_out, pixels);
+}
+
+// Etapa en el lugar sobre una imagen BGR de width x height: lee y escribe 3 bytes por pixel.
+static inline void stats_end_image(StatsSpan *sp, int width, int height)
+{
+    uint64_t n = (uint64_t)width * (uint64_t)height;
+    stats_end(sp, 3 * n, 3 * n, n);
+}
+
+// Tabla resumen (stderr) al terminar el proceso.
+static void stats_report(void)
+{
+    if (!g_stats.enabled || g_stats.jsonl || g_stats.nstages == 0)
+        return;
+    int hw = 0;
+    for (int i = 0; i < STATS_HW_COUNTERS; ++i)
+        hw |= g_stats.hw_ok[i];
+    fprintf(stderr, "\n%-22s %6s %11s %10s %10s %9s %8s %10s", "etapa", "llamad", "tiempo ms", "MB leidos",
+            "MB escr.", "MPix/s", "GB/s", "fallos pag");
+    if (hw)
+        fprintf(stderr, " %9s %6s %11s %12s", "ciclos/px", "IPC", "LLC miss/px", "dTLB miss/px");
+    fprintf(stderr, "\n");
+    for (int i = 0; i < g_stats.nstages; ++i)
+    {
+        const StatsStage *st = &g_stats.stages[i];
+        double s = st->seconds > 0.0 ? st->seconds : 1e-12;
+        double px = st->pixels ? (double)st->pixels : 1.0;
+        fprintf(stderr, "%-22s %6llu %11.3f %10.2f %10.2f %9.1f %8.2f %10llu", st->name,
+                (unsigned long long)st->calls, st->seconds * 1e3, st->bytes_in / 1e6, st->bytes_out / 1e6,
+                st->pixels / s / 1e6, (st->bytes_in + st->bytes_out) / s / 1e9, (unsigned long long)st->faults);
+        if (hw)
+        {
+            if (g_stats.hw_ok[0])
+                fprintf(stderr, " %9.2f", st->hw[0] / px);
+            else
+                fprintf(stderr, " %9s", "n/d");
+            if (g_stats.hw_ok[0] && g_stats.hw_ok[1] && st->hw[0])
+                fprintf(stderr, " %6.2f", (double)st->hw[1] / (double)st->hw[0]);
+            else
+                fprintf(stderr, " %6s", "n/d");
+            if (g_stats.hw_ok[2])
+                fprintf(stderr, " %11.4f", st->hw[2] / px);
+            else
+                fprintf(stderr, " %11s", "n/d");
+            if (g_stats.hw_ok[3])
+                fprintf(stderr, " %12.4f", st->hw[3] / px);
+            else
+                fprintf(stderr, " %12s", "n/d");
+        }
+        fprintf(stderr, "\n");
+    }
+    if (!hw)
+        fprintf(stderr, "(contadores de hardware no disponibles: perf_event_open fallo o no hay PMU)\n");
+    uint64_t local = __atomic_load_n(&g_numa.local, __ATOMIC_RELAXED);
+    uint64_t remote = __atomic_load_n(&g_numa.remote, __ATOMIC_RELAXED);
+    if (g_numa.enabled)
+        fprintf(stderr, "NUMA: %d nodos (%s), teselas en su nodo de casa: %llu de %llu (%.1f%%)\n", g_numa.nnodes,
+                g_numa.simulated ? "simulados" : "sysfs", (unsigned long long)local,
+                (unsigned long long)(local + remote), local + remote ? 100.0 * local / (local + remote) : 100.0);
+}
+
+// Activa la instrumentacion. jsonl_path != NULL agrega una linea JSON por etapa a ese archivo;
+// si no, se imprime la tabla resumen al salir.
+int stats_enable(const char *jsonl_path)
+{
+    if (g_stats.enabled)
+        return 1;
+    // Prueba de cada contador en este hilo; los de cada hilo se abren al usarlo
+    for (int i = 0; i < STATS_HW_COUNTERS; ++i)
+    {
+        int fd = stats_perf_open(i);
+        g_stats.hw_ok[i] = fd >= 0;
+        if (fd >= 0)
+            close(fd);
+    }
+    if (jsonl_path)
+    {
+        g_stats.jsonl = fopen(jsonl_path, "a");
+        if (!g_stats.jsonl)
+        {
+            fprintf(stderr, "No se pudo abrir %s para las estadisticas.\n", jsonl_path);
+            return 0;
+        }
+    }
+    g_stats.enabled = 1;
+    atexit(stats_report);
+    return 1;
+}
+
+// --- Lectura/escritura por filas (streaming) ---
+// Las filas se entregan y se reciben en el orden del archivo: de ABAJO hacia ARRIBA.
+// El nombre "-" es stdin/stdout: no se usa fseek, asi que sirve con tuberias y sockets.
+
+// Validaciones mínimas de formato (comunes a archivo y memoria)
+static int bmp_check_headers(const BMPHeader *fh, const BMPInfoHeader *ih)
+{
+    if (fh->bfType != 0x4D42)
+    { // 'BM'
+        fprintf(stderr, "No es un BMP valido (firma BM).\n");
+        return 0;
+    }
+    if (ih->biBitCount != 24 || ih->biCompression != 0)
+    {
+        fprintf(stderr, "Solo se soporta BMP 24-bpp sin compresion.\n");
+        return 0;
+    }
+    if (ih->biWidth <= 0 || ih->biHeight <= 0)
+    {
+        fprintf(stderr, "Solo se soportan dimensiones positivas.\n");
+        return 0;
+    }
+    if (fh->bfOffBits < sizeof(BMPHeader) + sizeof(BMPInfoHeader))
+    {
+        fprintf(stderr, "Offset de pixeles invalido.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Cabeceras de salida de un BMP 24bpp con las dimensiones de src_ih.
+static void bmp_make_headers24(const BMPInfoHeader *src_ih, BMPHeader *fh, BMPInfoHeader *ih, int *padding)
+{
+    int row_bytes = src_ih->biWidth * 3;
+    *padding = (4 - (row_bytes % 4)) % 4;
+    uint32_t image_size = (row_bytes + *padding) * (uint32_t)src_ih->biHeight;
+
+    *ih = *src_ih; // copiamos la info base
+    // Ajustamos campos de tamaño
+    ih->biSize = sizeof(BMPInfoHeader);
+    ih->biCompression = 0;
+    ih->biBitCount = 24;
+    ih->biPlanes = 1;
+    ih->biSizeImage = image_size;
+
+    fh->bfType = 0x4D42; // 'BM'
+    fh->bfOffBits = sizeof(BMPHeader) + sizeof(BMPInfoHeader);
+    fh->bfSize = fh->bfOffBits + image_size;
+    fh->bfReserved1 = 0;
+    fh->bfReserved2 = 0;
+}
+
+static FILE *bmp_open_output(const char *filename)
+{
+    if (strcmp(filename, "-") == 0)
+        return stdout;
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        perror("No se pudo crear el archivo");
+    return f;
+}
+
+// stdout no se cierra (puede seguir en uso); solo se vacia.
+static int bmp_close_output(FILE *f)
+{
+    if (f == stdout)
+        return fflush(f) == 0;
+    return fclose(f) == 0;
+}
+
+// Descarta n bytes del flujo leyendolos (vale para tuberias).
+static int bmp_skip_bytes(FILE *f, size_t n)
+{
+    uint8_t junk[256];
+    while (n)
+    {
+        size_t k = n < sizeof(junk) ? n : sizeof(junk);
+        if (fread(junk, 1, k, f) != k)
+            return 0;
+        n -= k;
+    }
+    return 1;
+}
+
+// Abre un BMP 24bpp sin compresion, valida las cabeceras y se posiciona en los pixeles.
+int bmp_reader_open(BMPReader *rd, const char *filename)
+{
+    FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    if (!f)
+    {
+        perror("No se pudo abrir el archivo");
+        return 0;
+    }
+
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    // Vamos al inicio de los datos de pixeles
+    if (fread(&fh, sizeof(fh), 1, f) != 1 || fread(&ih, sizeof(ih), 1, f) != 1 || !bmp_check_headers(&fh, &ih) ||
+        !bmp_skip_bytes(f, fh.bfOffBits - sizeof(fh) - sizeof(ih)))
+    {
+        if (f != stdin)
+            fclose(f);
+        return 0;
+    }
+
+    rd->f = f;
+    rd->fh = fh;
+    rd->ih = ih;
+    rd->width = ih.biWidth;
+    rd->height = ih.biHeight;
+    // Padding por fila (múltiplo de 4 bytes)
+    rd->padding = (4 - ((ih.biWidth * 3) % 4)) % 4;
+    rd->rows_done = 0;
+    return 1;
+}
+
+// Lee la siguiente fila del archivo (la primera es la de ABAJO de la imagen).
+int bmp_reader_next_row(BMPReader *rd, Pixel24 *row)
+{
+    if (rd->rows_done >= rd->height)
+        return 0;
+    if (fread(row, 3, (size_t)rd->width, rd->f) != (size_t)rd->width)
+    {
+        fprintf(stderr, "Lectura de fila incompleta.\n");
+        return 0;
+    }
+    // Saltamos el padding
+    if (rd->padding && !bmp_skip_bytes(rd->f, (size_t)rd->padding))
+    {
+        fprintf(stderr, "Lectura de fila incompleta.\n");
+        return 0;
+    }
+    rd->rows_done++;
+    return 1;
+}
+
+void bmp_reader_close(BMPReader *rd)
+{
+    if (rd->f && rd->f != stdin)
+        fclose(rd->f);
+    rd->f = NULL;
+}
+
+// --- Lector por bloques (BmpStreamReader) ---
+// read() de bloques grandes sobre un buffer alineado en lugar del buffer de 4 KB de stdio. Con
+// POSIX_FADV_SEQUENTIAL el nucleo agranda su ventana de readahead y con WILLNEED se piden los
+// BMP_STREAM_AHEAD bloques siguientes mientras se decodifica (y, con load_bmp24_stream, se filtra)
+// el actual: el disco recibe pedidos de varios MB aunque cada read() sea de 1 MB, que es lo que
+// mejor anda al copiar (un bloque mayor ya no cabe en la cache L2). Los bytes sin consumir de un
+// bloque se mueven justo antes del area de lectura: las filas quedan contiguas y cada read()
+// empieza alineado, como exige O_DIRECT.
+#define BMP_STREAM_ALIGN 4096
+#define BMP_STREAM_DEFAULT_MB 1
+#define BMP_STREAM_AHEAD 4
+#define BMP_STREAM_SMALL (64 * 1024) // buffer para archivos que caben en un bloque
+
+static size_t bmp_round_up(size_t n, size_t a)
+{
+    return (n + a - 1) / a * a;
+}
+
+// Reserva slack bytes antes del area de lectura (lo que puede quedar sin consumir), conservando
+// los bytes pendientes si ya habia buffer: pueden ser casi un bloque entero, asi que se copian al
+// principio y bmp_stream_fill los acomoda cuando ya son menos de una fila.
+static int bmp_stream_reserve(BmpStreamReader *sr, size_t slack)
+{
+    slack = bmp_round_up(slack, BMP_STREAM_ALIGN);
+    uint8_t *raw = (uint8_t *)bmp_malloc(slack + sr->area_size + BMP_STREAM_ALIGN);
+    if (!raw)
+    {
+        fprintf(stderr, "Sin memoria para el buffer de lectura.\n");
+        return 0;
+    }
+    uint8_t *area = (uint8_t *)(((uintptr_t)raw + slack + BMP_STREAM_ALIGN - 1) & ~(uintptr_t)(BMP_STREAM_ALIGN - 1));
+    size_t left = (size_t)(sr->end - sr->data); // <= slack anterior + area_size
+    if (left)
+        memcpy(area - slack, sr->data, left);
+    bmp_free(sr->raw);
+    sr->raw = raw;
+    sr->area = area;
+    sr->data = area - slack;
+    sr->end = sr->data + left;
+    sr->slack = slack;
+    return 1;
+}
+
+// Lee el siguiente bloque detras de los bytes pendientes. Devuelve los bytes leidos (0 = fin del
+// archivo) o -1 si fallo la lectura.
+static long bmp_stream_fill(BmpStreamReader *sr)
+{
+    size_t left = (size_t)(sr->end - sr->data);
+    memmove(sr->area - left, sr->data, left);
+    sr->data = sr->area - left;
+    sr->end = sr->area;
+    for (;;)
+    {
+        ssize_t n = read(sr->fd, sr->area, sr->area_size);
+        if (n < 0 && errno == EINTR)
+            continue;
+#ifdef O_DIRECT
+        if (n < 0 && errno == EINVAL && (sr->flags & BMP_STREAM_DIRECT))
+        {
+            // El dispositivo pide otra alineacion: se sigue con lecturas normales
+            fcntl(sr->fd, F_SETFL, fcntl(sr->fd, F_GETFL) & ~O_DIRECT);
+            sr->flags &= ~BMP_STREAM_DIRECT;
+            continue;
+        }
+#endif
+        if (n < 0)
+        {
+            perror("Error leyendo el archivo");
+            return -1;
+        }
+        sr->end = sr->area + n;
+        sr->file_pos += (uint64_t)n;
+        if (n > 0 && sr->fd != 0 && !(sr->flags & BMP_STREAM_DIRECT))
+            posix_fadvise(sr->fd, (off_t)sr->file_pos, (off_t)(BMP_STREAM_AHEAD * sr->area_size), POSIX_FADV_WILLNEED);
+        return (long)n;
+    }
+}
+
+// Asegura n bytes contiguos sin consumir (n <= slack). 0 si el archivo termina antes.
+static int bmp_stream_need(BmpStreamReader *sr, size_t n)
+{
+    while ((size_t)(sr->end - sr->data) < n)
+    {
+        if (bmp_stream_fill(sr) <= 0)
+            return 0;
+    }
+    return 1;
+}
+
+int bmp_stream_open(BmpStreamReader *sr, const char *filename, size_t buf_size, int flags)
+{
+    memset(sr, 0, sizeof(*sr));
+    int fd = -1;
+    if (strcmp(filename, "-") == 0)
+    {
+        fd = 0; // stdin: sin fadvise ni O_DIRECT
+        flags &= ~BMP_STREAM_DIRECT;
+    }
+    else
+    {
+#ifdef O_DIRECT
+        if (flags & BMP_STREAM_DIRECT)
+            fd = open(filename, O_RDONLY | O_DIRECT);
+#endif
+        if (fd < 0)
+        {
+            flags &= ~BMP_STREAM_DIRECT; // p. ej. tmpfs no admite O_DIRECT
+            fd = open(filename, O_RDONLY);
+        }
+    }
+    if (fd < 0)
+    {
+        perror("No se pudo abrir el archivo");
+        return 0;
+    }
+    sr->fd = fd;
+    sr->flags = flags;
+
+    // Buffer de buf_size (0 = BMP_READ_MB o 1 MB). Si el archivo entra en un bloque se usan
+    // BMP_STREAM_SMALL bytes: un buffer algo mayor que el umbral de mmap de malloc costaba un mmap y
+    // sus fallos de pagina por archivo (lotes de miles de imagenes chicas).
+    if (!buf_size)
+    {
+        const char *env = getenv("BMP_READ_MB");
+        long mb = env ? atol(env) : 0;
+        buf_size = (size_t)(mb > 0 ? mb : BMP_STREAM_DEFAULT_MB) << 20;
+    }
+    struct stat st;
+    if (fd != 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size <= buf_size &&
+        buf_size > BMP_STREAM_SMALL)
+        buf_size = BMP_STREAM_SMALL;
+    sr->area_size = bmp_round_up(buf_size, BMP_STREAM_ALIGN);
+    if (fd != 0 && !(flags & BMP_STREAM_DIRECT))
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    size_t skip = 0;
+    int ok = bmp_stream_reserve(sr, BMP_STREAM_ALIGN) && bmp_stream_need(sr, sizeof(fh) + sizeof(ih));
+    if (ok)
+    {
+        memcpy(&fh, sr->data, sizeof(fh));
+        memcpy(&ih, sr->data + sizeof(fh), sizeof(ih));
+        sr->data += sizeof(fh) + sizeof(ih);
+        ok = bmp_check_headers(&fh, &ih);
+        skip = ok ? fh.bfOffBits - sizeof(fh) - sizeof(ih) : 0;
+    }
+    // Hueco entre cabeceras y pixeles (cabeceras V4/V5, paleta): se descarta bloque a bloque
+    while (ok && skip)
+    {
+        size_t avail = (size_t)(sr->end - sr->data);
+        size_t k = avail < skip ? avail : skip;
+        sr->data += k;
+        skip -= k;
+        if (skip && bmp_stream_fill(sr) <= 0)
+            ok = 0;
+    }
+    if (ok)
+    {
+        sr->fh = fh;
+        sr->ih = ih;
+        sr->width = ih.biWidth;
+        sr->height = ih.biHeight;
+        sr->padding = (4 - ((ih.biWidth * 3) % 4)) % 4;
+        size_t stride = (size_t)ih.biWidth * 3 + (size_t)sr->padding;
+        ok = stride <= sr->slack || bmp_stream_reserve(sr, stride);
+    }
+    if (!ok)
+    {
+        bmp_stream_close(sr);
+        return 0;
+    }
+    return 1;
+}
+
+// Como bmp_reader_next_row: la primera fila es la de ABAJO de la imagen.
+int bmp_stream_next_row(BmpStreamReader *sr, Pixel24 *row)
+{
+    if (sr->rows_done >= sr->height)
+        return 0;
+    size_t row_bytes = (size_t)sr->width * 3;
+    if (!bmp_stream_need(sr, row_bytes + (size_t)sr->padding))
+    {
+        fprintf(stderr, "Lectura de fila incompleta.\n");
+        return 0;
+    }
+    memcpy(row, sr->data, row_bytes);
+    sr->data += row_bytes + (size_t)sr->padding;
+    sr->rows_done++;
+    return 1;
+}
+
+void bmp_stream_close(BmpStreamReader *sr)
+{
+    if (sr->fd > 0)
+        close(sr->fd);
+    if (sr->raw)
+        bmp_free(sr->raw);
+    memset(sr, 0, sizeof(*sr));
+    sr->fd = -1;
+}
+
+// Crea el archivo y escribe las cabeceras de un BMP 24bpp con las dimensiones de src_ih.
+int bmp_writer_open(BMPWriter *wr, const char *filename, const BMPInfoHeader *src_ih)
+{
+    FILE *f = bmp_open_output(filename);
+    if (!f)
+        return 0;
+
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    int padding;
+    bmp_make_headers24(src_ih, &fh, &ih, &padding);
+
+    // Escribimos cabeceras
+    if (fwrite(&fh, sizeof(fh), 1, f) != 1 || fwrite(&ih, sizeof(ih), 1, f) != 1)
+    {
+        bmp_close_output(f);
+        return 0;
+    }
+
+    wr->f = f;
+    wr->width = src_ih->biWidth;
+    wr->height = src_ih->biHeight;
+    wr->padding = padding;
+    wr->rows_done = 0;
+    return 1;
+}
+
+// Escribe la siguiente fila del archivo (la primera es la de ABAJO de la imagen).
+int bmp_writer_put_row(BMPWriter *wr, const Pixel24 *row)
+{
+    static const uint8_t pad[3] = {0, 0, 0};
+    if (fwrite(row, 3, (size_t)wr->width, wr->f) != (size_t)wr->width)
+        return 0;
+    if (wr->padding && fwrite(pad, 1, (size_t)wr->padding, wr->f) != (size_t)wr->padding)
+        return 0;
+    wr->rows_done++;
+    return 1;
+}
+
+// Cierra el archivo. Devuelve 0 si faltaron filas o fallo el cierre.
+int bmp_writer_close(BMPWriter *wr)
+{
+    int ok = wr->rows_done == wr->height;
+    if (wr->f && !bmp_close_output(wr->f))
+        ok = 0;
+    wr->f = NULL;
+    return ok;
+}
+
+// Decodifica en pixels (ARRIBA hacia ABAJO) todas las filas completas que haya en el buffer,
+// leyendo un bloque si no hay ninguna. El BMP viene de ABAJO hacia ARRIBA: cada fila va a su lugar
+// invertido. Devuelve cuantas filas decodifico; 0 si el archivo se corto.
+static int bmp_stream_decode_rows(BmpStreamReader *sr, Pixel24 *pixels)
+{
+    size_t row_bytes = (size_t)sr->width * 3, stride = row_bytes + (size_t)sr->padding;
+    size_t k = (size_t)(sr->end - sr->data) / stride;
+    while (k == 0)
+    {
+        if (bmp_stream_fill(sr) <= 0)
+        {
+            fprintf(stderr, "Lectura de fila incompleta.\n");
+            return 0;
+        }
+        k = (size_t)(sr->end - sr->data) / stride;
+    }
+    if (k > (size_t)(sr->height - sr->rows_done))
+        k = (size_t)(sr->height - sr->rows_done);
+    int y = sr->height - 1 - sr->rows_done;
+    for (size_t i = 0; i < k; ++i, --y)
+    {
+        memcpy(&pixels[(size_t)y * sr->width], sr->data, row_bytes);
+        sr->data += stride;
+    }
+    sr->rows_done += (int)k;
+    return (int)k;
+}
+
+// Carga BMP 24bpp sin compresión, altura > 0.
+// Devuelve un bloque de Pixel24 de tamaño width*height (ordenado de arriba a abajo, izquierda a derecha).
+// Se lee con BmpStreamReader: cada bloque leido se decodifica entero y se pasa a on_rows (si no es
+// NULL) antes de pedir el siguiente, asi el llamador filtra esas filas mientras el nucleo ya trae
+// las proximas.
+int load_bmp24_stream(const char *filename, int flags, BmpRowsFn on_rows, void *user,
+                      BMPHeader *out_fh, BMPInfoHeader *out_ih, Pixel24 **out_pixels)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "load_bmp24");
+    BmpStreamReader sr;
+    if (!bmp_stream_open(&sr, filename, 0, flags))
+        return 0;
+
+    int width = sr.width;
+    int height = sr.height;
+    size_t stride = (size_t)width * 3 + (size_t)sr.padding;
+
+    // Reserva memoria para la imagen ordenada de ARRIBA hacia ABAJO (forma natural de trabajar)
+    Pixel24 *pixels = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)width * (size_t)height);
+    int ok = pixels != NULL;
+    numa_first_touch(pixels, sizeof(Pixel24) * (size_t)width, height);
+
+    while (ok && sr.rows_done < height)
+    {
+        int k = bmp_stream_decode_rows(&sr, pixels);
+        int y1 = height - sr.rows_done + k; // filas [y1 - k, y1) de la imagen
+        if (k == 0 || (on_rows && !on_rows(pixels, width, height, y1 - k, y1, user)))
+            ok = 0;
+    }
+
+    BMPHeader fh = sr.fh;
+    BMPInfoHeader ih = sr.ih;
+    bmp_stream_close(&sr);
+    if (!ok)
+    {
+        if (pixels)
+            bmp_free(pixels);
+        return 0;
+    }
+    uint64_t n = (uint64_t)width * (uint64_t)height;
+    stats_end(&sp, (uint64_t)fh.bfOffBits + (uint64_t)stride * (uint64_t)height, 3 * n, n);
+    *out_fh = fh;
+    *out_ih = ih;
+    *out_pixels = pixels;
+    return 1;
+}
+
+// BMP_DIRECT=1 lee con O_DIRECT.
+int load_bmp24(const char *filename,
+               BMPHeader *out_fh, BMPInfoHeader *out_ih,
+               Pixel24 **out_pixels)
+{
+    const char *env = getenv("BMP_DIRECT");
+    int flags = env && atoi(env) > 0 ? BMP_STREAM_DIRECT : 0;
+    return load_bmp24_stream(filename, flags, NULL, NULL, out_fh, out_ih, out_pixels);
+}
+
+// Guarda BMP 24bpp aplicando flags SAVE_* durante la escritura.
+int save_bmp24_oriented(const char *filename,
+                        const BMPInfoHeader *src_ih, const Pixel24 *pixels, int flags)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "save_bmp24");
+    BMPWriter wr;
+    if (!bmp_writer_open(&wr, filename, src_ih))
+        return 0;
+
+    Pixel24 *rev = NULL;
+    if (flags & SAVE_FLIP_H)
+    {
+        rev = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)wr.width);
+        if (!rev)
+        {
+            bmp_writer_close(&wr);
+            return 0;
+        }
+    }
+
+    // Sin flip vertical escribimos de ABAJO hacia ARRIBA (formato BMP); con flip, al reves
+    for (int i = 0; i < wr.height; ++i)
+    {
+        int y = (flags & SAVE_FLIP_V) ? i : wr.height - 1 - i;
+        const Pixel24 *row = &pixels[(size_t)y * wr.width];
+        if (rev)
+        {
+            for (int x = 0; x < wr.width; ++x)
+                rev[x] = row[wr.width - 1 - x];
+            row = rev;
+        }
+        if (!bmp_writer_put_row(&wr, row))
+        {
+            bmp_free(rev);
+            bmp_writer_close(&wr);
+            return 0;
+        }
+    }
+    bmp_free(rev);
+    int ok = bmp_writer_close(&wr);
+    uint64_t n = (uint64_t)wr.width * (uint64_t)wr.height;
+    uint64_t file_bytes = sizeof(BMPHeader) + sizeof(BMPInfoHeader) + (uint64_t)(3 * wr.width + wr.padding) * wr.height;
+    stats_end(&sp, 3 * n, file_bytes, n);
+    return ok;
+}
+
+// Guarda BMP 24bpp sin compresion con los pixeles en arreglo de ARRIBA hacia ABAJO.
+int save_bmp24(const char *filename,
+               const BMPInfoHeader *src_ih, const Pixel24 *pixels)
+{
+    return save_bmp24_oriented(filename, src_ih, pixels, 0);
+}
+
+// --- Pipeline lectura -> filtro -> escritura dentro de una imagen ---
+// Un hilo lector decodifica el archivo por bloques y publica cuantas filas ya tiene. El hilo
+// llamador encola en el planificador cada banda de band_rows filas en cuanto llegan tambien sus
+// filas de halo, ayuda a filtrarlas mientras espera y escribe las terminadas en orden de archivo
+// (de ABAJO hacia ARRIBA). La banda b cubre las filas de archivo [b * band_rows, (b + 1) * band_rows).
+// Asi leer, filtrar y escribir se solapan y la latencia de una imagen grande tiende a
+// max(E/S, calculo) en lugar de la suma. El lector es el unico hilo propio: pasa casi todo el tiempo
+// bloqueado en read() y como tarea dejaria un hilo del conjunto sin filtrar mientras tanto.
+// Con --stats cada etapa tiene su fila: pipeline_read (bloques del lector, sin prepare),
+// pipeline_filter (bandas, sumando todos los hilos) y pipeline_write (bandas del escritor).
+
+#define PIPE_BAND_ROWS 64
+
+typedef struct
+{
+    const BmpPipeline *p;
+    BmpStreamReader sr;
+    Pixel24 *src, *dst;
+    int width, height, band_rows, nbands;
+    int rows_ready; // atomico: filas de archivo decodificadas y preparadas por el lector
+    int filtered;   // atomico: bandas que ya salieron del filtro
+    int failed;     // atomico: cualquier etapa lo pone para que las demas corten
+} PipeJob;
+
+typedef struct
+{
+    BmpTask task;
+    PipeJob *job;
+    int band;
+    int node;  // nodo de casa; -1 sin NUMA
+    int state; // atomico: 0 en cola, 1 filtrada, -1 el filtro fallo
+} PipeTask;
+
+// Filas de la imagen [y0, y1) de la banda b.
+static void pipe_band_rows(const PipeJob *job, int b, int *y0, int *y1)
+{
+    *y1 = job->height - b * job->band_rows;
+    *y0 = *y1 - job->band_rows < 0 ? 0 : *y1 - job->band_rows;
+}
+
+static void *pipe_reader_main(void *arg)
+{
+    PipeJob *job = (PipeJob *)arg;
+    uint64_t stride = 3 * (uint64_t)job->width + (uint64_t)job->sr.padding;
+    while (job->sr.rows_done < job->height && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+    {
+        StatsSpan sp;
+        stats_begin(&sp, "pipeline_read");
+        int k = bmp_stream_decode_rows(&job->sr, job->src);
+        if (k > 0)
+            stats_end(&sp, stride * (uint64_t)k, 3 * (uint64_t)job->width * k, (uint64_t)job->width * k);
+        int top = job->height - job->sr.rows_done; // decodificadas las filas [top, height)
+        if (k == 0 ||
+            (job->p->prepare && !job->p->prepare(job->src, job->width, job->height, top, top + k, job->p->user)))
+        {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_store_n(&job->rows_ready, job->sr.rows_done, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void pipe_task_run(BmpTask *t)
+{
+    PipeTask *pt = (PipeTask *)t;
+    PipeJob *job = pt->job;
+    if (pt->node >= 0)
+        numa_count(pt->node);
+    int y0, y1, ok = 0;
+    pipe_band_rows(job, pt->band, &y0, &y1);
+    if (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+    {
+        StatsSpan sp;
+        stats_begin(&sp, "pipeline_filter");
+        ok = job->p->filter(job->src, job->dst, job->width, job->height, y0, y1, job->p->user);
+        if (ok)
+            stats_end_image(&sp, job->width, y1 - y0);
+    }
+    __atomic_fetch_add(&job->filtered, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&pt->state, ok ? 1 : -1, __ATOMIC_RELEASE);
+}
+
+int pipeline_bmp24(const char *in_name, const char *out_name, const BmpPipeline *p, int band_rows, int workers)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "pipeline_bmp24");
+    PipeJob job;
+    memset(&job, 0, sizeof(job));
+    job.p = p;
+    const char *direct = getenv("BMP_DIRECT");
+    if (!bmp_stream_open(&job.sr, in_name, 0, direct && atoi(direct) > 0 ? BMP_STREAM_DIRECT : 0))
+        return 0;
+    job.width = job.sr.width;
+    job.height = job.sr.height;
+    job.band_rows = band_rows > 0 ? band_rows : PIPE_BAND_ROWS;
+    job.nbands = (job.height + job.band_rows - 1) / job.band_rows;
+    if (workers <= 0)
+        workers = bmp_num_threads();
+    size_t n = (size_t)job.width * (size_t)job.height;
+    job.src = (Pixel24 *)bmp_malloc(n * sizeof(Pixel24));
+    job.dst = p->in_place && p->halo == 0 ? job.src : (Pixel24 *)bmp_malloc(n * sizeof(Pixel24));
+    // Con NUMA y un llamador externo cada banda va al nodo de sus filas, como en run_bands
+    int spread = sched_spread_rows();
+    int home = numa_enabled() && !spread ? sched_node() : -1;
+    numa_first_touch(job.src, sizeof(Pixel24) * (size_t)job.width, job.height);
+    if (job.dst != job.src)
+        numa_first_touch(job.dst, sizeof(Pixel24) * (size_t)job.width, job.height);
+    PipeTask *tasks = (PipeTask *)bmp_calloc(job.nbands > 0 ? (size_t)job.nbands : 1, sizeof(PipeTask));
+    BMPWriter wr;
+    int ok = job.src && job.dst && tasks;
+    int wr_open = ok && bmp_writer_open(&wr, out_name, &job.sr.ih);
+    ok = wr_open;
+
+    pthread_t reader_tid;
+    int reader = ok && pthread_create(&reader_tid, NULL, pipe_reader_main, &job) == 0;
+    if (ok && !reader)
+    {
+        fprintf(stderr, "No se pudo crear el hilo lector del pipeline.\n");
+        ok = 0;
+    }
+
+    // Este hilo encola las bandas listas (como mucho workers en el filtro a la vez), ayuda con
+    // ellas y escribe las terminadas en orden de archivo
+    BmpTaskGroup group;
+    group.pending = 0;
+    int spawned = 0, next = 0, spins = 0;
+    while (ok && next < job.nbands)
+    {
+        int top = job.height - __atomic_load_n(&job.rows_ready, __ATOMIC_ACQUIRE); // listas [top, height)
+        for (; spawned < job.nbands && spawned - __atomic_load_n(&job.filtered, __ATOMIC_RELAXED) < workers;
+             ++spawned)
+        {
+            PipeTask *pt = &tasks[spawned];
+            int y0, y1;
+            pipe_band_rows(&job, spawned, &y0, &y1);
+            if (top > 0 && top > y0 - p->halo)
+                break; // falta su halo superior
+            pt->task.run = pipe_task_run;
+            pt->job = &job;
+            pt->band = spawned;
+            pt->node = spread ? numa_home_node(job.height, y0, y1) : home;
+            if (spread)
+                sched_spawn_on(&group, &pt->task, pt->node);
+            else
+                bmp_task_spawn(&group, &pt->task);
+        }
+        int state = next < spawned ? __atomic_load_n(&tasks[next].state, __ATOMIC_ACQUIRE) : 0;
+        if (state < 0 || __atomic_load_n(&job.failed, __ATOMIC_RELAXED))
+        {
+            ok = 0;
+            break;
+        }
+        if (state > 0)
+        {
+            int y0, y1;
+            pipe_band_rows(&job, next, &y0, &y1);
+            StatsSpan wsp;
+            stats_begin(&wsp, "pipeline_write");
+            for (int y = y1 - 1; ok && y >= y0; --y)
+                ok = bmp_writer_put_row(&wr, &job.dst[(size_t)y * job.width]);
+            uint64_t n_band = (uint64_t)job.width * (uint64_t)(y1 - y0);
+            if (ok)
+                stats_end(&wsp, 3 * n_band, (uint64_t)(3 * wr.width + wr.padding) * (uint64_t)(y1 - y0), n_band);
+            next++;
+            spins = 0;
+        }
+        else if (bmp_task_help())
+            spins = 0;
+        else
+            sched_backoff(&spins);
+    }
+    if (!ok)
+        __atomic_store_n(&job.failed, 1, __ATOMIC_RELAXED);
+    // Tras un error las bandas ya encoladas salen sin filtrar y el lector corta en el proximo bloque
+    bmp_task_wait(&group);
+    if (reader)
+        pthread_join(reader_tid, NULL);
+
+    if (wr_open && !bmp_writer_close(&wr))
+        ok = 0;
+    bmp_stream_close(&job.sr);
+    bmp_free(tasks);
+    if (job.dst != job.src)
+        bmp_free(job.dst);
+    bmp_free(job.src);
+    if (ok)
+        stats_end_image(&sp, job.width, job.height);
+    return ok;
+}
+
+// Guarda BMP monocromo de 1 bpp (paleta de 2 colores: 0 = negro, 1 = blanco).
+// mask tiene un byte por pixel, de ARRIBA hacia ABAJO; cualquier valor distinto de 0 es blanco.
+int save_bmp1(const char *filename,
+              const BMPInfoHeader *src_ih, const uint8_t *mask)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "save_bmp1");
+    FILE *f = bmp_open_output(filename);
+    if (!f)
+        return 0;
+
+    int width = src_ih->biWidth;
+    int height = src_ih->biHeight;
+
+    // Cada fila empaqueta 8 pixeles por byte y se alinea a 4 bytes
+    int row_bytes = ((width + 31) / 32) * 4;
+    uint32_t image_size = (uint32_t)row_bytes * (uint32_t)height;
+    uint8_t palette[8] = {0, 0, 0, 0, 255, 255, 255, 0}; // RGBQUAD negro y blanco
+
+    BMPHeader fh;
+    BMPInfoHeader ih = *src_ih;
+    ih.biSize = sizeof(BMPInfoHeader);
+    ih.biCompression = 0;
+    ih.biBitCount = 1;
+    ih.biPlanes = 1;
+    ih.biSizeImage = image_size;
+    ih.biClrUsed = 2;
+    ih.biClrImportant = 2;
+
+    fh.bfType = 0x4D42; // 'BM'
+    fh.bfOffBits = sizeof(BMPHeader) + sizeof(BMPInfoHeader) + sizeof(palette);
+    fh.bfSize = fh.bfOffBits + image_size;
+    fh.bfReserved1 = 0;
+    fh.bfReserved2 = 0;
+
+    uint8_t *packed = (uint8_t *)bmp_calloc((size_t)row_bytes, 1);
+    if (!packed)
+    {
+        bmp_close_output(f);
+        return 0;
+    }
+    if (fwrite(&fh, sizeof(fh), 1, f) != 1 || fwrite(&ih, sizeof(ih), 1, f) != 1 ||
+        fwrite(palette, sizeof(palette), 1, f) != 1)
+    {
+        bmp_free(packed);
+        bmp_close_output(f);
+        return 0;
+    }
+
+    // Filas de ABAJO hacia ARRIBA, bit mas significativo = pixel de mas a la izquierda
+    for (int y = height - 1; y >= 0; --y)
+    {
+        const uint8_t *m = &mask[(size_t)y * width];
+        int x = 0;
+        for (; x + 8 <= width; x += 8)
+        {
+            packed[x >> 3] = (uint8_t)((m[x] ? 0x80 : 0) | (m[x + 1] ? 0x40 : 0) | (m[x + 2] ? 0x20 : 0) |
+                                       (m[x + 3] ? 0x10 : 0) | (m[x + 4] ? 0x08 : 0) | (m[x + 5] ? 0x04 : 0) |
+                                       (m[x + 6] ? 0x02 : 0) | (m[x + 7] ? 0x01 : 0));
+        }
+        if (x < width)
+        {
+            uint8_t last = 0;
+            for (int i = 0; x + i < width; ++i)
+                if (m[x + i])
+                    last |= (uint8_t)(0x80 >> i);
+            packed[x >> 3] = last;
+        }
+        if (fwrite(packed, 1, (size_t)row_bytes, f) != (size_t)row_bytes)
+        {
+            bmp_free(packed);
+            bmp_close_output(f);
+            return 0;
+        }
+    }
+
+    bmp_free(packed);
+    if (!bmp_close_output(f))
+        return 0;
+    stats_end(&sp, (uint64_t)width * height, fh.bfSize, (uint64_t)width * height);
+    return 1;
+}
+
+// --- Codificacion en memoria ---
+// Para servicios que reciben o envian el BMP por tuberias o sockets: nada pasa por disco.
+// El tamano codificado sale de la cabecera, asi el llamador reserva el buffer una sola vez.
+
+// Bytes que ocupa el BMP 24bpp de ih codificado (cabeceras + filas con relleno); 0 si no es valido.
+size_t bmp24_encoded_size(const BMPInfoHeader *ih)
+{
+    if (ih->biWidth <= 0 || ih->biHeight <= 0)
+        return 0;
+    uint64_t row = ((uint64_t)ih->biWidth * 3 + 3) & ~(uint64_t)3;
+    uint64_t total = sizeof(BMPHeader) + sizeof(BMPInfoHeader) + row * (uint64_t)ih->biHeight;
+    if (total > 0xFFFFFFFFu || total > (size_t)-1) // bfSize es de 32 bits
+        return 0;
+    return (size_t)total;
+}
+
+// Codifica pixels (de ARRIBA hacia ABAJO) en buf. Falla sin escribir nada si buf_size no alcanza.
+int encode_bmp24(const BMPInfoHeader *src_ih, const Pixel24 *pixels, uint8_t *buf, size_t buf_size,
+                 size_t *out_size)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "encode_bmp24");
+    size_t need = bmp24_encoded_size(src_ih);
+    if (!need || buf_size < need)
+    {
+        fprintf(stderr, "Buffer de salida insuficiente (%zu bytes, se necesitan %zu).\n", buf_size, need);
+        return 0;
+    }
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    int padding;
+    bmp_make_headers24(src_ih, &fh, &ih, &padding);
+    memcpy(buf, &fh, sizeof(fh));
+    memcpy(buf + sizeof(fh), &ih, sizeof(ih));
+
+    // Filas de ABAJO hacia ARRIBA, como en el archivo
+    int width = src_ih->biWidth, height = src_ih->biHeight;
+    size_t row_bytes = 3 * (size_t)width;
+    uint8_t *dst = buf + fh.bfOffBits;
+    for (int y = height - 1; y >= 0; --y)
+    {
+        memcpy(dst, &pixels[(size_t)y * width], row_bytes);
+        memset(dst + row_bytes, 0, (size_t)padding);
+        dst += row_bytes + (size_t)padding;
+    }
+    if (out_size)
+        *out_size = need;
+    uint64_t n = (uint64_t)width * (uint64_t)height;
+    stats_end(&sp, 3 * n, need, n);
+    return 1;
+}
+
+// Decodifica un BMP 24bpp completo en memoria. *out_pixels (de ARRIBA hacia ABAJO) se libera con bmp_free.
+int decode_bmp24(const uint8_t *buf, size_t size, BMPHeader *out_fh, BMPInfoHeader *out_ih, Pixel24 **out_pixels)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "decode_bmp24");
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    if (size < sizeof(fh) + sizeof(ih))
+    {
+        fprintf(stderr, "Buffer demasiado corto para un BMP.\n");
+        return 0;
+    }
+    memcpy(&fh, buf, sizeof(fh));
+    memcpy(&ih, buf + sizeof(fh), sizeof(ih));
+    if (!bmp_check_headers(&fh, &ih))
+        return 0;
+
+    int width = ih.biWidth, height = ih.biHeight;
+    size_t row_bytes = 3 * (size_t)width;
+    size_t stride = (row_bytes + 3) & ~(size_t)3;
+    if (fh.bfOffBits > size || (size - fh.bfOffBits) / stride < (size_t)height)
+    {
+        fprintf(stderr, "BMP truncado: faltan filas de pixeles.\n");
+        return 0;
+    }
+    Pixel24 *pixels = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)width * (size_t)height);
+    if (!pixels)
+        return 0;
+    numa_first_touch(pixels, sizeof(Pixel24) * (size_t)width, height);
+    const uint8_t *src = buf + fh.bfOffBits;
+    for (int y = height - 1; y >= 0; --y, src += stride)
+        memcpy(&pixels[(size_t)y * width], src, row_bytes);
+
+    uint64_t n = (uint64_t)width * (uint64_t)height;
+    stats_end(&sp, (uint64_t)fh.bfOffBits + (uint64_t)stride * height, 3 * n, n);
+    *out_fh = fh;
+    *out_ih = ih;
+    *out_pixels = pixels;
+    return 1;
+}
+
+// --- Segmentos de memoria compartida ---
+// Imagen en un memfd (o shm_open con nombre) precedida por BmpShmHeader: otro proceso recibe el
+// descriptor, lo mapea y filtra los pixeles en el lugar, sin copias ni codificacion BMP.
+size_t bmp_shm_size(int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return 0;
+    return BMP_SHM_HEADER_SIZE + 3 * (size_t)width * (size_t)height;
+}
+
+static int bmp_shm_map(BmpShm *seg, int fd, size_t size)
+{
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("No se pudo mapear el segmento");
+        return 0;
+    }
+    seg->fd = fd;
+    seg->size = size;
+    seg->hdr = (BmpShmHeader *)map;
+    seg->pixels = (Pixel24 *)((uint8_t *)map + BMP_SHM_HEADER_SIZE);
+    return 1;
+}
+
+// Descriptor anonimo vacio; tag solo hace unico el nombre temporal donde no hay memfd.
+static int shm_anon_fd(const void *tag)
+{
+#if defined(__linux__) && defined(__NR_memfd_create)
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+    (void)tag;
+    // Con sellos permitidos: el servidor le pone F_SEAL_SHRINK antes de mapearlo
+    return (int)syscall(__NR_memfd_create, "bmp_shm", MFD_ALLOW_SEALING);
+#else
+    // Sin memfd: nombre unico que se borra en seguida (el descriptor sigue valido)
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "/bmp_shm_%ld_%p", (long)getpid(), tag);
+    int fd = shm_open(tmp, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd >= 0)
+        shm_unlink(tmp);
+    return fd;
+#endif
+}
+
+// Crea un segmento de width x height. name NULL = memfd anonimo (se comparte pasando el
+// descriptor); "/nombre" = shm_open, para procesos que solo conocen el nombre.
+int bmp_shm_create(BmpShm *seg, int width, int height, const char *name)
+{
+    size_t size = bmp_shm_size(width, height);
+    if (!size)
+        return 0;
+    int fd = name ? shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600) : shm_anon_fd(seg);
+    if (fd < 0)
+    {
+        perror("No se pudo crear el segmento");
+        return 0;
+    }
+    if (ftruncate(fd, (off_t)size) != 0 || !bmp_shm_map(seg, fd, size))
+    {
+        close(fd);
+        return 0;
+    }
+    memset(seg->hdr, 0, sizeof(*seg->hdr));
+    seg->hdr->magic = BMP_SHM_MAGIC;
+    seg->hdr->version = BMP_SHM_VERSION;
+    seg->hdr->format = BMP_SHM_BGR24;
+    seg->hdr->width = width;
+    seg->hdr->height = height;
+    seg->hdr->stride = 3 * (uint32_t)width;
+    seg->hdr->data_offset = BMP_SHM_HEADER_SIZE;
+    seg->hdr->capacity = size - BMP_SHM_HEADER_SIZE;
+    seg->width = width;
+    seg->height = height;
+    seg->capacity = seg->hdr->capacity;
+    return 1;
+}
+
+// Mapea un segmento recibido y valida la cabecera. La cabecera se copia antes de validarla y
+// solo se usa la copia (seg->width, height, capacity): otro proceso puede reescribirla en
+// cualquier momento. Con sealed el segmento debe poder sellarse contra achicarse (o venir ya
+// sellado); sin el sello, quien lo creo podria truncarlo mientras esta mapeado (SIGBUS).
+static int shm_attach(BmpShm *seg, int fd, int sealed)
+{
+    if (sealed)
+    {
+#ifdef F_SEAL_SHRINK
+        int seals = fcntl(fd, F_GET_SEALS);
+        if (seals < 0 || (!(seals & F_SEAL_SHRINK) && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0))
+#endif
+        {
+            fprintf(stderr, "Segmento compartido sin sello F_SEAL_SHRINK (crearlo con bmp_shm_create).\n");
+            return 0;
+        }
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < BMP_SHM_HEADER_SIZE)
+    {
+        fprintf(stderr, "Segmento compartido invalido (tamano).\n");
+        return 0;
+    }
+    if (!bmp_shm_map(seg, fd, (size_t)st.st_size))
+        return 0;
+    BmpShmHeader h;
+    memcpy(&h, (const void *)seg->hdr, sizeof(h));
+    const char *err = NULL;
+    if (h.magic != BMP_SHM_MAGIC || h.version != BMP_SHM_VERSION)
+        err = "firma o version";
+    else if (h.format != BMP_SHM_BGR24 || h.data_offset != BMP_SHM_HEADER_SIZE)
+        err = "formato";
+    // Todo en 64 bits: 3 * width en 32 bits da la vuelta (width = 0x55555556 -> stride 2) y una
+    // cabecera asi pasaria con un segmento de pocos bytes. Las filas deben caber en un int.
+    else if (h.width <= 0 || h.height <= 0 || (uint64_t)h.stride != 3 * (uint64_t)h.width ||
+             (uint64_t)h.stride > INT32_MAX)
+        err = "dimensiones o stride (se requieren filas contiguas)";
+    else if (h.capacity > seg->size - BMP_SHM_HEADER_SIZE ||
+             3 * (uint64_t)h.width * (uint64_t)h.height > h.capacity)
+        err = "capacidad";
+    if (err)
+    {
+        fprintf(stderr, "Segmento compartido invalido (%s).\n", err);
+        bmp_shm_detach(seg);
+        return 0;
+    }
+    seg->width = h.width;
+    seg->height = h.height;
+    seg->capacity = h.capacity;
+    return 1;
+}
+
+int bmp_shm_attach(BmpShm *seg, int fd)
+{
+    return shm_attach(seg, fd, 0);
+}
+
+int bmp_shm_attach_sealed(BmpShm *seg, int fd)
+{
+    return shm_attach(seg, fd, 1);
+}
+
+// Cambia las dimensiones registradas (resize, rotaciones) si la imagen cabe en el segmento.
+int bmp_shm_set_size(BmpShm *seg, int width, int height)
+{
+    if (width <= 0 || height <= 0 || 3 * (uint64_t)width * (uint64_t)height > seg->capacity)
+    {
+        fprintf(stderr, "La imagen de %dx%d no cabe en el segmento.\n", width, height);
+        return 0;
+    }
+    seg->width = width;
+    seg->height = height;
+    seg->hdr->width = width;
+    seg->hdr->height = height;
+    seg->hdr->stride = 3 * (uint32_t)width;
+    return 1;
+}
+
+void bmp_shm_detach(BmpShm *seg)
+{
+    if (seg->hdr)
+        munmap(seg->hdr, seg->size);
+    seg->hdr = NULL;
+    seg->pixels = NULL;
+    seg->size = 0;
+}
+
+// --check-shm: bmp_shm_attach con cabeceras que un cliente del servidor podria mandar. Las
+// invalidas deben rechazarse y la valida aceptarse. Devuelve 0 si todas se comportan asi.
+typedef struct
+{
+    const char *what;
+    int32_t width, height;
+    uint32_t stride;
+    uint64_t capacity;
+    size_t file; // bytes del segmento (cabecera incluida)
+    int valid;
+} ShmCheckCase;
+
+int check_shm(void)
+{
+    static const ShmCheckCase cases[] = {
+        {"valida 4x3", 4, 3, 12, 36, BMP_SHM_HEADER_SIZE + 36, 1},
+        {"valida, capacidad de sobra", 4, 3, 12, 100, BMP_SHM_HEADER_SIZE + 100, 1},
+        {"3 * width da la vuelta en 32 bits", 0x55555556, 1, 2, 3, BMP_SHM_HEADER_SIZE + 3, 0},
+        {"width * height da la vuelta", 0x40000000, 0x40000000, 0xC0000000u, 36, BMP_SHM_HEADER_SIZE + 36, 0},
+        {"stride distinto de 3 * width", 4, 3, 16, 48, BMP_SHM_HEADER_SIZE + 48, 0},
+        {"imagen mayor que la capacidad", 100, 100, 300, 36, BMP_SHM_HEADER_SIZE + 36, 0},
+        {"capacidad mayor que el segmento", 4, 3, 12, 1u << 20, BMP_SHM_HEADER_SIZE + 36, 0},
+        {"alto negativo", 4, -3, 12, 36, BMP_SHM_HEADER_SIZE + 36, 0},
+        {"ancho cero", 0, 3, 0, 36, BMP_SHM_HEADER_SIZE + 36, 0},
+        {"segmento menor que la cabecera", 4, 3, 12, 36, BMP_SHM_HEADER_SIZE - 1, 0},
+    };
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        const ShmCheckCase *c = &cases[i];
+        BmpShmHeader h;
+        memset(&h, 0, sizeof(h));
+        h.magic = BMP_SHM_MAGIC;
+        h.version = BMP_SHM_VERSION;
+        h.format = BMP_SHM_BGR24;
+        h.width = c->width;
+        h.height = c->height;
+        h.stride = c->stride;
+        h.data_offset = BMP_SHM_HEADER_SIZE;
+        h.capacity = c->capacity;
+        int fd = shm_anon_fd(c);
+        size_t head = c->file < sizeof(h) ? c->file : sizeof(h);
+        if (fd < 0 || ftruncate(fd, (off_t)c->file) != 0 || pwrite(fd, &h, head, 0) != (ssize_t)head)
+        {
+            perror("No se pudo preparar el segmento de prueba");
+            if (fd >= 0)
+                close(fd);
+            return 1;
+        }
+        BmpShm seg;
+        int accepted = bmp_shm_attach(&seg, fd);
+        if (accepted)
+            bmp_shm_detach(&seg);
+        close(fd);
+        int ok = accepted == c->valid;
+        printf("  %-36s %s %s\n", c->what, accepted ? "aceptada" : "rechazada", ok ? "ok" : "FALLA");
+        failures += !ok;
+    }
+    printf("%s\n", failures ? "hay cabeceras mal validadas" : "todas las cabeceras se validan bien");
+    return failures ? 1 : 0;
+}
+
+// --- Escala de grises: estandares de luminancia ---
+// Cada variante se genera con una macro y sus pesos quedan como constantes Q16 (suman 65536),
+// asi elegir el estandar es una sola indireccion fuera del bucle y el bucle no cambia de costo.
+#define LUMA_Q16(wr, wg, wb) (((wr) * r + (wg) * g + (wb) * b + 32768) >> 16)
+
+#define DEFINE_GRAY_KERNEL(name, expr)                               \
+    static void name(Pixel24 *pixels, size_t n)                      \
+    {                                                                \
+        for (size_t i = 0; i < n; ++i)                               \
+        {                                                            \
+            int r = pixels[i].r, g = pixels[i].g, b = pixels[i].b;   \
+            (void)r;                                                 \
+            (void)g;                                                 \
+            (void)b;                                                 \
+            uint8_t g8 = (uint8_t)(expr);                            \
+            pixels[i].r = pixels[i].g = pixels[i].b = g8;            \
+        }                                                            \
+    }
+
+DEFINE_GRAY_KERNEL(gray_bt601, LUMA_Q16(19595, 38470, 7471))
+DEFINE_GRAY_KERNEL(gray_bt709, LUMA_Q16(13933, 46871, 4732))
+DEFINE_GRAY_KERNEL(gray_bt2020, LUMA_Q16(17216, 44433, 3887))
+DEFINE_GRAY_KERNEL(gray_average, ((r + g + b) * 21846 + 32768) >> 16)
+DEFINE_GRAY_KERNEL(gray_channel_r, r)
+DEFINE_GRAY_KERNEL(gray_channel_g, g)
+DEFINE_GRAY_KERNEL(gray_channel_b, b)
+
+typedef void (*GrayKernel)(Pixel24 *pixels, size_t n);
+static const GrayKernel gray_kernels[LUMA_COUNT] = {
+    gray_bt601, gray_bt709, gray_bt2020, gray_average, gray_channel_r, gray_channel_g, gray_channel_b};
+
+// Convierte en el mismo arreglo a escala de grises con el estandar indicado (LUMA_*).
+void to_grayscale_ex(Pixel24 *pixels, int width, int height, int standard)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "to_grayscale");
+    if (standard < 0 || standard >= LUMA_COUNT)
+        standard = LUMA_BT601;
+    size_t n = (size_t)width * (size_t)height;
+    // Los tres estandares ponderados tienen variantes SIMD; promedio y canal suelto son triviales
+    if (standard == LUMA_BT601)
+        g_kernels.gray_bt601(pixels, n);
+    else if (standard == LUMA_BT709)
+        g_kernels.gray_bt709(pixels, n);
+    else if (standard == LUMA_BT2020)
+        g_kernels.gray_bt2020(pixels, n);
+    else
+        gray_kernels[standard](pixels, n);
+    stats_end_image(&sp, width, height);
+}
+
+// Convierte en el mismo arreglo a escala de grises (BT.601).
+void to_grayscale(Pixel24 *pixels, int width, int height)
+{
+    to_grayscale_ex(pixels, width, height, LUMA_BT601);
+}
+
+// Implementacion original en doble precision; se conserva como referencia para las mediciones.
+// Difiere de la version Q16 en +-1 solo en casos de empate de redondeo (~0.06% de los colores).
+void to_grayscale_reference(Pixel24 *pixels, int width, int height)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "to_grayscale_reference");
+    for (int i = 0; i < width * height; ++i)
+    {
+        int r = pixels[i].r;
+        int g = pixels[i].g;
+        int b = pixels[i].b;
+        int gray = (int)(0.299 * r + 0.587 * g + 0.114 * b + 0.5); // +0.5 para redondear
+        uint8_t g8 = clamp_int_to_u8(gray);
+        pixels[i].r = pixels[i].g = pixels[i].b = g8;
+    }
+    stats_end_image(&sp, width, height);
+}
+
+// Columnas [x0, x1) de una fila de la convolucion 3x3. src apunta a la fila central; k son los
+// 9 pesos por filas. Las variantes SIMD acumulan en el mismo orden (dy, dx) y dan exactamente
+// el mismo resultado en float; por eso ninguna contrae mul + add en FMA (g++ lo hace por defecto).
+#if defined(__GNUC__) && !defined(__clang__)
+#define BMP_NO_FMA __attribute__((optimize("fp-contract=off")))
+#else
+#define BMP_NO_FMA
+#endif
+static BMP_NO_FMA void conv3x3_cols_scalar(const uint8_t *src, uint8_t *dst, int width, int x0, int x1, const float *k,
+                                float sumk)
+{
+    for (int x = x0; x < x1; ++x)
+    {
+        float acc = 0.f;
+        // Ventana 3x3 centrada en x
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                uint8_t pix = src[dy * width + x + dx];
+                acc += pix * k[(dy + 1) * 3 + dx + 1];
+            }
+        }
+        int val = (int)(acc / sumk + 0.5f);
+        dst[x] = clamp_int_to_u8(val);
+    }
+}
+
+static void conv3x3_row_scalar(const uint8_t *src, uint8_t *dst, int width, const float *k, float sumk)
+{
+    conv3x3_cols_scalar(src, dst, width, 1, width - 1, k, sumk);
+}
+
+typedef struct
+{
+    Pixel24 *pixels;
+    uint8_t *src, *dst;
+    int width, height;
+    float k[9], sumk;
+} ConvJob;
+
+// Primera pasada: filas [y0, y1) de la imagen (gris) a un plano de un canal.
+static void convolve3x3_gather_band(void *ctx, int band, int y0, int y1)
+{
+    ConvJob *job = (ConvJob *)ctx;
+    (void)band;
+    for (size_t i = (size_t)y0 * job->width, e = (size_t)y1 * job->width; i < e; ++i)
+        job->src[i] = job->pixels[i].r; // r=g=b en gris
+}
+
+// Segunda pasada: convolucion de las filas [y0, y1) (lee tambien y0 - 1 e y1), bordes sin cambio
+// y resultado de vuelta en los tres canales.
+static void convolve3x3_band(void *ctx, int band, int y0, int y1)
+{
+    ConvJob *job = (ConvJob *)ctx;
+    (void)band;
+    int w = job->width;
+    for (int y = y0; y < y1; ++y)
+    {
+        const uint8_t *s = job->src + (size_t)y * w;
+        uint8_t *d = job->dst + (size_t)y * w;
+        if (y == 0 || y == job->height - 1)
+            memcpy(d, s, (size_t)w);
+        else
+        {
+            g_kernels.conv3x3_row(s, d, w, job->k, job->sumk);
+            d[0] = s[0];
+            d[w - 1] = s[w - 1];
+        }
+        Pixel24 *p = job->pixels + (size_t)y * w;
+        for (int x = 0; x < w; ++x)
+            p[x].r = p[x].g = p[x].b = d[x];
+    }
+}
+
+// Pesos en orden de filas y su suma para normalizar (1 si es 0).
+static void conv3x3_weights(const float k[3][3], float *flat, float *sumk)
+{
+    *sumk = 0.f;
+    for (int j = 0; j < 3; ++j)
+        for (int i = 0; i < 3; ++i)
+        {
+            flat[j * 3 + i] = k[j][i];
+            *sumk += k[j][i];
+        }
+    if (*sumk == 0.f)
+        *sumk = 1.f;
+}
+
+// Aplica convolución 3x3 sobre la imagen (asumiendo GRAYSCALE ya).
+// Copiamos bordes sin cambio para simplificar.
+void convolve3x3(Pixel24 *pixels, int width, int height, const float k[3][3])
+{
+    StatsSpan sp;
+    stats_begin(&sp, "convolve3x3");
+    // Creamos una copia en escala de grises de un canal (como uint8_t)
+    uint8_t *src = (uint8_t *)bmp_malloc((size_t)width * (size_t)height);
+    uint8_t *dst = (uint8_t *)bmp_malloc((size_t)width * (size_t)height);
+    if (!src || !dst)
+    {
+        bmp_free(src);
+        bmp_free(dst);
+        return;
+    }
+
+    ConvJob job;
+    job.pixels = pixels;
+    job.src = src;
+    job.dst = dst;
+    job.width = width;
+    job.height = height;
+    conv3x3_weights(k, job.k, &job.sumk);
+
+    // Copia al plano, convolucion y vuelta por teselas: cada tesela de la segunda pasada arranca en
+    // cuanto estan sus filas y la vecina de cada lado, y cada fila de los planos la toca primero
+    // (y la vuelve a usar) el hilo de su tesela, no el llamador.
+    run_bands_halo(height, sched_tiles(height), convolve3x3_gather_band, &job, convolve3x3_band, &job, 1);
+
+    bmp_free(src);
+    bmp_free(dst);
+    stats_end_image(&sp, width, height);
+}
+
+// Filas [y0, y1) de convolve3x3 de src (ya en gris) a dst, para procesar por bandas: lee ademas
+// las filas y0 - 1 e y1. Mismo kernel y mismos bordes, asi el resultado es identico byte a byte.
+int convolve3x3_rows(const Pixel24 *src, Pixel24 *dst, int width, int height, int y0, int y1, const float k[3][3])
+{
+    StatsSpan sp;
+    stats_begin(&sp, "convolve3x3_rows");
+    int r0 = y0 > 0 ? y0 - 1 : 0, r1 = y1 < height ? y1 + 1 : height;
+    size_t plane = (size_t)width * (size_t)(r1 - r0);
+    uint8_t *in = (uint8_t *)bmp_malloc(2 * plane);
+    if (!in)
+        return 0;
+    uint8_t *out = in + plane;
+    for (size_t i = 0; i < plane; ++i)
+        in[i] = src[(size_t)r0 * width + i].r; // r=g=b en gris
+    float kf[9], sumk;
+    conv3x3_weights(k, kf, &sumk);
+    for (int y = y0; y < y1; ++y)
+    {
+        const uint8_t *i = in + (size_t)(y - r0) * width;
+        uint8_t *o = out + (size_t)(y - r0) * width;
+        if (y == 0 || y == height - 1)
+            memcpy(o, i, (size_t)width);
+        else
+        {
+            g_kernels.conv3x3_row(i, o, width, kf, sumk);
+            o[0] = i[0];
+            o[width - 1] = i[width - 1];
+        }
+        Pixel24 *d = dst + (size_t)y * width;
+        for (int x = 0; x < width; ++x)
+            d[x].r = d[x].g = d[x].b = o[x];
+    }
+    bmp_free(in);
+    stats_end(&sp, 3 * plane, 3 * (uint64_t)width * (y1 - y0), (uint64_t)width * (y1 - y0));
+    return 1;
+}
+
+// --- Operaciones puntuales por tabla (LUT) ---
+// Gamma, brillo/contraste, niveles, inversion, umbral y curvas son todas funciones u8 -> u8.
+// Se componen en una sola tabla de 256 entradas por canal y se aplican en una unica pasada.
+// Deja la tabla como identidad (f(v) = v) en los tres canales.
+void lut_identity(PointLUT *lut)
+{
+    for (int i = 0; i < 256; ++i)
+        lut->b[i] = lut->g[i] = lut->r[i] = (uint8_t)i;
+}
+
+// Compone f DESPUES de lo que ya contiene la tabla: lut[c][v] = f[lut[c][v]], solo en los canales de mask.
+void lut_compose(PointLUT *lut, const uint8_t f[256], int mask)
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        if (mask & LUT_CH_B)
+            lut->b[i] = f[lut->b[i]];
+        if (mask & LUT_CH_G)
+            lut->g[i] = f[lut->g[i]];
+        if (mask & LUT_CH_R)
+            lut->r[i] = f[lut->r[i]];
+    }
+}
+
+// Correccion gamma: v' = 255 * (v/255)^(1/gamma). gamma > 1 aclara.
+void lut_gamma(PointLUT *lut, double gamma, int mask)
+{
+    uint8_t f[256];
+    if (gamma <= 0.0)
+        gamma = 1.0;
+    for (int i = 0; i < 256; ++i)
+        f[i] = clamp_int_to_u8((int)(255.0 * pow(i / 255.0, 1.0 / gamma) + 0.5));
+    lut_compose(lut, f, mask);
+}
+
+// Brillo/contraste: v' = (v - 128) * contrast + 128 + brightness.
+void lut_brightness_contrast(PointLUT *lut, int brightness, double contrast, int mask)
+{
+    uint8_t f[256];
+    for (int i = 0; i < 256; ++i)
+    {
+        double v = (i - 128) * contrast + 128.0 + brightness;
+        f[i] = clamp_int_to_u8((int)floor(v + 0.5));
+    }
+    lut_compose(lut, f, mask);
+}
+
+// Niveles: lleva [in_black, in_white] a [out_black, out_white] con gamma intermedia.
+void lut_levels(PointLUT *lut, int in_black, int in_white, double gamma,
+                int out_black, int out_white, int mask)
+{
+    uint8_t f[256];
+    if (in_white <= in_black)
+        in_white = in_black + 1;
+    if (gamma <= 0.0)
+        gamma = 1.0;
+    for (int i = 0; i < 256; ++i)
+    {
+        double t = (double)(i - in_black) / (double)(in_white - in_black);
+        if (t < 0.0)
+            t = 0.0;
+        if (t > 1.0)
+            t = 1.0;
+        t = pow(t, 1.0 / gamma);
+        f[i] = clamp_int_to_u8((int)(out_black + t * (out_white - out_black) + 0.5));
+    }
+    lut_compose(lut, f, mask);
+}
+
+// Negativo: v' = 255 - v.
+void lut_invert(PointLUT *lut, int mask)
+{
+    uint8_t f[256];
+    for (int i = 0; i < 256; ++i)
+        f[i] = (uint8_t)(255 - i);
+    lut_compose(lut, f, mask);
+}
+
+// Umbral: v' = 255 si v >= t, 0 si no.
+void lut_threshold(PointLUT *lut, int t, int mask)
+{
+    uint8_t f[256];
+    for (int i = 0; i < 256; ++i)
+        f[i] = (i >= t) ? 255 : 0;
+    lut_compose(lut, f, mask);
+}
+
+// Curva tonal lineal a trozos por puntos de control (xs creciente, n >= 2).
+// Fuera del rango de xs se mantiene el valor del extremo.
+void lut_curve(PointLUT *lut, const uint8_t *xs, const uint8_t *ys, int n, int mask)
+{
+    uint8_t f[256];
+    if (n < 2)
+        return;
+    int seg = 0;
+    for (int i = 0; i < 256; ++i)
+    {
+        while (seg < n - 2 && i > xs[seg + 1])
+            ++seg;
+        int x0 = xs[seg], x1 = xs[seg + 1];
+        if (i <= xs[0])
+            f[i] = ys[0];
+        else if (i >= xs[n - 1] || x1 <= x0)
+            f[i] = (i >= xs[n - 1]) ? ys[n - 1] : ys[seg + 1];
+        else
+            f[i] = clamp_int_to_u8((int)(ys[seg] + (double)(ys[seg + 1] - ys[seg]) * (i - x0) / (x1 - x0) + 0.5));
+    }
+    lut_compose(lut, f, mask);
+}
+
+// Busqueda escalar byte a byte (n multiplo de 3, orden B, G, R).
+static void lut_apply_scalar(uint8_t *p, size_t n, const PointLUT *lut, int uniform)
+{
+    (void)uniform;
+    for (size_t i = 0; i + 3 <= n; i += 3)
+    {
+        p[i + 0] = lut->b[p[i + 0]];
+        p[i + 1] = lut->g[p[i + 1]];
+        p[i + 2] = lut->r[p[i + 2]];
+    }
+}
+
+// Aplica la LUT compuesta sobre la imagen en una sola pasada.
+void apply_lut24(Pixel24 *pixels, int width, int height, const PointLUT *lut)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "apply_lut24");
+    size_t n = (size_t)width * (size_t)height * 3;
+    int uniform = memcmp(lut->b, lut->g, 256) == 0 && memcmp(lut->b, lut->r, 256) == 0;
+    g_kernels.lut_apply((uint8_t *)pixels, n, lut, uniform);
+    stats_end_image(&sp, width, height);
+}
+
+// --- Histogramas y estadisticas ---
+// Luminancia BT.601 en punto fijo (16 bits), redondeada; mismos pesos que gray_bt601.
+static inline int luma601_fixed(int r, int g, int b)
+{
+    return LUMA_Q16(19595, 38470, 7471);
+}
+
+// Sub-histogramas intercalados: pixeles consecutivos van a bancos distintos para que
+// dos valores iguales seguidos no serialicen el incremento (store-to-load forwarding).
+#define HIST_BANKS 4
+
+typedef struct
+{
+    const Pixel24 *pixels;
+    int width;
+    Histogram24 *parts; // uno por banda
+} HistJob;
+
+static void histogram_band(void *ctx, int band, int y0, int y1)
+{
+    HistJob *job = (HistJob *)ctx;
+    uint32_t(*sub)[4][256] = (uint32_t(*)[4][256])bmp_calloc(HIST_BANKS, sizeof(*sub));
+    Histogram24 *out = &job->parts[band];
+    memset(out, 0, sizeof(*out));
+    if (!sub)
+    {
+        // Sin memoria para los bancos: contamos directo, mas lento pero correcto
+        for (size_t i = (size_t)y0 * job->width; i < (size_t)y1 * job->width; ++i)
+        {
+            const Pixel24 *p = &job->pixels[i];
+            out->b[p->b]++;
+            out->g[p->g]++;
+            out->r[p->r]++;
+            out->y[luma601_fixed(p->r, p->g, p->b)]++;
+        }
+        return;
+    }
+
+    const Pixel24 *p = &job->pixels[(size_t)y0 * job->width];
+    size_t n = (size_t)(y1 - y0) * job->width;
+    size_t i = 0;
+    for (; i + HIST_BANKS <= n; i += HIST_BANKS)
+    {
+        for (int k = 0; k < HIST_BANKS; ++k)
+        {
+            const Pixel24 *q = &p[i + k];
+            sub[k][0][q->b]++;
+            sub[k][1][q->g]++;
+            sub[k][2][q->r]++;
+            sub[k][3][luma601_fixed(q->r, q->g, q->b)]++;
+        }
+    }
+    for (; i < n; ++i)
+    {
+        const Pixel24 *q = &p[i];
+        sub[0][0][q->b]++;
+        sub[0][1][q->g]++;
+        sub[0][2][q->r]++;
+        sub[0][3][luma601_fixed(q->r, q->g, q->b)]++;
+    }
+
+    // Fusion de los bancos
+    for (int k = 0; k < HIST_BANKS; ++k)
+    {
+        for (int v = 0; v < 256; ++v)
+        {
+            out->b[v] += sub[k][0][v];
+            out->g[v] += sub[k][1][v];
+            out->r[v] += sub[k][2][v];
+            out->y[v] += sub[k][3][v];
+        }
+    }
+    bmp_free(sub);
+}
+
+// Calcula los histogramas B, G, R y de luminancia en una sola pasada, en paralelo por bandas.
+int compute_histogram24(const Pixel24 *pixels, int width, int height, Histogram24 *out)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "compute_histogram24");
+    int nb = bmp_num_threads();
+    Histogram24 *parts = (Histogram24 *)bmp_malloc(sizeof(Histogram24) * (size_t)nb);
+    if (!parts)
+        return 0;
+
+    HistJob job;
+    job.pixels = pixels;
+    job.width = width;
+    job.parts = parts;
+    if (nb > height)
+        nb = height;
+    run_bands(height, nb, histogram_band, &job);
+
+    // Reduccion de las bandas
+    memset(out, 0, sizeof(*out));
+    for (int b = 0; b < nb; ++b)
+    {
+        for (int v = 0; v < 256; ++v)
+        {
+            out->b[v] += parts[b].b[v];
+            out->g[v] += parts[b].g[v];
+            out->r[v] += parts[b].r[v];
+            out->y[v] += parts[b].y[v];
+        }
+    }
+    bmp_free(parts);
+    stats_end(&sp, 3 * (uint64_t)width * height, sizeof(*out), (uint64_t)width * height);
+    return 1;
+}
+
+// Minimo, maximo, mediana, media y desviacion estandar a partir de un histograma.
+void histogram_channel_stats(const uint32_t hist[256], ChannelStats *st)
+{
+    uint64_t n = 0;
+    double sum = 0.0, sum2 = 0.0;
+    st->min = -1;
+    st->max = -1;
+    for (int v = 0; v < 256; ++v)
+    {
+        if (!hist[v])
+            continue;
+        if (st->min < 0)
+            st->min = v;
+        st->max = v;
+        n += hist[v];
+        sum += (double)v * hist[v];
+        sum2 += (double)v * v * hist[v];
+    }
+    st->median = 0;
+    st->mean = n ? sum / (double)n : 0.0;
+    st->stddev = n ? sqrt(fmax(sum2 / (double)n - st->mean * st->mean, 0.0)) : 0.0;
+
+    uint64_t acc = 0;
+    for (int v = 0; v < 256; ++v)
+    {
+        acc += hist[v];
+        if (n && acc * 2 >= n)
+        {
+            st->median = v;
+            break;
+        }
+    }
+}
+
+// --- Ecualizacion de histograma ---
+// Construye la LUT de ecualizacion de un canal a partir de su histograma (CDF normalizada).
+static void equalize_table(const uint32_t hist[256], uint8_t f[256])
+{
+    uint64_t n = 0, cdf_min = 0;
+    for (int v = 0; v < 256; ++v)
+        n += hist[v];
+    for (int v = 0; v < 256; ++v)
+    {
+        if (hist[v])
+        {
+            cdf_min = hist[v];
+            break;
+        }
+    }
+    uint64_t acc = 0;
+    for (int v = 0; v < 256; ++v)
+    {
+        acc += hist[v];
+        if (n <= cdf_min)
+            f[v] = (uint8_t)v; // imagen de un solo valor: no hay nada que ecualizar
+        else
+            f[v] = clamp_int_to_u8((int)(((acc > cdf_min ? acc - cdf_min : 0) * 255 + (n - cdf_min) / 2) / (n - cdf_min)));
+    }
+}
+
+// Ecualizacion global. per_channel = 1 ecualiza B, G y R por separado;
+// 0 aplica a los tres canales la curva obtenida de la luminancia (conserva mejor el color).
+int equalize_histogram24(Pixel24 *pixels, int width, int height, int per_channel)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "equalize_histogram24");
+    Histogram24 hist;
+    if (!compute_histogram24(pixels, width, height, &hist))
+        return 0;
+
+    PointLUT lut;
+    lut_identity(&lut);
+    uint8_t f[256];
+    if (per_channel)
+    {
+        equalize_table(hist.b, f);
+        lut_compose(&lut, f, LUT_CH_B);
+        equalize_table(hist.g, f);
+        lut_compose(&lut, f, LUT_CH_G);
+        equalize_table(hist.r, f);
+        lut_compose(&lut, f, LUT_CH_R);
+    }
+    else
+    {
+        equalize_table(hist.y, f);
+        lut_compose(&lut, f, LUT_CH_ALL);
+    }
+    apply_lut24(pixels, width, height, &lut);
+    stats_end_image(&sp, width, height);
+    return 1;
+}
+
+// --- CLAHE (ecualizacion adaptativa con limite de contraste) ---
+// La imagen se divide en tiles_x * tiles_y mosaicos. Cada mosaico tiene su histograma de luminancia
+// recortado y su LUT; cada pixel interpola bilinealmente las LUT de los 4 mosaicos vecinos.
+// El costo por pixel es fijo (no depende del tamano del mosaico) y la luminancia se calcula al vuelo,
+// sin planos intermedios del tamano de la imagen.
+typedef struct
+{
+    Pixel24 *pixels;
+    int width, height;
+    int tiles_x, tiles_y, tile_w, tile_h;
+    double clip_limit;
+    uint8_t *luts; // tiles_x * tiles_y * 256
+    // Tablas por columna para la interpolacion (pesos en punto fijo de 8 bits)
+    int *col_t0, *col_t1, *col_w;
+    int failed; // atomico: una banda sin memoria para sus histogramas lo pone (sus LUT quedan sin hacer)
+} ClaheJob;
+
+// Histograma recortado + LUT de cada mosaico; cada banda procesa filas de mosaicos completas.
+static void clahe_tiles_band(void *ctx, int band, int ty0, int ty1)
+{
+    ClaheJob *job = (ClaheJob *)ctx;
+    (void)band;
+    uint32_t *hist = (uint32_t *)bmp_malloc(sizeof(uint32_t) * 256 * (size_t)job->tiles_x);
+    if (!hist)
+    {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int ty = ty0; ty < ty1; ++ty)
+    {
+        int y0 = ty * job->tile_h;
+        int y1 = y0 + job->tile_h < job->height ? y0 + job->tile_h : job->height;
+        memset(hist, 0, sizeof(uint32_t) * 256 * (size_t)job->tiles_x);
+
+        // Recorremos las filas completas (acceso secuencial) repartiendo por mosaico
+        for (int y = y0; y < y1; ++y)
+        {
+            const Pixel24 *row = &job->pixels[(size_t)y * job->width];
+            for (int tx = 0; tx < job->tiles_x; ++tx)
+            {
+                uint32_t *h = &hist[256 * tx];
+                int x0 = tx * job->tile_w;
+                int x1 = x0 + job->tile_w < job->width ? x0 + job->tile_w : job->width;
+                for (int x = x0; x < x1; ++x)
+                    h[luma601_fixed(row[x].r, row[x].g, row[x].b)]++;
+            }
+        }
+
+        for (int tx = 0; tx < job->tiles_x; ++tx)
+        {
+            uint32_t *h = &hist[256 * tx];
+            int x0 = tx * job->tile_w;
+            int x1 = x0 + job->tile_w < job->width ? x0 + job->tile_w : job->width;
+            uint32_t npix = (uint32_t)((x1 - x0) * (y1 - y0));
+
+            // Recorte: lo que excede el limite se reparte uniformemente entre los 256 niveles
+            uint32_t limit = (uint32_t)(job->clip_limit * npix / 256.0);
+            if (limit < 1)
+                limit = 1;
+            uint32_t excess = 0;
+            for (int v = 0; v < 256; ++v)
+            {
+                if (h[v] > limit)
+                {
+                    excess += h[v] - limit;
+                    h[v] = limit;
+                }
+            }
+            uint32_t inc = excess / 256, residual = excess % 256;
+            for (int v = 0; v < 256; ++v)
+                h[v] += inc;
+            if (residual)
+            {
+                uint32_t step = 256 / residual;
+                for (uint32_t v = 0; v < 256 && residual; v += step, --residual)
+                    h[v]++;
+            }
+
+            uint8_t *lut = &job->luts[256 * ((size_t)ty * job->tiles_x + tx)];
+            uint64_t acc = 0;
+            for (int v = 0; v < 256; ++v)
+            {
+                acc += h[v];
+                lut[v] = clamp_int_to_u8((int)((acc * 255 + npix / 2) / (npix ? npix : 1)));
+            }
+        }
+    }
+    bmp_free(hist);
+}
+
+// Aplicacion: interpolacion bilineal de las 4 LUT vecinas en punto fijo, una pasada por fila.
+static void clahe_apply_band(void *ctx, int band, int y0, int y1)
+{
+    ClaheJob *job = (ClaheJob *)ctx;
+    (void)band;
+    for (int y = y0; y < y1; ++y)
+    {
+        // Posicion relativa a los centros de los mosaicos
+        double gy = (y + 0.5) / job->tile_h - 0.5;
+        int t0 = (int)floor(gy);
+        int wy = (int)((gy - t0) * 256.0 + 0.5);
+        int t1 = t0 + 1;
+        if (t0 < 0)
+            t0 = 0, wy = 0;
+        if (t1 > job->tiles_y - 1)
+            t1 = job->tiles_y - 1;
+        if (t0 > job->tiles_y - 1)
+            t0 = job->tiles_y - 1;
+
+        const uint8_t *lrow0 = &job->luts[256 * (size_t)t0 * job->tiles_x];
+        const uint8_t *lrow1 = &job->luts[256 * (size_t)t1 * job->tiles_x];
+        Pixel24 *row = &job->pixels[(size_t)y * job->width];
+        for (int x = 0; x < job->width; ++x)
+        {
+            int v = luma601_fixed(row[x].r, row[x].g, row[x].b);
+            int a = job->col_t0[x] * 256 + v, b = job->col_t1[x] * 256 + v;
+            int wx = job->col_w[x];
+            int top = lrow0[a] * (256 - wx) + lrow0[b] * wx;
+            int bot = lrow1[a] * (256 - wx) + lrow1[b] * wx;
+            int nv = (top * (256 - wy) + bot * wy + 32768) >> 16;
+            // Desplazamos los tres canales lo mismo que la luminancia (en gris queda exacto)
+            int d = nv - v;
+            row[x].b = clamp_int_to_u8(row[x].b + d);
+            row[x].g = clamp_int_to_u8(row[x].g + d);
+            row[x].r = clamp_int_to_u8(row[x].r + d);
+        }
+    }
+}
+
+// CLAHE sobre la luminancia. clip_limit es multiplo de la altura media del histograma (tipico 2..4).
+int clahe24(Pixel24 *pixels, int width, int height, int tiles_x, int tiles_y, double clip_limit)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "clahe24");
+    if (tiles_x < 1)
+        tiles_x = 1;
+    if (tiles_y < 1)
+        tiles_y = 1;
+    if (tiles_x > width)
+        tiles_x = width;
+    if (tiles_y > height)
+        tiles_y = height;
+
+    ClaheJob job;
+    job.pixels = pixels;
+    job.width = width;
+    job.height = height;
+    job.tile_w = (width + tiles_x - 1) / tiles_x;
+    job.tile_h = (height + tiles_y - 1) / tiles_y;
+    // Con el redondeo hacia arriba pueden sobrar mosaicos vacios al final
+    job.tiles_x = (width + job.tile_w - 1) / job.tile_w;
+    job.tiles_y = (height + job.tile_h - 1) / job.tile_h;
+    job.clip_limit = clip_limit > 0.0 ? clip_limit : 1.0;
+    job.failed = 0;
+    job.luts = (uint8_t *)bmp_malloc(256 * (size_t)job.tiles_x * (size_t)job.tiles_y);
+    job.col_t0 = (int *)bmp_malloc(sizeof(int) * (size_t)width);
+    job.col_t1 = (int *)bmp_malloc(sizeof(int) * (size_t)width);
+    job.col_w = (int *)bmp_malloc(sizeof(int) * (size_t)width);
+    if (!job.luts || !job.col_t0 || !job.col_t1 || !job.col_w)
+    {
+        bmp_free(job.luts);
+        bmp_free(job.col_t0);
+        bmp_free(job.col_t1);
+        bmp_free(job.col_w);
+        return 0;
+    }
+
+    for (int x = 0; x < width; ++x)
+    {
+        double gx = (x + 0.5) / job.tile_w - 0.5;
+        int t0 = (int)floor(gx);
+        int w = (int)((gx - t0) * 256.0 + 0.5);
+        int t1 = t0 + 1;
+        if (t0 < 0)
+            t0 = 0, w = 0;
+        if (t1 > job.tiles_x - 1)
+            t1 = job.tiles_x - 1;
+        if (t0 > job.tiles_x - 1)
+            t0 = job.tiles_x - 1;
+        job.col_t0[x] = t0;
+        job.col_t1[x] = t1;
+        job.col_w[x] = w;
+    }
+
+    run_bands(job.tiles_y, sched_tiles(job.tiles_y), clahe_tiles_band, &job);
+    int ok = !__atomic_load_n(&job.failed, __ATOMIC_RELAXED);
+    if (ok)
+        run_bands(height, sched_tiles(height), clahe_apply_band, &job);
+
+    bmp_free(job.luts);
+    bmp_free(job.col_t0);
+    bmp_free(job.col_t1);
+    bmp_free(job.col_w);
+    stats_end_image(&sp, width, height);
+    return ok;
+}
+
+// --- Umbralizacion (documentos) ---
+// Extrae la luminancia BT.601 a un plano de un canal (width*height bytes).
+void extract_luma_plane(const Pixel24 *pixels, int width, int height, uint8_t *plane)
+{
+    for (size_t i = 0; i < (size_t)width * (size_t)height; ++i)
+        plane[i] = (uint8_t)luma601_fixed(pixels[i].r, pixels[i].g, pixels[i].b);
+}
+
+// Umbral de Otsu: el t que maximiza la varianza entre clases [0,t] y [t+1,255].
+int otsu_threshold(const uint32_t hist[256])
+{
+    uint64_t n = 0;
+    double sum = 0.0;
+    for (int v = 0; v < 256; ++v)
+    {
+        n += hist[v];
+        sum += (double)v * hist[v];
+    }
+
+    uint64_t n0 = 0;
+    double sum0 = 0.0, best = -1.0;
+    int best_t = 127;
+    for (int t = 0; t < 255; ++t)
+    {
+        n0 += hist[t];
+        sum0 += (double)t * hist[t];
+        uint64_t n1 = n - n0;
+        if (n0 == 0 || n1 == 0)
+            continue;
+        double m0 = sum0 / (double)n0;
+        double m1 = (sum - sum0) / (double)n1;
+        double between = (double)n0 * (double)n1 * (m0 - m1) * (m0 - m1);
+        if (between > best)
+        {
+            best = between;
+            best_t = t;
+        }
+    }
+    return best_t;
+}
+
+// Binariza con un umbral global: 255 si v > t, 0 si no.
+void threshold_plane(const uint8_t *gray, int width, int height, int t, uint8_t *mask)
+{
+    for (size_t i = 0; i < (size_t)width * (size_t)height; ++i)
+        mask[i] = gray[i] > t ? 255 : 0;
+}
+
+typedef struct
+{
+    const uint8_t *src;
+    uint8_t *dst;
+    const uint32_t *integral; // (width+1) * (height+1)
+    int width, height, radius;
+} BoxMeanJob;
+
+static void box_mean_band(void *ctx, int band, int y0, int y1)
+{
+    BoxMeanJob *job = (BoxMeanJob *)ctx;
+    (void)band;
+    size_t stride = (size_t)job->width + 1;
+    for (int y = y0; y < y1; ++y)
+    {
+        int ya = y - job->radius < 0 ? 0 : y - job->radius;
+        int yb = y + job->radius + 1 > job->height ? job->height : y + job->radius + 1;
+        const uint32_t *ia = &job->integral[(size_t)ya * stride];
+        const uint32_t *ib = &job->integral[(size_t)yb * stride];
+        for (int x = 0; x < job->width; ++x)
+        {
+            int xa = x - job->radius < 0 ? 0 : x - job->radius;
+            int xb = x + job->radius + 1 > job->width ? job->width : x + job->radius + 1;
+            // Aritmetica modular en 32 bits: la suma de la ventana cabe aunque el total no
+            uint32_t sum = ib[xb] - ib[xa] - ia[xb] + ia[xa];
+            uint32_t cnt = (uint32_t)((xb - xa) * (yb - ya));
+            job->dst[(size_t)y * job->width + x] = (uint8_t)((sum + cnt / 2) / cnt);
+        }
+    }
+}
+
+// Media en ventana (2r+1)x(2r+1) con imagen integral; en los bordes promedia solo lo que hay dentro.
+// Costo por pixel independiente del radio. src y dst pueden ser el mismo plano.
+int box_mean_u8(const uint8_t *src, uint8_t *dst, int width, int height, int radius)
+{
+    size_t stride = (size_t)width + 1;
+    uint32_t *integral = (uint32_t *)bmp_malloc(sizeof(uint32_t) * stride * ((size_t)height + 1));
+    uint8_t *out = dst == src ? (uint8_t *)bmp_malloc((size_t)width * (size_t)height) : dst;
+    if (!integral || !out)
+    {
+        bmp_free(integral);
+        if (out != dst)
+            bmp_free(out);
+        return 0;
+    }
+
+    memset(integral, 0, sizeof(uint32_t) * stride);
+    for (int y = 0; y < height; ++y)
+    {
+        uint32_t *prev = &integral[(size_t)y * stride];
+        uint32_t *cur = prev + stride;
+        const uint8_t *s = &src[(size_t)y * width];
+        uint32_t row_sum = 0;
+        cur[0] = 0;
+        for (int x = 0; x < width; ++x)
+        {
+            row_sum += s[x];
+            cur[x + 1] = prev[x + 1] + row_sum;
+        }
+    }
+
+    BoxMeanJob job;
+    job.src = src;
+    job.dst = out;
+    job.integral = integral;
+    job.width = width;
+    job.height = height;
+    job.radius = radius < 0 ? 0 : radius;
+    run_bands(height, sched_tiles(height), box_mean_band, &job);
+
+    if (out != dst)
+    {
+        memcpy(dst, out, (size_t)width * (size_t)height);
+        bmp_free(out);
+    }
+    bmp_free(integral);
+    return 1;
+}
+
+// Radios de 3 cajas sucesivas cuya varianza sumada iguala la de una gaussiana de sigma dado.
+static void gauss_box_radii(double sigma, int radii[3])
+{
+    double wi = sqrt(12.0 * sigma * sigma / 3.0 + 1.0);
+    int wl = (int)floor(wi);
+    if (wl % 2 == 0)
+        --wl;
+    if (wl < 1)
+        wl = 1;
+    int wu = wl + 2;
+    int m = (int)floor((12.0 * sigma * sigma - 3.0 * wl * wl - 12.0 * wl - 9.0) / (-4.0 * wl - 4.0) + 0.5);
+    for (int i = 0; i < 3; ++i)
+        radii[i] = ((i < m ? wl : wu) - 1) / 2;
+}
+
+// Umbral adaptativo: blanco si v > media_local - offset.
+// ADAPT_GAUSSIAN aproxima la gaussiana con 3 medias de caja sucesivas (sigma ~ radius / 2).
+int adaptive_threshold(const uint8_t *gray, int width, int height,
+                       int radius, int method, int offset, uint8_t *mask)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "adaptive_threshold");
+    uint8_t *local = (uint8_t *)bmp_malloc((size_t)width * (size_t)height);
+    if (!local)
+        return 0;
+
+    int ok = 1;
+    if (method == ADAPT_GAUSSIAN)
+    {
+        int radii[3];
+        gauss_box_radii(radius > 0 ? radius / 2.0 : 0.5, radii);
+        memcpy(local, gray, (size_t)width * (size_t)height);
+        for (int i = 0; i < 3 && ok; ++i)
+            ok = box_mean_u8(local, local, width, height, radii[i]);
+    }
+    else
+    {
+        ok = box_mean_u8(gray, local, width, height, radius);
+    }
+
+    if (ok)
+    {
+        for (size_t i = 0; i < (size_t)width * (size_t)height; ++i)
+            mask[i] = (int)gray[i] > (int)local[i] - offset ? 255 : 0;
+    }
+    bmp_free(local);
+    stats_end(&sp, (uint64_t)width * height, (uint64_t)width * height, (uint64_t)width * height);
+    return ok;
+}
+
+// --- Redimensionado ---
+
+typedef struct
+{
+    const Pixel24 *src;
+    Pixel24 *dst;
+    int sw, sh, dw, dh;
+    int fx, fy; // factores enteros (caja)
+    int failed; // atomico: una banda sin memoria para sus acumuladores lo pone
+} BoxResizeJob;
+
+// acc[i] += row[i] para n bytes (sumas verticales de la reduccion por caja).
+static void accum_u8_u16_scalar(uint16_t *acc, const uint8_t *row, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        acc[i] = (uint16_t)(acc[i] + row[i]);
+}
+
+// Caja: acumulamos fy filas de origen en una fila de u16 (SIMD) y luego sumamos grupos de fx pixeles.
+static void box_resize_band(void *ctx, int band, int y0, int y1)
+{
+    BoxResizeJob *job = (BoxResizeJob *)ctx;
+    (void)band;
+    size_t n = (size_t)job->sw * 3;
+    uint32_t area = (uint32_t)job->fx * (uint32_t)job->fy;
+    uint32_t *acc = (uint32_t *)bmp_malloc(sizeof(uint32_t) * n);
+    uint16_t *acc16 = (uint16_t *)bmp_malloc(sizeof(uint16_t) * n);
+    if (!acc || !acc16)
+    {
+        bmp_free(acc);
+        bmp_free(acc16);
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int y = y0; y < y1; ++y)
+    {
+        memset(acc, 0, sizeof(uint32_t) * n);
+        // Sumas verticales en u16 en tramos de hasta 257 filas (257 * 255 < 65536)
+        for (int r0 = 0; r0 < job->fy; r0 += 257)
+        {
+            int r1 = r0 + 257 < job->fy ? r0 + 257 : job->fy;
+            memset(acc16, 0, sizeof(uint16_t) * n);
+            for (int r = r0; r < r1; ++r)
+            {
+                const uint8_t *row = (const uint8_t *)&job->src[((size_t)y * job->fy + r) * job->sw];
+                g_kernels.accum_u8_u16(acc16, row, n);
+            }
+            for (size_t i = 0; i < n; ++i)
+                acc[i] += acc16[i];
+        }
+
+        Pixel24 *out = &job->dst[(size_t)y * job->dw];
+        for (int x = 0; x < job->dw; ++x)
+        {
+            uint32_t sb = 0, sg = 0, sr = 0;
+            const uint32_t *a = &acc[(size_t)x * job->fx * 3];
+            for (int k = 0; k < job->fx; ++k)
+            {
+                sb += a[3 * k + 0];
+                sg += a[3 * k + 1];
+                sr += a[3 * k + 2];
+            }
+            out[x].b = (uint8_t)((sb + area / 2) / area);
+            out[x].g = (uint8_t)((sg + area / 2) / area);
+            out[x].r = (uint8_t)((sr + area / 2) / area);
+        }
+    }
+    bmp_free(acc);
+    bmp_free(acc16);
+}
+
+// Tabla de coeficientes de un eje: para cada destino, primer indice de origen y sus pesos normalizados.
+typedef struct
+{
+    int taps;    // maximo de muestras por destino
+    int *start;  // n
+    int *count;  // n
+    float *w;    // n * taps
+} ResampleTable;
+
+static double resize_kernel(int filter, double x)
+{
+    if (x < 0.0)
+        x = -x;
+    if (filter == RESIZE_BILINEAR)
+        return x < 1.0 ? 1.0 - x : 0.0;
+    // Lanczos3
+    if (x < 1e-8)
+        return 1.0;
+    if (x >= 3.0)
+        return 0.0;
+    const double pi = 3.14159265358979323846;
+    return 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x);
+}
+
+static void resample_table_free(ResampleTable *t)
+{
+    bmp_free(t->start);
+    bmp_free(t->count);
+    bmp_free(t->w);
+}
+
+static int resample_table_build(ResampleTable *t, int src_n, int dst_n, int filter)
+{
+    double scale = (double)src_n / dst_n;
+    double fscale = scale > 1.0 ? scale : 1.0; // al reducir, el soporte se estira
+    double support = (filter == RESIZE_BILINEAR ? 1.0 : 3.0) * fscale;
+    t->taps = (int)ceil(support) * 2 + 1;
+    t->start = (int *)bmp_malloc(sizeof(int) * (size_t)dst_n);
+    t->count = (int *)bmp_malloc(sizeof(int) * (size_t)dst_n);
+    t->w = (float *)bmp_malloc(sizeof(float) * (size_t)dst_n * (size_t)t->taps);
+    if (!t->start || !t->count || !t->w)
+    {
+        resample_table_free(t);
+        return 0;
+    }
+
+    for (int i = 0; i < dst_n; ++i)
+    {
+        double center = (i + 0.5) * scale;
+        int j0 = (int)(center - support + 0.5);
+        int j1 = (int)(center + support + 0.5);
+        if (j0 < 0)
+            j0 = 0;
+        if (j1 > src_n)
+            j1 = src_n;
+        if (j1 - j0 > t->taps)
+            j1 = j0 + t->taps;
+
+        float *w = &t->w[(size_t)i * t->taps];
+        double total = 0.0;
+        for (int j = j0; j < j1; ++j)
+        {
+            double v = resize_kernel(filter, (j + 0.5 - center) / fscale);
+            w[j - j0] = (float)v;
+            total += v;
+        }
+        for (int j = j0; j < j1; ++j)
+            w[j - j0] = total != 0.0 ? (float)(w[j - j0] / total) : 0.f;
+        t->start[i] = j0;
+        t->count[i] = j1 - j0;
+    }
+    return 1;
+}
+
+typedef struct
+{
+    const Pixel24 *src;
+    Pixel24 *dst;
+    int sw, sh, dw, dh;
+    const ResampleTable *tx, *ty;
+    int failed; // atomico: una banda sin memoria para su anillo lo pone
+} SepResizeJob;
+
+// Separable horizontal -> vertical. Cada banda guarda solo un anillo de ty->taps filas
+// ya remuestreadas en horizontal; nunca existe la imagen intermedia completa.
+static void sep_resize_band(void *ctx, int band, int y0, int y1)
+{
+    SepResizeJob *job = (SepResizeJob *)ctx;
+    (void)band;
+    const ResampleTable *tx = job->tx, *ty = job->ty;
+    size_t rn = (size_t)job->dw * 3;
+    int ring_n = ty->taps;
+    float *ring = (float *)bmp_malloc(sizeof(float) * rn * (size_t)ring_n);
+    float *acc = (float *)bmp_malloc(sizeof(float) * rn);
+    if (!ring || !acc)
+    {
+        bmp_free(ring);
+        bmp_free(acc);
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    int next_src = -1; // siguiente fila de origen pendiente de remuestrear en horizontal
+    for (int y = y0; y < y1; ++y)
+    {
+        int s0 = ty->start[y], sc = ty->count[y];
+        if (next_src < s0)
+            next_src = s0;
+        for (; next_src < s0 + sc; ++next_src)
+        {
+            const Pixel24 *row = &job->src[(size_t)next_src * job->sw];
+            float *h = &ring[(size_t)(next_src % ring_n) * rn];
+            for (int x = 0; x < job->dw; ++x)
+            {
+                const float *w = &tx->w[(size_t)x * tx->taps];
+                const Pixel24 *p = &row[tx->start[x]];
+                float b = 0.f, g = 0.f, r = 0.f;
+                for (int k = 0; k < tx->count[x]; ++k)
+                {
+                    b += w[k] * p[k].b;
+                    g += w[k] * p[k].g;
+                    r += w[k] * p[k].r;
+                }
+                h[3 * x + 0] = b;
+                h[3 * x + 1] = g;
+                h[3 * x + 2] = r;
+            }
+        }
+
+        // Vertical: combinacion lineal de filas contiguas del anillo (bucle vectorizable)
+        const float *w = &ty->w[(size_t)y * ty->taps];
+        memset(acc, 0, sizeof(float) * rn);
+        for (int k = 0; k < sc; ++k)
+        {
+            const float *h = &ring[(size_t)((s0 + k) % ring_n) * rn];
+            float wk = w[k];
+            for (size_t i = 0; i < rn; ++i)
+                acc[i] += wk * h[i];
+        }
+        uint8_t *out = (uint8_t *)&job->dst[(size_t)y * job->dw];
+        for (size_t i = 0; i < rn; ++i)
+            out[i] = clamp_int_to_u8((int)floorf(acc[i] + 0.5f));
+    }
+    bmp_free(ring);
+    bmp_free(acc);
+}
+
+// Redimensiona a dw x dh. Devuelve en *out un bloque nuevo (el llamador lo libera).
+int resize_bmp24(const Pixel24 *src, int sw, int sh, int dw, int dh, int filter, Pixel24 **out)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "resize_bmp24");
+    if (dw <= 0 || dh <= 0)
+        return 0;
+    int integer_factor = sw % dw == 0 && sh % dh == 0;
+    if (filter == RESIZE_AUTO)
+        filter = integer_factor ? RESIZE_BOX : RESIZE_LANCZOS3;
+    if (filter == RESIZE_BOX && !integer_factor)
+    {
+        fprintf(stderr, "La caja requiere factores de reduccion enteros.\n");
+        return 0;
+    }
+
+    Pixel24 *dst = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)dw * (size_t)dh);
+    if (!dst)
+        return 0;
+
+    int failed;
+    if (filter == RESIZE_BOX)
+    {
+        BoxResizeJob job;
+        job.src = src;
+        job.dst = dst;
+        job.sw = sw;
+        job.sh = sh;
+        job.dw = dw;
+        job.dh = dh;
+        job.fx = sw / dw;
+        job.fy = sh / dh;
+        job.failed = 0;
+        run_bands(dh, sched_tiles(dh), box_resize_band, &job);
+        failed = __atomic_load_n(&job.failed, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        ResampleTable tx, ty;
+        if (!resample_table_build(&tx, sw, dw, filter))
+        {
+            bmp_free(dst);
+            return 0;
+        }
+        if (!resample_table_build(&ty, sh, dh, filter))
+        {
+            resample_table_free(&tx);
+            bmp_free(dst);
+            return 0;
+        }
+        SepResizeJob job;
+        job.src = src;
+        job.dst = dst;
+        job.sw = sw;
+        job.sh = sh;
+        job.dw = dw;
+        job.dh = dh;
+        job.tx = &tx;
+        job.ty = &ty;
+        job.failed = 0;
+        run_bands(dh, sched_tiles(dh), sep_resize_band, &job);
+        failed = __atomic_load_n(&job.failed, __ATOMIC_RELAXED);
+        resample_table_free(&tx);
+        resample_table_free(&ty);
+    }
+    if (failed)
+    {
+        bmp_free(dst); // alguna banda quedo sin escribir
+        return 0;
+    }
+
+    *out = dst;
+    stats_end(&sp, 3 * (uint64_t)sw * sh, 3 * (uint64_t)dw * dh, (uint64_t)dw * dh);
+    return 1;
+}
+
+// --- Piramide de imagenes (mipmaps) en una sola lectura ---
+// Cada nivel k (1/2^k) guarda solo una fila pendiente del nivel anterior: al llegar la segunda
+// fila del par se promedia el bloque 2x2, se escribe la fila resultante y se pasa al nivel siguiente.
+// Como la lectura y la escritura de BMP van ambas de ABAJO hacia ARRIBA, las filas se emiten
+// directamente en orden de archivo. Dimensiones impares: se descarta la ultima columna/fila.
+#define PYRAMID_MAX_LEVELS 32
+
+typedef struct
+{
+    int levels;
+    int width[PYRAMID_MAX_LEVELS + 1];
+    int height[PYRAMID_MAX_LEVELS + 1];
+    Pixel24 *pending[PYRAMID_MAX_LEVELS + 1]; // fila esperando pareja (entrada del nivel k)
+    int has_pending[PYRAMID_MAX_LEVELS + 1];
+    Pixel24 *out_row[PYRAMID_MAX_LEVELS + 1];
+    BMPWriter writer[PYRAMID_MAX_LEVELS + 1];
+    int ok;
+} PyramidBuilder;
+
+static void pyramid_free(PyramidBuilder *pb)
+{
+    for (int k = 1; k <= pb->levels; ++k)
+    {
+        bmp_free(pb->pending[k]);
+        bmp_free(pb->out_row[k]);
+        if (pb->writer[k].f && !bmp_writer_close(&pb->writer[k]))
+            pb->ok = 0;
+    }
+}
+
+// Prepara los niveles 1..max_levels (0 = todos hasta 1 pixel) y abre <prefix>_<k>.bmp de cada uno.
+static int pyramid_open(PyramidBuilder *pb, const BMPInfoHeader *ih, const char *prefix, int max_levels)
+{
+    memset(pb, 0, sizeof(*pb));
+    pb->ok = 1;
+    pb->width[0] = ih->biWidth;
+    pb->height[0] = ih->biHeight;
+    if (max_levels <= 0 || max_levels > PYRAMID_MAX_LEVELS)
+        max_levels = PYRAMID_MAX_LEVELS;
+
+    for (int k = 1; k <= max_levels; ++k)
+    {
+        int w = pb->width[k - 1] / 2, h = pb->height[k - 1] / 2;
+        if (w < 1 || h < 1)
+            break;
+        pb->width[k] = w;
+        pb->height[k] = h;
+        pb->levels = k;
+
+        char name[512];
+        snprintf(name, sizeof(name), "%s_%d.bmp", prefix, k);
+        BMPInfoHeader lih = *ih;
+        lih.biWidth = w;
+        lih.biHeight = h;
+        pb->pending[k] = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)pb->width[k - 1]);
+        pb->out_row[k] = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)w);
+        if (!pb->pending[k] || !pb->out_row[k] || !bmp_writer_open(&pb->writer[k], name, &lih))
+        {
+            pb->ok = 0;
+            pyramid_free(pb);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Entrega una fila (orden de archivo) al nivel k; la cascada sigue hacia los niveles inferiores.
+static void pyramid_push_row(PyramidBuilder *pb, int k, const Pixel24 *row)
+{
+    for (; k <= pb->levels && pb->ok; ++k)
+    {
+        if (!pb->has_pending[k])
+        {
+            memcpy(pb->pending[k], row, sizeof(Pixel24) * (size_t)pb->width[k - 1]);
+            pb->has_pending[k] = 1;
+            return;
+        }
+        pb->has_pending[k] = 0;
+        if (pb->writer[k].rows_done >= pb->height[k])
+            return; // fila impar sobrante
+
+        const Pixel24 *a = pb->pending[k];
+        Pixel24 *out = pb->out_row[k];
+        for (int x = 0; x < pb->width[k]; ++x)
+        {
+            const Pixel24 *p = &a[2 * x], *q = &row[2 * x];
+            out[x].b = (uint8_t)((p[0].b + p[1].b + q[0].b + q[1].b + 2) >> 2);
+            out[x].g = (uint8_t)((p[0].g + p[1].g + q[0].g + q[1].g + 2) >> 2);
+            out[x].r = (uint8_t)((p[0].r + p[1].r + q[0].r + q[1].r + 2) >> 2);
+        }
+        if (!bmp_writer_put_row(&pb->writer[k], out))
+            pb->ok = 0;
+        row = out;
+    }
+}
+
+// Piramide leyendo el archivo una sola vez, fila a fila, sin cargar la imagen completa.
+int build_pyramid_bmp24(const char *in_name, const char *prefix, int max_levels)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "build_pyramid");
+    BmpStreamReader rd;
+    if (!bmp_stream_open(&rd, in_name, 0, 0))
+        return 0;
+    PyramidBuilder pb;
+    Pixel24 *row = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)rd.width);
+    if (!row || !pyramid_open(&pb, &rd.ih, prefix, max_levels))
+    {
+        bmp_free(row);
+        bmp_stream_close(&rd);
+        return 0;
+    }
+    while (pb.ok && bmp_stream_next_row(&rd, row))
+        pyramid_push_row(&pb, 1, row);
+    if (rd.rows_done != rd.height)
+        pb.ok = 0;
+
+    pyramid_free(&pb);
+    bmp_free(row);
+    bmp_stream_close(&rd);
+    stats_end(&sp, 3 * (uint64_t)pb.width[0] * pb.height[0], 0, (uint64_t)pb.width[0] * pb.height[0]);
+    return pb.ok;
+}
+
+// Igual, pero desde una imagen ya cargada (ARRIBA hacia ABAJO): se recorre en orden de archivo.
+int build_pyramid_from_pixels(const Pixel24 *pixels, const BMPInfoHeader *ih, const char *prefix, int max_levels)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "build_pyramid");
+    PyramidBuilder pb;
+    if (!pyramid_open(&pb, ih, prefix, max_levels))
+        return 0;
+    for (int y = ih->biHeight - 1; y >= 0 && pb.ok; --y)
+        pyramid_push_row(&pb, 1, &pixels[(size_t)y * ih->biWidth]);
+    pyramid_free(&pb);
+    stats_end(&sp, 3 * (uint64_t)pb.width[0] * pb.height[0], 0, (uint64_t)pb.width[0] * pb.height[0]);
+    return pb.ok;
+}
+
+// --- Operaciones geometricas: rotacion, transposicion y espejos ---
+// La rotacion de 90 grados escribe en columnas: para no castigar cache y TLB se subdivide
+// recursivamente (cache-oblivious) hasta bloques que caben en L1 tanto en origen como en destino.
+#define ROT_BLOCK_PIXELS 256 // 16x16 pixeles = 768 bytes por lado
+
+typedef struct
+{
+    const Pixel24 *src;
+    Pixel24 *dst;
+    int width;
+    ptrdiff_t base, sx, sy; // destino(x, y) = dst[base + x*sx + y*sy]
+} RotateJob;
+
+static void rotate_block(const RotateJob *job, int x0, int x1, int y0, int y1)
+{
+    int bw = x1 - x0, bh = y1 - y0;
+    if (bw * bh <= ROT_BLOCK_PIXELS || (bw == 1 && bh == 1))
+    {
+        for (int y = y0; y < y1; ++y)
+        {
+            const Pixel24 *s = &job->src[(size_t)y * job->width];
+            Pixel24 *d = job->dst + job->base + (ptrdiff_t)y * job->sy;
+            for (int x = x0; x < x1; ++x)
+                d[(ptrdiff_t)x * job->sx] = s[x];
+        }
+        return;
+    }
+    // Partimos el lado mas largo
+    if (bw >= bh)
+    {
+        int xm = x0 + bw / 2;
+        rotate_block(job, x0, xm, y0, y1);
+        rotate_block(job, xm, x1, y0, y1);
+    }
+    else
+    {
+        int ym = y0 + bh / 2;
+        rotate_block(job, x0, x1, y0, ym);
+        rotate_block(job, x0, x1, ym, y1);
+    }
+}
+
+static void rotate_band(void *ctx, int band, int y0, int y1)
+{
+    RotateJob *job = (RotateJob *)ctx;
+    (void)band;
+    // Cada banda de filas de origen se subdivide por separado
+    rotate_block(job, 0, job->width, y0, y1);
+}
+
+// Transpone o rota 90/270 grados. *out es un bloque nuevo de height x width (el llamador lo libera).
+int rotate_bmp24(const Pixel24 *src, int width, int height, int mode, Pixel24 **out)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "rotate_bmp24");
+    Pixel24 *dst = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * (size_t)width * (size_t)height);
+    if (!dst)
+        return 0;
+
+    // La imagen destino mide height de ancho y width de alto
+    RotateJob job;
+    job.src = src;
+    job.dst = dst;
+    job.width = width;
+    if (mode == ROTATE_90)
+    { // destino(h-1-y, x)
+        job.base = height - 1;
+        job.sx = height;
+        job.sy = -1;
+    }
+    else if (mode == ROTATE_270)
+    { // destino(y, w-1-x)
+        job.base = (ptrdiff_t)(width - 1) * height;
+        job.sx = -(ptrdiff_t)height;
+        job.sy = 1;
+    }
+    else
+    { // destino(y, x)
+        job.base = 0;
+        job.sx = height;
+        job.sy = 1;
+    }
+    run_bands(height, sched_tiles(height), rotate_band, &job);
+    *out = dst;
+    stats_end_image(&sp, width, height);
+    return 1;
+}
+
+// Espejo horizontal en el lugar: cada fila se invierte (intercambio desde ambos extremos).
+void flip_horizontal(Pixel24 *pixels, int width, int height)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "flip_horizontal");
+    for (int y = 0; y < height; ++y)
+    {
+        Pixel24 *row = &pixels[(size_t)y * width];
+        for (int a = 0, b = width - 1; a < b; ++a, --b)
+        {
+            Pixel24 t = row[a];
+            row[a] = row[b];
+            row[b] = t;
+        }
+    }
+    stats_end_image(&sp, width, height);
+}
+
+// Espejo vertical en el lugar: intercambio de filas completas con memcpy.
+int flip_vertical(Pixel24 *pixels, int width, int height)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "flip_vertical");
+    size_t row_size = sizeof(Pixel24) * (size_t)width;
+    Pixel24 *tmp = (Pixel24 *)bmp_malloc(row_size);
+    if (!tmp)
+        return 0;
+    for (int a = 0, b = height - 1; a < b; ++a, --b)
+    {
+        memcpy(tmp, &pixels[(size_t)a * width], row_size);
+        memcpy(&pixels[(size_t)a * width], &pixels[(size_t)b * width], row_size);
+        memcpy(&pixels[(size_t)b * width], tmp, row_size);
+    }
+    bmp_free(tmp);
+    stats_end_image(&sp, width, height);
+    return 1;
+}
+
+// Rotacion de 180 grados en el lugar (equivale a invertir el arreglo completo).
+void rotate180(Pixel24 *pixels, int width, int height)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "rotate180");
+    size_t n = (size_t)width * (size_t)height;
+    for (size_t a = 0, b = n - 1; n && a < b; ++a, --b)
+    {
+        Pixel24 t = pixels[a];
+        pixels[a] = pixels[b];
+        pixels[b] = t;
+    }
+    stats_end_image(&sp, width, height);
+}
+
+// --- Morfologia (van Herk / Gil-Werman) ---
+// Erosion/dilatacion con elemento rectangular separable. Por cada linea se calculan minimos
+// (o maximos) acumulados hacia adelante (g) y hacia atras (hh) dentro de bloques de k muestras;
+// cualquier ventana de k muestras es min(hh[inicio], g[fin]): 3 comparaciones por pixel
+// sin importar el tamano del elemento. La linea se rellena con el neutro (255 para min, 0 para max).
+
+static inline uint8_t morph_pick(uint8_t a, uint8_t b, int is_max)
+{
+    return is_max ? (a > b ? a : b) : (a < b ? a : b);
+}
+
+// d[i] = min/max(a[i], b[i]) para n bytes (g_kernels.minmax_rows).
+static void minmax_rows_scalar(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t n, int is_max)
+{
+    for (size_t i = 0; i < n; ++i)
+        d[i] = morph_pick(a[i], b[i], is_max);
+}
+
+typedef struct
+{
+    uint8_t *plane;
+    int width, height, k, is_max;
+    uint8_t *g, *hh; // planos de (height + k - 1) filas para la pasada vertical
+    int failed;      // atomico: una banda sin memoria para sus buffers lo pone
+} MorphJob;
+
+// Pasada horizontal: van Herk/Gil-Werman escalar por fila con buffers propios de cada banda.
+static void morph_h_band(void *ctx, int band, int y0, int y1)
+{
+    MorphJob *job = (MorphJob *)ctx;
+    (void)band;
+    int k = job->k, w = job->width, a = k / 2;
+    int len = w + k - 1;
+    uint8_t neutral = job->is_max ? 0 : 255;
+    uint8_t *line = (uint8_t *)bmp_malloc((size_t)len * 3);
+    if (!line)
+    {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint8_t *g = line + len, *hh = line + 2 * (size_t)len;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        uint8_t *row = &job->plane[(size_t)y * w];
+        memset(line, neutral, (size_t)len);
+        memcpy(line + a, row, (size_t)w);
+        for (int i = 0; i < len; ++i)
+            g[i] = (i % k == 0) ? line[i] : morph_pick(g[i - 1], line[i], job->is_max);
+        for (int i = len - 1; i >= 0; --i)
+            hh[i] = (i % k == k - 1 || i == len - 1) ? line[i] : morph_pick(hh[i + 1], line[i], job->is_max);
+        for (int x = 0; x < w; ++x)
+            row[x] = morph_pick(hh[x], g[x + k - 1], job->is_max);
+    }
+    bmp_free(line);
+}
+
+// Pasada vertical, parte 1: g y hh por bloques de k filas (cada banda son bloques completos).
+// Las operaciones son entre filas enteras, asi que vectorizan con min/max de u8.
+static void morph_v_blocks_band(void *ctx, int band, int b0, int b1)
+{
+    MorphJob *job = (MorphJob *)ctx;
+    (void)band;
+    int k = job->k, w = job->width, a = k / 2;
+    int len = job->height + k - 1;
+    uint8_t *neutral = (uint8_t *)bmp_malloc((size_t)w);
+    if (!neutral)
+    {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memset(neutral, job->is_max ? 0 : 255, (size_t)w);
+
+    for (int blk = b0; blk < b1; ++blk)
+    {
+        int i0 = blk * k;
+        int i1 = i0 + k < len ? i0 + k : len;
+        for (int i = i0; i < i1; ++i)
+        {
+            int y = i - a;
+            const uint8_t *src = (y >= 0 && y < job->height) ? &job->plane[(size_t)y * w] : neutral;
+            uint8_t *g = &job->g[(size_t)i * w];
+            if (i == i0)
+                memcpy(g, src, (size_t)w);
+            else
+                g_kernels.minmax_rows(g, g - w, src, (size_t)w, job->is_max);
+        }
+        for (int i = i1 - 1; i >= i0; --i)
+        {
+            int y = i - a;
+            const uint8_t *src = (y >= 0 && y < job->height) ? &job->plane[(size_t)y * w] : neutral;
+            uint8_t *hh = &job->hh[(size_t)i * w];
+            if (i == i1 - 1)
+                memcpy(hh, src, (size_t)w);
+            else
+                g_kernels.minmax_rows(hh, hh + w, src, (size_t)w, job->is_max);
+        }
+    }
+    bmp_free(neutral);
+}
+
+// Pasada vertical, parte 2: salida(y) = min/max(hh[y], g[y + k - 1]).
+static void morph_v_combine_band(void *ctx, int band, int y0, int y1)
+{
+    MorphJob *job = (MorphJob *)ctx;
+    (void)band;
+    size_t w = (size_t)job->width;
+    for (int y = y0; y < y1; ++y)
+        g_kernels.minmax_rows(&job->plane[y * w], &job->hh[y * w], &job->g[(y + job->k - 1) * w], w, job->is_max);
+}
+
+// Erosion (is_max = 0) o dilatacion (is_max = 1) en el lugar con elemento se_w x se_h.
+static int morph_basic(uint8_t *plane, int width, int height, int se_w, int se_h, int is_max)
+{
+    MorphJob job;
+    job.plane = plane;
+    job.width = width;
+    job.height = height;
+    job.is_max = is_max;
+    job.g = job.hh = NULL;
+    job.failed = 0;
+
+    if (se_w > 1)
+    {
+        job.k = se_w;
+        run_bands(height, sched_tiles(height), morph_h_band, &job);
+        if (__atomic_load_n(&job.failed, __ATOMIC_RELAXED))
+            return 0;
+    }
+    if (se_h > 1)
+    {
+        job.k = se_h;
+        size_t len = (size_t)height + (size_t)se_h - 1;
+        job.g = (uint8_t *)bmp_malloc(len * (size_t)width);
+        job.hh = (uint8_t *)bmp_malloc(len * (size_t)width);
+        if (!job.g || !job.hh)
+        {
+            bmp_free(job.g);
+            bmp_free(job.hh);
+            return 0;
+        }
+        int nblocks = (int)((len + (size_t)se_h - 1) / (size_t)se_h);
+        run_bands(nblocks, sched_tiles(nblocks), morph_v_blocks_band, &job);
+        // Con bloques sin hacer g y hh tienen filas sin inicializar: no se combinan
+        int failed = __atomic_load_n(&job.failed, __ATOMIC_RELAXED);
+        if (!failed)
+            run_bands(height, sched_tiles(height), morph_v_combine_band, &job);
+        bmp_free(job.g);
+        bmp_free(job.hh);
+        if (failed)
+            return 0;
+    }
+    return 1;
+}
+
+// Operacion morfologica MORPH_* sobre un plano de un canal (gris o mascara binaria 0/255).
+int morph_plane(uint8_t *plane, int width, int height, int se_w, int se_h, int op)
+{
+    if (op == MORPH_ERODE || op == MORPH_DILATE)
+        return morph_basic(plane, width, height, se_w, se_h, op == MORPH_DILATE);
+
+    size_t n = (size_t)width * (size_t)height;
+    uint8_t *orig = NULL;
+    if (op == MORPH_TOPHAT || op == MORPH_BLACKHAT)
+    {
+        orig = (uint8_t *)bmp_malloc(n);
+        if (!orig)
+            return 0;
+        memcpy(orig, plane, n);
+    }
+
+    // Apertura = erosion + dilatacion; cierre = dilatacion + erosion
+    int first_max = (op == MORPH_CLOSE || op == MORPH_BLACKHAT);
+    int ok = morph_basic(plane, width, height, se_w, se_h, first_max) &&
+             morph_basic(plane, width, height, se_w, se_h, !first_max);
+
+    if (ok && op == MORPH_TOPHAT)
+        for (size_t i = 0; i < n; ++i)
+            plane[i] = (uint8_t)(orig[i] - plane[i]); // apertura <= original
+    else if (ok && op == MORPH_BLACKHAT)
+        for (size_t i = 0; i < n; ++i)
+            plane[i] = (uint8_t)(plane[i] - orig[i]); // cierre >= original
+    bmp_free(orig);
+    return ok;
+}
+
+// Morfologia sobre una imagen en escala de grises (r = g = b), como la deja to_grayscale.
+int morph_bmp24(Pixel24 *pixels, int width, int height, int se_w, int se_h, int op)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "morph_bmp24");
+    size_t n = (size_t)width * (size_t)height;
+    uint8_t *plane = (uint8_t *)bmp_malloc(n);
+    if (!plane)
+        return 0;
+    for (size_t i = 0; i < n; ++i)
+        plane[i] = pixels[i].r; // r=g=b en gris
+    int ok = morph_plane(plane, width, height, se_w, se_h, op);
+    if (ok)
+        for (size_t i = 0; i < n; ++i)
+            pixels[i].r = pixels[i].g = pixels[i].b = plane[i];
+    bmp_free(plane);
+    stats_end_image(&sp, width, height);
+    return ok;
+}
+
+// --- Desenfoque rapido en punto flotante (base de filtros que lo necesiten) ---
+// Caja con sumas corridas: costo por pixel constante sin importar el radio. En los bordes
+// se promedia solo lo que cae dentro de la imagen. Tres cajas seguidas aproximan una gaussiana.
+#define BOX_V_BLOCK 64 // filas minimas entre reinicios de la suma vertical
+
+typedef struct
+{
+    const float *src;
+    float *dst;
+    int width, height, radius;
+    int block; // filas por bloque de la pasada vertical (multiplo de BOX_V_BLOCK)
+    // Si sharpen_out no es NULL, la pasada vertical no escribe dst: combina con el original
+    // (mascara de enfoque) y escribe el resultado final en u8.
+    const uint8_t *orig;
+    uint8_t *sharpen_out;
+    float amount;
+    int threshold;
+    int failed; // atomico: una banda sin memoria para su acumulador lo pone
+} BoxF32Job;
+
+static void box_h_f32_band(void *ctx, int band, int y0, int y1)
+{
+    BoxF32Job *job = (BoxF32Job *)ctx;
+    (void)band;
+    int w = job->width, r = job->radius;
+    for (int y = y0; y < y1; ++y)
+    {
+        const float *s = &job->src[(size_t)y * w];
+        float *d = &job->dst[(size_t)y * w];
+        double acc = 0.0;
+        for (int x = 0; x < r && x < w; ++x)
+            acc += s[x];
+        for (int x = 0; x < w; ++x)
+        {
+            if (x + r < w)
+                acc += s[x + r];
+            if (x - r - 1 >= 0)
+                acc -= s[x - r - 1];
+            int xa = x - r < 0 ? 0 : x - r;
+            int xb = x + r >= w ? w - 1 : x + r;
+            d[x] = (float)(acc / (xb - xa + 1));
+        }
+    }
+}
+
+// Vertical fila a fila: un acumulador por columna, se suma la fila que entra y se resta la que sale.
+// Al comienzo de cada bloque la suma se rehace con la ventana exacta [y - r, y + r]: el valor de
+// una fila depende solo de y y no de donde empieza su banda (las bandas son bloques completos),
+// y una banda lee filas [y0 - r, y1 + r), sin pasar del halo de radius filas.
+static void box_v_f32_band(void *ctx, int band, int y0, int y1)
+{
+    BoxF32Job *job = (BoxF32Job *)ctx;
+    (void)band;
+    int w = job->width, h = job->height, r = job->radius;
+    double *acc = (double *)bmp_malloc(sizeof(double) * (size_t)w);
+    if (!acc)
+    {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int y = y0; y < y1; ++y)
+    {
+        int ya = y - r < 0 ? 0 : y - r;
+        int yb = y + r >= h ? h - 1 : y + r;
+        if (y == y0 || y % job->block == 0)
+        {
+            memset(acc, 0, sizeof(double) * (size_t)w);
+            for (int yy = ya; yy <= yb; ++yy)
+            {
+                const float *s = &job->src[(size_t)yy * w];
+                for (int x = 0; x < w; ++x)
+                    acc[x] += s[x];
+            }
+        }
+        else
+        {
+            if (y + r < h)
+            {
+                const float *s = &job->src[(size_t)(y + r) * w];
+                for (int x = 0; x < w; ++x)
+                    acc[x] += s[x];
+            }
+            if (y - r - 1 >= 0)
+            {
+                const float *s = &job->src[(size_t)(y - r - 1) * w];
+                for (int x = 0; x < w; ++x)
+                    acc[x] -= s[x];
+            }
+        }
+        double inv = 1.0 / (yb - ya + 1);
+        if (job->sharpen_out)
+        {
+            // original + amount * (original - desenfocado), solo donde la diferencia supera el umbral
+            const uint8_t *o = &job->orig[(size_t)y * w];
+            uint8_t *d = &job->sharpen_out[(size_t)y * w];
+            for (int x = 0; x < w; ++x)
+            {
+                float diff = o[x] - (float)(acc[x] * inv);
+                if (fabsf(diff) >= (float)job->threshold)
+                    d[x] = clamp_int_to_u8((int)floorf(o[x] + job->amount * diff + 0.5f));
+                else
+                    d[x] = o[x];
+            }
+            continue;
+        }
+        float *d = &job->dst[(size_t)y * w];
+        for (int x = 0; x < w; ++x)
+            d[x] = (float)(acc[x] * inv);
+    }
+    bmp_free(acc);
+}
+
+static void box_f32_job(BoxF32Job *job, const float *src, float *dst, int width, int height, int radius)
+{
+    job->src = src;
+    job->dst = dst;
+    job->width = width;
+    job->height = height;
+    job->radius = radius;
+    // Bloques de al menos 8 radios: rehacer la ventana (2r + 1 filas) cuesta poco frente al bloque
+    job->block = BOX_V_BLOCK;
+    while (job->block < 8 * radius && job->block < height)
+        job->block *= 2;
+    job->orig = NULL;
+    job->sharpen_out = NULL;
+    job->amount = 0.f;
+    job->threshold = 0;
+    job->failed = 0;
+}
+
+// Las teselas de box_hv_f32 son bloques de v->block filas; estas envolturas pasan de bloques a filas.
+static void box_h_f32_blocks_band(void *ctx, int band, int b0, int b1)
+{
+    BoxF32Job *job = (BoxF32Job *)ctx;
+    int y1 = b1 * job->block;
+    box_h_f32_band(ctx, band, b0 * job->block, y1 < job->height ? y1 : job->height);
+}
+
+static void box_v_f32_blocks_band(void *ctx, int band, int b0, int b1)
+{
+    BoxF32Job *job = (BoxF32Job *)ctx;
+    int y1 = b1 * job->block;
+    box_v_f32_band(ctx, band, b0 * job->block, y1 < job->height ? y1 : job->height);
+}
+
+// Caja horizontal (h) y luego vertical (v, que lee la salida de h) por teselas de bloques: la
+// vertical de una tesela arranca cuando la horizontal termino sus filas y las radius de halo
+// (redondeadas a bloques). Como las teselas empiezan en un limite de bloque, el resultado no
+// depende de BMP_THREADS. Devuelve 0 si a alguna banda le falto memoria.
+static int box_hv_f32(BoxF32Job *h, BoxF32Job *v)
+{
+    int nblocks = (v->height + v->block - 1) / v->block;
+    h->block = v->block;
+    run_bands_halo(nblocks, sched_tiles(nblocks), box_h_f32_blocks_band, h, box_v_f32_blocks_band, v,
+                   (v->radius + v->block - 1) / v->block);
+    return !__atomic_load_n(&v->failed, __ATOMIC_RELAXED);
+}
+
+// Gaussiana aproximada (3 cajas H+V) en el lugar; tmp es un plano auxiliar del mismo tamano.
+int gauss_blur_f32(float *plane, float *tmp, int width, int height, double sigma)
+{
+    int radii[3];
+    gauss_box_radii(sigma, radii);
+    for (int i = 0; i < 3; ++i)
+    {
+        if (radii[i] <= 0)
+            continue;
+        BoxF32Job h, v;
+        box_f32_job(&h, plane, tmp, width, height, radii[i]);
+        box_f32_job(&v, tmp, plane, width, height, radii[i]);
+        if (!box_hv_f32(&h, &v))
+            return 0;
+    }
+    return 1;
+}
+
+// --- Filtro bilateral ---
+// Aproximacion lineal a trozos por cuantizacion del rango: para N niveles i_k se filtran
+// espacialmente W_k = exp(-(I - i_k)^2 / 2 sr^2) y W_k * I con la gaussiana rapida, y cada
+// pixel interpola entre los dos niveles que encierran su valor. El costo es N desenfoques,
+// independiente de sigma espacial. Se procesa cada canal por separado.
+static int bilateral_plane_fast(uint8_t *plane, int width, int height,
+                                double sigma_s, double sigma_r, int levels)
+{
+    size_t n = (size_t)width * (size_t)height;
+    int vmin = 255, vmax = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (plane[i] < vmin)
+            vmin = plane[i];
+        if (plane[i] > vmax)
+            vmax = plane[i];
+    }
+    if (vmax == vmin)
+        return 1;
+    if (levels <= 0)
+        levels = (int)ceil((vmax - vmin) / sigma_r) + 1;
+    if (levels < 2)
+        levels = 2;
+    if (levels > 64)
+        levels = 64;
+
+    float *wk = (float *)bmp_malloc(sizeof(float) * n);
+    float *jk = (float *)bmp_malloc(sizeof(float) * n);
+    float *tmp = (float *)bmp_malloc(sizeof(float) * n);
+    float *out = (float *)bmp_calloc(n, sizeof(float));
+    if (!wk || !jk || !tmp || !out)
+    {
+        bmp_free(wk);
+        bmp_free(jk);
+        bmp_free(tmp);
+        bmp_free(out);
+        return 0;
+    }
+
+    float range_w[256];
+    double step = (double)(vmax - vmin) / (levels - 1);
+    for (int k = 0; k < levels; ++k)
+    {
+        double ik = vmin + k * step;
+        for (int v = 0; v < 256; ++v)
+            range_w[v] = (float)exp(-(v - ik) * (v - ik) / (2.0 * sigma_r * sigma_r));
+        for (size_t i = 0; i < n; ++i)
+        {
+            wk[i] = range_w[plane[i]];
+            jk[i] = wk[i] * plane[i];
+        }
+        if (!gauss_blur_f32(wk, tmp, width, height, sigma_s) || !gauss_blur_f32(jk, tmp, width, height, sigma_s))
+        {
+            bmp_free(wk);
+            bmp_free(jk);
+            bmp_free(tmp);
+            bmp_free(out);
+            return 0;
+        }
+
+        // Peso de interpolacion del nivel k para cada pixel (triangulo centrado en i_k)
+        for (size_t i = 0; i < n; ++i)
+        {
+            double t = fabs((plane[i] - ik) / step);
+            if (t < 1.0)
+                out[i] += (float)((1.0 - t) * (wk[i] > 1e-12f ? jk[i] / wk[i] : plane[i]));
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        plane[i] = clamp_int_to_u8((int)(out[i] + 0.5f));
+    bmp_free(wk);
+    bmp_free(jk);
+    bmp_free(tmp);
+    bmp_free(out);
+    return 1;
+}
+
+// Aplica fn a cada canal de la imagen por separado (plano de un canal, en el lugar).
+static int for_each_channel(Pixel24 *pixels, int width, int height,
+                            int (*fn)(uint8_t *, int, int, double, double, int),
+                            double a, double b, int c)
+{
+    size_t n = (size_t)width * (size_t)height;
+    uint8_t *plane = (uint8_t *)bmp_malloc(n);
+    if (!plane)
+        return 0;
+    int ok = 1;
+    for (int ch = 0; ch < 3 && ok; ++ch)
+    {
+        uint8_t *base = (uint8_t *)pixels + ch;
+        for (size_t i = 0; i < n; ++i)
+            plane[i] = base[3 * i];
+        ok = fn(plane, width, height, a, b, c);
+        for (size_t i = 0; ok && i < n; ++i)
+            base[3 * i] = plane[i];
+    }
+    bmp_free(plane);
+    return ok;
+}
+
+// Bilateral rapido. levels = 0 elige el numero de niveles segun sigma_r.
+int bilateral_filter_bmp24(Pixel24 *pixels, int width, int height,
+                           double sigma_s, double sigma_r, int levels)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "bilateral_filter");
+    int ok = for_each_channel(pixels, width, height, bilateral_plane_fast, sigma_s, sigma_r, levels);
+    stats_end_image(&sp, width, height);
+    return ok;
+}
+
+typedef struct
+{
+    const uint8_t *src;
+    uint8_t *dst;
+    int width, height, radius;
+    const float *spatial; // (2r+1)^2
+    const float *range;   // 256
+} BilateralRefJob;
+
+static void bilateral_ref_band(void *ctx, int band, int y0, int y1)
+{
+    BilateralRefJob *job = (BilateralRefJob *)ctx;
+    (void)band;
+    int r = job->radius, w = job->width, h = job->height, side = 2 * r + 1;
+    for (int y = y0; y < y1; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            int c = job->src[(size_t)y * w + x];
+            double acc = 0.0, norm = 0.0;
+            for (int dy = -r; dy <= r; ++dy)
+            {
+                int yy = y + dy;
+                if (yy < 0 || yy >= h)
+                    continue;
+                const uint8_t *row = &job->src[(size_t)yy * w];
+                const float *sw = &job->spatial[(size_t)(dy + r) * side + r];
+                for (int dx = -r; dx <= r; ++dx)
+                {
+                    int xx = x + dx;
+                    if (xx < 0 || xx >= w)
+                        continue;
+                    int v = row[xx];
+                    double wgt = sw[dx] * job->range[v > c ? v - c : c - v];
+                    acc += wgt * v;
+                    norm += wgt;
+                }
+            }
+            job->dst[(size_t)y * w + x] = clamp_int_to_u8((int)(acc / norm + 0.5));
+        }
+    }
+}
+
+// Referencia por fuerza bruta (ventana de radio 3 sigma), solo para medir la aproximacion.
+static int bilateral_plane_reference(uint8_t *plane, int width, int height,
+                                     double sigma_s, double sigma_r, int unused)
+{
+    (void)unused;
+    int r = (int)ceil(3.0 * sigma_s);
+    int side = 2 * r + 1;
+    size_t n = (size_t)width * (size_t)height;
+    float *spatial = (float *)bmp_malloc(sizeof(float) * (size_t)side * side);
+    uint8_t *dst = (uint8_t *)bmp_malloc(n);
+    float range[256];
+    if (!spatial || !dst)
+    {
+        bmp_free(spatial);
+        bmp_free(dst);
+        return 0;
+    }
+    for (int dy = -r; dy <= r; ++dy)
+        for (int dx = -r; dx <= r; ++dx)
+            spatial[(dy + r) * side + dx + r] = (float)exp(-(dx * dx + dy * dy) / (2.0 * sigma_s * sigma_s));
+    for (int d = 0; d < 256; ++d)
+        range[d] = (float)exp(-(double)d * d / (2.0 * sigma_r * sigma_r));
+
+    BilateralRefJob job;
+    job.src = plane;
+    job.dst = dst;
+    job.width = width;
+    job.height = height;
+    job.radius = r;
+    job.spatial = spatial;
+    job.range = range;
+    run_bands(height, sched_tiles(height), bilateral_ref_band, &job);
+    memcpy(plane, dst, n);
+    bmp_free(spatial);
+    bmp_free(dst);
+    return 1;
+}
+
+int bilateral_reference_bmp24(Pixel24 *pixels, int width, int height, double sigma_s, double sigma_r)
+{
+    return for_each_channel(pixels, width, height, bilateral_plane_reference, sigma_s, sigma_r, 0);
+}
+
+// --- Mascara de enfoque (unsharp mask) ---
+// Reutiliza la gaussiana de 3 cajas; la combinacion original + amount * (original - desenfocado)
+// se hace dentro de la ultima pasada vertical, asi que cuesta un desenfoque y nada mas.
+static int unsharp_plane(uint8_t *plane, int width, int height, double radius, double amount, int threshold)
+{
+    size_t n = (size_t)width * (size_t)height;
+    int radii[3];
+    gauss_box_radii(radius, radii);
+    int last = -1;
+    for (int i = 0; i < 3; ++i)
+        if (radii[i] > 0)
+            last = i;
+    if (last < 0 || amount == 0.0)
+        return 1; // radio demasiado chico: el desenfoque es la identidad
+
+    float *f = (float *)bmp_malloc(sizeof(float) * n);
+    float *tmp = (float *)bmp_malloc(sizeof(float) * n);
+    uint8_t *orig = (uint8_t *)bmp_malloc(n);
+    if (!f || !tmp || !orig)
+    {
+        bmp_free(f);
+        bmp_free(tmp);
+        bmp_free(orig);
+        return 0;
+    }
+    memcpy(orig, plane, n);
+    for (size_t i = 0; i < n; ++i)
+        f[i] = plane[i];
+
+    int ok = 1;
+    for (int i = 0; i <= last && ok; ++i)
+    {
+        if (radii[i] <= 0)
+            continue;
+        BoxF32Job h, v;
+        box_f32_job(&h, f, tmp, width, height, radii[i]);
+        box_f32_job(&v, tmp, i < last ? f : NULL, width, height, radii[i]);
+        if (i == last)
+        {
+            v.orig = orig;
+            v.sharpen_out = plane;
+            v.amount = (float)amount;
+            v.threshold = threshold;
+        }
+        ok = box_hv_f32(&h, &v);
+    }
+
+    bmp_free(f);
+    bmp_free(tmp);
+    bmp_free(orig);
+    return ok;
+}
+
+// Enfoca cada canal. radius es el sigma de la gaussiana en pixeles, amount la fuerza (1 = 100%)
+// y threshold la diferencia minima (0..255) para tocar un pixel, asi no se realza el ruido plano.
+int unsharp_mask_bmp24(Pixel24 *pixels, int width, int height, double radius, double amount, int threshold)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "unsharp_mask");
+    int ok = for_each_channel(pixels, width, height, unsharp_plane, radius, amount, threshold);
+    stats_end_image(&sp, width, height);
+    return ok;
+}
+
+// --- Espacios de color (YCbCr, HSV, Lab) ---
+// Las conversiones trabajan por trozos: se separan B, G y R de un bloque de pixeles en buffers
+// pequenos (pshufb) y se convierten en planos de 8 bits. YCbCr usa una matriz en punto fijo
+// (madd de pares i16); HSV y Lab se aceleran con tablas.
+#define COLOR_CHUNK 1024 // pixeles por trozo (3 KB por plano, queda en L1)
+
+static void unpack_bgr24_scalar(const Pixel24 *src, size_t n, uint8_t *b, uint8_t *g, uint8_t *r)
+{
+    const uint8_t *p = (const uint8_t *)src;
+    for (size_t i = 0; i < n; ++i)
+    {
+        b[i] = p[3 * i + 0];
+        g[i] = p[3 * i + 1];
+        r[i] = p[3 * i + 2];
+    }
+}
+
+static void pack_bgr24_scalar(const uint8_t *b, const uint8_t *g, const uint8_t *r, size_t n, Pixel24 *dst)
+{
+    uint8_t *p = (uint8_t *)dst;
+    for (size_t i = 0; i < n; ++i)
+    {
+        p[3 * i + 0] = b[i];
+        p[3 * i + 1] = g[i];
+        p[3 * i + 2] = r[i];
+    }
+}
+
+// Separa pixeles BGR entrelazados en tres planos.
+void unpack_bgr24(const Pixel24 *src, size_t n, uint8_t *b, uint8_t *g, uint8_t *r)
+{
+    g_kernels.unpack_bgr(src, n, b, g, r);
+}
+
+// Junta tres planos en pixeles BGR entrelazados.
+void pack_bgr24(const uint8_t *b, const uint8_t *g, const uint8_t *r, size_t n, Pixel24 *dst)
+{
+    g_kernels.pack_bgr(b, g, r, n, dst);
+}
+
+// Matriz 3x3 en punto fijo: out_i = clamp((sum_j M_ij * (in_j - in_off_j) + out_off_i) >> shift)
+// out_off ya incluye el redondeo y el desplazamiento de salida escalado por 2^shift.
+typedef struct ColorMatrix
+{
+    int16_t m[9];
+    int16_t in_off[3];
+    int32_t out_off[3];
+    int shift;
+} ColorMatrix;
+
+// Las variantes SIMD (madd de pares i16) usan la misma aritmetica entera: resultado identico.
+static void color_matrix_scalar(const ColorMatrix *cm, const uint8_t *i0, const uint8_t *i1, const uint8_t *i2,
+                                uint8_t *o0, uint8_t *o1, uint8_t *o2, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        int a = i0[i] - cm->in_off[0], b = i1[i] - cm->in_off[1], c = i2[i] - cm->in_off[2];
+        o0[i] = clamp_int_to_u8((cm->m[0] * a + cm->m[1] * b + cm->m[2] * c + cm->out_off[0]) >> cm->shift);
+        o1[i] = clamp_int_to_u8((cm->m[3] * a + cm->m[4] * b + cm->m[5] * c + cm->out_off[1]) >> cm->shift);
+        o2[i] = clamp_int_to_u8((cm->m[6] * a + cm->m[7] * b + cm->m[8] * c + cm->out_off[2]) >> cm->shift);
+    }
+}
+
+static void ycc_coeffs(int standard, double *kr, double *kb)
+{
+    if (standard == YCC_BT709)
+    {
+        *kr = 0.2126;
+        *kb = 0.0722;
+    }
+    else
+    {
+        *kr = 0.299;
+        *kb = 0.114;
+    }
+}
+
+// Matriz directa (entrada R, G, B) o inversa (entrada Y, Cb, Cr, salida R, G, B).
+static void ycc_matrix(ColorMatrix *cm, int standard, int full_range, int inverse)
+{
+    double kr, kb;
+    ycc_coeffs(standard, &kr, &kb);
+    double kg = 1.0 - kr - kb;
+    double ys = full_range ? 1.0 : 219.0 / 255.0; // escala de Y
+    double cs = full_range ? 1.0 : 224.0 / 255.0; // escala de Cb/Cr
+    int yoff = full_range ? 0 : 16;
+    double f[9];
+    if (!inverse)
+    {
+        f[0] = kr * ys, f[1] = kg * ys, f[2] = kb * ys;
+        f[3] = -0.5 * kr / (1.0 - kb) * cs, f[4] = -0.5 * kg / (1.0 - kb) * cs, f[5] = 0.5 * cs;
+        f[6] = 0.5 * cs, f[7] = -0.5 * kg / (1.0 - kr) * cs, f[8] = -0.5 * kb / (1.0 - kr) * cs;
+        cm->shift = 14;
+        cm->in_off[0] = cm->in_off[1] = cm->in_off[2] = 0;
+        cm->out_off[0] = (yoff << 14) + (1 << 13);
+        cm->out_off[1] = cm->out_off[2] = (128 << 14) + (1 << 13);
+    }
+    else
+    {
+        // Con rango limitado el factor de Cb llega a ~2.1: Q13 para que quepa en int16
+        double iy = 1.0 / ys, ic = 1.0 / cs;
+        f[0] = iy, f[1] = 0.0, f[2] = 2.0 * (1.0 - kr) * ic;
+        f[3] = iy, f[4] = -2.0 * (1.0 - kb) * kb / kg * ic, f[5] = -2.0 * (1.0 - kr) * kr / kg * ic;
+        f[6] = iy, f[7] = 2.0 * (1.0 - kb) * ic, f[8] = 0.0;
+        cm->shift = 13;
+        cm->in_off[0] = (int16_t)yoff;
+        cm->in_off[1] = cm->in_off[2] = 128;
+        cm->out_off[0] = cm->out_off[1] = cm->out_off[2] = 1 << 12;
+    }
+    for (int i = 0; i < 9; ++i)
+        cm->m[i] = (int16_t)floor(f[i] * (1 << cm->shift) + 0.5);
+}
+
+// BGR -> Y, Cb, Cr (planos de n bytes). standard = YCC_BT601/YCC_BT709.
+void bgr_to_ycbcr(const Pixel24 *src, size_t n, uint8_t *y, uint8_t *cb, uint8_t *cr,
+                  int standard, int full_range)
+{
+    ColorMatrix cm;
+    ycc_matrix(&cm, standard, full_range, 0);
+    uint8_t b[COLOR_CHUNK], g[COLOR_CHUNK], r[COLOR_CHUNK];
+    for (size_t i = 0; i < n; i += COLOR_CHUNK)
+    {
+        size_t m = n - i < COLOR_CHUNK ? n - i : COLOR_CHUNK;
+        unpack_bgr24(src + i, m, b, g, r);
+        g_kernels.color_matrix(&cm, r, g, b, y + i, cb + i, cr + i, m);
+    }
+}
+
+// Y, Cb, Cr -> BGR.
+void ycbcr_to_bgr(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, size_t n, Pixel24 *dst,
+                  int standard, int full_range)
+{
+    ColorMatrix cm;
+    ycc_matrix(&cm, standard, full_range, 1);
+    uint8_t b[COLOR_CHUNK], g[COLOR_CHUNK], r[COLOR_CHUNK];
+    for (size_t i = 0; i < n; i += COLOR_CHUNK)
+    {
+        size_t m = n - i < COLOR_CHUNK ? n - i : COLOR_CHUNK;
+        g_kernels.color_matrix(&cm, y + i, cb + i, cr + i, r, g, b, m);
+        pack_bgr24(b, g, r, m, dst + i);
+    }
+}
+
+// Division redondeada por 255 sin dividir (exacta para 0 <= x <= 65535).
+static inline int div255(int x)
+{
+    return (x + 128 + ((x + 128) >> 8)) >> 8;
+}
+
+// Tablas de reciprocos en Q12 para HSV: s = diff * 255 / v y h = delta * (256/6) / diff.
+static int hsv_sdiv[256], hsv_hdiv[256];
+static int hsv_tables_ready = 0;
+
+static void hsv_init_tables(void)
+{
+    if (hsv_tables_ready)
+        return;
+    hsv_sdiv[0] = hsv_hdiv[0] = 0;
+    for (int v = 1; v < 256; ++v)
+    {
+        hsv_sdiv[v] = (int)(255.0 * 4096.0 / v + 0.5);
+        hsv_hdiv[v] = (int)(256.0 / 6.0 * 4096.0 / v + 0.5);
+    }
+    hsv_tables_ready = 1;
+}
+
+// BGR -> H, S, V de 8 bits. H cubre el circulo completo en 0..255 (256 = 360 grados).
+void bgr_to_hsv(const Pixel24 *src, size_t n, uint8_t *h, uint8_t *s, uint8_t *v)
+{
+    hsv_init_tables();
+    for (size_t i = 0; i < n; ++i)
+    {
+        int b = src[i].b, g = src[i].g, r = src[i].r;
+        int mx = r > g ? (r > b ? r : b) : (g > b ? g : b);
+        int mn = r < g ? (r < b ? r : b) : (g < b ? g : b);
+        int diff = mx - mn;
+        v[i] = (uint8_t)mx;
+        s[i] = (uint8_t)((diff * hsv_sdiv[mx] + 2048) >> 12);
+        int hq; // Q12
+        if (diff == 0)
+            hq = 0;
+        else if (mx == r)
+            hq = (g - b) * hsv_hdiv[diff];
+        else if (mx == g)
+            hq = (b - r) * hsv_hdiv[diff] + (int)(256.0 / 3.0 * 4096.0 + 0.5);
+        else
+            hq = (r - g) * hsv_hdiv[diff] + (int)(512.0 / 3.0 * 4096.0 + 0.5);
+        h[i] = (uint8_t)(((hq + (256 << 12) + 2048) >> 12) & 255);
+    }
+}
+
+// H, S, V -> BGR.
+void hsv_to_bgr(const uint8_t *h, const uint8_t *s, const uint8_t *v, size_t n, Pixel24 *dst)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        int hh = h[i] * 6; // 0..1530: sector en el byte alto, fraccion en el bajo
+        int sector = hh >> 8, f = hh & 255;
+        int vv = v[i], ss = s[i];
+        int p = div255(vv * (255 - ss));
+        int q = div255(vv * (255 - div255(ss * f)));
+        int t = div255(vv * (255 - div255(ss * (255 - f))));
+        int r, g, b;
+        switch (sector)
+        {
+        case 0:
+            r = vv, g = t, b = p;
+            break;
+        case 1:
+            r = q, g = vv, b = p;
+            break;
+        case 2:
+            r = p, g = vv, b = t;
+            break;
+        case 3:
+            r = p, g = q, b = vv;
+            break;
+        case 4:
+            r = t, g = p, b = vv;
+            break;
+        default:
+            r = vv, g = p, b = q;
+            break;
+        }
+        dst[i].b = (uint8_t)b;
+        dst[i].g = (uint8_t)g;
+        dst[i].r = (uint8_t)r;
+    }
+}
+
+// Lab (D65). En 8 bits: L * 255/100, a + 128, b + 128 (como hacen la mayoria de las bibliotecas).
+#define LAB_LUT_SIZE 4096
+static float lab_srgb_to_linear[256];
+static float lab_f[LAB_LUT_SIZE + 2];           // f(t) para t en [0, 1]
+static uint8_t lab_linear_to_srgb[LAB_LUT_SIZE + 1]; // linear [0, 1] -> sRGB 8 bits
+static int lab_tables_ready = 0;
+
+static void lab_init_tables(void)
+{
+    if (lab_tables_ready)
+        return;
+    for (int v = 0; v < 256; ++v)
+    {
+        double c = v / 255.0;
+        lab_srgb_to_linear[v] = (float)(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+    }
+    for (int i = 0; i <= LAB_LUT_SIZE + 1; ++i)
+    {
+        double t = (double)i / LAB_LUT_SIZE;
+        lab_f[i] = (float)(t > 0.008856 ? cbrt(t) : 7.787 * t + 16.0 / 116.0);
+    }
+    for (int i = 0; i <= LAB_LUT_SIZE; ++i)
+    {
+        double c = (double)i / LAB_LUT_SIZE;
+        double sv = c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+        lab_linear_to_srgb[i] = clamp_int_to_u8((int)(sv * 255.0 + 0.5));
+    }
+    lab_tables_ready = 1;
+}
+
+// f(t) por tabla con interpolacion lineal.
+static inline float lab_f_lut(float t)
+{
+    if (t <= 0.f)
+        return lab_f[0];
+    if (t >= 1.f)
+        return t > 1.f ? cbrtf(t) : lab_f[LAB_LUT_SIZE];
+    float x = t * LAB_LUT_SIZE;
+    int i = (int)x;
+    float fr = x - (float)i;
+    return lab_f[i] + (lab_f[i + 1] - lab_f[i]) * fr;
+}
+
+static inline void bgr_to_lab_f(const Pixel24 *p, float *L, float *a, float *b)
+{
+    float rl = lab_srgb_to_linear[p->r], gl = lab_srgb_to_linear[p->g], bl = lab_srgb_to_linear[p->b];
+    // sRGB lineal -> XYZ normalizado por el blanco D65
+    float x = (0.4124564f * rl + 0.3575761f * gl + 0.1804375f * bl) / 0.950456f;
+    float y = 0.2126729f * rl + 0.7151522f * gl + 0.0721750f * bl;
+    float z = (0.0193339f * rl + 0.1191920f * gl + 0.9503041f * bl) / 1.088754f;
+    float fx = lab_f_lut(x), fy = lab_f_lut(y), fz = lab_f_lut(z);
+    *L = 116.f * fy - 16.f;
+    *a = 500.f * (fx - fy);
+    *b = 200.f * (fy - fz);
+}
+
+void bgr_to_lab(const Pixel24 *src, size_t n, uint8_t *L, uint8_t *a, uint8_t *b)
+{
+    lab_init_tables();
+    for (size_t i = 0; i < n; ++i)
+    {
+        float l, aa, bb;
+        bgr_to_lab_f(&src[i], &l, &aa, &bb);
+        L[i] = clamp_int_to_u8((int)(l * 255.f / 100.f + 0.5f));
+        a[i] = clamp_int_to_u8((int)floorf(aa + 128.5f));
+        b[i] = clamp_int_to_u8((int)floorf(bb + 128.5f));
+    }
+}
+
+static inline float lab_finv(float f)
+{
+    return f > 0.206893f ? f * f * f : (f - 16.f / 116.f) / 7.787f;
+}
+
+static inline uint8_t lab_to_srgb8(float c)
+{
+    if (c <= 0.f)
+        return 0;
+    if (c >= 1.f)
+        return 255;
+    return lab_linear_to_srgb[(int)(c * LAB_LUT_SIZE + 0.5f)];
+}
+
+void lab_to_bgr(const uint8_t *L, const uint8_t *a, const uint8_t *b, size_t n, Pixel24 *dst)
+{
+    lab_init_tables();
+    for (size_t i = 0; i < n; ++i)
+    {
+        float fy = (L[i] * 100.f / 255.f + 16.f) / 116.f;
+        float fx = fy + (a[i] - 128) / 500.f;
+        float fz = fy - (b[i] - 128) / 200.f;
+        float x = lab_finv(fx) * 0.950456f, y = lab_finv(fy), z = lab_finv(fz) * 1.088754f;
+        float rl = 3.2404542f * x - 1.5371385f * y - 0.4985314f * z;
+        float gl = -0.9692660f * x + 1.8760108f * y + 0.0415560f * z;
+        float bl = 0.0556434f * x - 0.2040259f * y + 1.0572252f * z;
+        dst[i].r = lab_to_srgb8(rl);
+        dst[i].g = lab_to_srgb8(gl);
+        dst[i].b = lab_to_srgb8(bl);
+    }
+}
+
+// Diferencia perceptual media (Delta E 1976) entre dos imagenes del mismo tamano.
+double mean_delta_e(const Pixel24 *a, const Pixel24 *b, size_t n)
+{
+    lab_init_tables();
+    double acc = 0.0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        float l1, a1, b1, l2, a2, b2;
+        bgr_to_lab_f(&a[i], &l1, &a1, &b1);
+        bgr_to_lab_f(&b[i], &l2, &a2, &b2);
+        acc += sqrt((double)(l1 - l2) * (l1 - l2) + (double)(a1 - a2) * (a1 - a2) + (double)(b1 - b2) * (b1 - b2));
+    }
+    return n ? acc / (double)n : 0.0;
+}
+
+// Ajuste de tono y saturacion via HSV. hue_shift en grados, sat_scale multiplica S.
+int adjust_hue_saturation(Pixel24 *pixels, int width, int height, double hue_shift, double sat_scale)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "adjust_hue_saturation");
+    size_t n = (size_t)width * (size_t)height;
+    uint8_t h[COLOR_CHUNK], sv[COLOR_CHUNK], v[COLOR_CHUNK];
+    int shift = (int)floor(hue_shift * 256.0 / 360.0 + 0.5);
+    uint8_t sat_lut[256];
+    for (int i = 0; i < 256; ++i)
+        sat_lut[i] = clamp_int_to_u8((int)(i * sat_scale + 0.5));
+    for (size_t i = 0; i < n; i += COLOR_CHUNK)
+    {
+        size_t m = n - i < COLOR_CHUNK ? n - i : COLOR_CHUNK;
+        bgr_to_hsv(pixels + i, m, h, sv, v);
+        for (size_t j = 0; j < m; ++j)
+        {
+            h[j] = (uint8_t)((h[j] + shift) & 255);
+            sv[j] = sat_lut[sv[j]];
+        }
+        hsv_to_bgr(h, sv, v, m, pixels + i);
+    }
+    stats_end_image(&sp, width, height);
+    return 1;
+}
+
+// Aplica fn solo a la luminancia: BGR -> YCbCr (rango completo), fn sobre Y como imagen gris
+// y recombinacion con el Cb/Cr original. Permite usar las convoluciones sin perder el color.
+int filter_luma_only(Pixel24 *pixels, int width, int height, int standard, LumaFilterFn fn, void *ctx)
+{
+    StatsSpan sp;
+    stats_begin(&sp, "filter_luma_only");
+    size_t n = (size_t)width * (size_t)height;
+    uint8_t *planes = (uint8_t *)bmp_malloc(3 * n);
+    Pixel24 *gray = (Pixel24 *)bmp_malloc(sizeof(Pixel24) * n);
+    if (!planes || !gray)
+    {
+        bmp_free(planes);
+        bmp_free(gray);
+        return 0;
+    }
+    uint8_t *y = planes, *cb = planes + n, *cr = planes + 2 * n;
+    bgr_to_ycbcr(pixels, n, y, cb, cr, standard, 1);
+    pack_bgr24(y, y, y, n, gray);
+
+    int ok = fn(gray, width, height, ctx);
+    if (ok)
+    {
+        for (size_t i = 0; i < n; ++i)
+            y[i] = gray[i].r;
+        ycbcr_to_bgr(y, cb, cr, n, pixels, standard, 1);
+    }
+    bmp_free(planes);
+    bmp_free(gray);
+    stats_end_image(&sp, width, height);
+    return ok;
+}
+
+// --- Variantes SIMD y despacho por CPU ---
+// Cada variante se compila con su propio atributo target, asi el binario generico (-O2 sin -m)
+// trae todas las rutas y elige al arrancar. Los restos que no llenan un vector se delegan en la
+// version escalar, que es la referencia de --check-kernels.
+
+// Mascaras pshufb (por carril de 16 bytes) para separar y juntar bloques de 16 pixeles BGR.
+// dei[c][k]: byte j del canal c sale del byte 3j + c del bloque, que esta en el vector k.
+// itl[k][c]: byte t del vector de salida k viene del plano (16k + t) % 3, posicion (16k + t) / 3.
+static void bgr_shuffle_masks(uint8_t dei[3][3][16], uint8_t itl[3][3][16])
+{
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < 3; ++k)
+            for (int j = 0; j < 16; ++j)
+            {
+                dei[c][k][j] = (3 * j + c) / 16 == k ? (uint8_t)((3 * j + c) % 16) : 0x80;
+                itl[k][c][j] = (16 * k + j) % 3 == c ? (uint8_t)((16 * k + j) / 3) : 0x80;
+            }
+}
+
+#if BMP_X86
+#define BMP_TARGET(isa) __attribute__((target(isa)))
+
+// SSE2
+
+static BMP_TARGET("sse2") void minmax_rows_sse2(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t n,
+                                                int is_max)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(d + i), is_max ? _mm_max_epu8(va, vb) : _mm_min_epu8(va, vb));
+    }
+    minmax_rows_scalar(d + i, a + i, b + i, n - i, is_max);
+}
+
+static BMP_TARGET("sse2") void accum_u8_u16_sse2(uint16_t *acc, const uint8_t *row, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i lo = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(acc + i + 8));
+        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+        _mm_storeu_si128((__m128i *)(acc + i), lo);
+        _mm_storeu_si128((__m128i *)(acc + i + 8), hi);
+    }
+    accum_u8_u16_scalar(acc + i, row + i, n - i);
+}
+
+// 8 pixeles por vuelta; pares (in0, in1) y (in2, 0) para _mm_madd_epi16.
+static BMP_TARGET("sse2") void color_matrix_sse2(const ColorMatrix *cm, const uint8_t *i0, const uint8_t *i1,
+                                                 const uint8_t *i2, uint8_t *o0, uint8_t *o1, uint8_t *o2, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i off0 = _mm_set1_epi16(cm->in_off[0]);
+    const __m128i off1 = _mm_set1_epi16(cm->in_off[1]);
+    const __m128i off2 = _mm_set1_epi16(cm->in_off[2]);
+    __m128i c01[3], c2[3], oo[3];
+    for (int r = 0; r < 3; ++r)
+    {
+        c01[r] = _mm_set1_epi32((int32_t)(((uint32_t)(uint16_t)cm->m[3 * r + 1] << 16) | (uint16_t)cm->m[3 * r]));
+        c2[r] = _mm_set1_epi32((int32_t)(uint16_t)cm->m[3 * r + 2]);
+        oo[r] = _mm_set1_epi32(cm->out_off[r]);
+    }
+    uint8_t *outs[3] = {o0, o1, o2};
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i a = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(i0 + i)), zero), off0);
+        __m128i b = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(i1 + i)), zero), off1);
+        __m128i c = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(i2 + i)), zero), off2);
+        __m128i ab_lo = _mm_unpacklo_epi16(a, b), ab_hi = _mm_unpackhi_epi16(a, b);
+        __m128i c_lo = _mm_unpacklo_epi16(c, zero), c_hi = _mm_unpackhi_epi16(c, zero);
+        for (int r = 0; r < 3; ++r)
+        {
+            __m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ab_lo, c01[r]), _mm_madd_epi16(c_lo, c2[r])), oo[r]);
+            __m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ab_hi, c01[r]), _mm_madd_epi16(c_hi, c2[r])), oo[r]);
+            lo = _mm_srai_epi32(lo, cm->shift);
+            hi = _mm_srai_epi32(hi, cm->shift);
+            _mm_storel_epi64((__m128i *)(outs[r] + i), _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero));
+        }
+    }
+    color_matrix_scalar(cm, i0 + i, i1 + i, i2 + i, o0 + i, o1 + i, o2 + i, n - i);
+}
+
+// 4 pixeles por vuelta en float; mismo orden de suma que la escalar, asi el redondeo coincide.
+static BMP_TARGET("sse2") BMP_NO_FMA void conv3x3_row_sse2(const uint8_t *src, uint8_t *dst, int width,
+                                                           const float *k, float sumk)
+{
+    __m128 kk[9];
+    for (int t = 0; t < 9; ++t)
+        kk[t] = _mm_set1_ps(k[t]);
+    const __m128 vs = _mm_set1_ps(sumk), half = _mm_set1_ps(0.5f);
+    const __m128i zero = _mm_setzero_si128();
+    int x = 1;
+    for (; x + 4 <= width - 1; x += 4)
+    {
+        __m128 acc = _mm_setzero_ps();
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                int32_t w4;
+                memcpy(&w4, src + dy * width + x + dx, 4);
+                __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(w4), zero), zero);
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_cvtepi32_ps(v), kk[(dy + 1) * 3 + dx + 1]));
+            }
+        }
+        __m128i r = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(acc, vs), half));
+        r = _mm_packs_epi32(r, r);
+        int32_t o = _mm_cvtsi128_si32(_mm_packus_epi16(r, r));
+        memcpy(dst + x, &o, 4);
+    }
+    conv3x3_cols_scalar(src, dst, width, x, width - 1, k, sumk);
+}
+
+// SSSE3
+
+static BMP_TARGET("ssse3") void unpack_bgr24_ssse3(const Pixel24 *src, size_t n, uint8_t *b, uint8_t *g, uint8_t *r)
+{
+    uint8_t dei[3][3][16], itl[3][3][16];
+    bgr_shuffle_masks(dei, itl);
+    __m128i m[3][3];
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < 3; ++k)
+            m[c][k] = _mm_loadu_si128((const __m128i *)dei[c][k]);
+    const uint8_t *p = (const uint8_t *)src;
+    uint8_t *out[3] = {b, g, r};
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(p + 3 * i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 3 * i + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 3 * i + 32));
+        for (int c = 0; c < 3; ++c)
+        {
+            __m128i x = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, m[c][0]), _mm_shuffle_epi8(v1, m[c][1])),
+                                     _mm_shuffle_epi8(v2, m[c][2]));
+            _mm_storeu_si128((__m128i *)(out[c] + i), x);
+        }
+    }
+    unpack_bgr24_scalar(src + i, n - i, b + i, g + i, r + i);
+}
+
+static BMP_TARGET("ssse3") void pack_bgr24_ssse3(const uint8_t *b, const uint8_t *g, const uint8_t *r, size_t n,
+                                                 Pixel24 *dst)
+{
+    uint8_t dei[3][3][16], itl[3][3][16];
+    bgr_shuffle_masks(dei, itl);
+    __m128i m[3][3];
+    for (int k = 0; k < 3; ++k)
+        for (int c = 0; c < 3; ++c)
+            m[k][c] = _mm_loadu_si128((const __m128i *)itl[k][c]);
+    uint8_t *p = (uint8_t *)dst;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i vg = _mm_loadu_si128((const __m128i *)(g + i));
+        __m128i vr = _mm_loadu_si128((const __m128i *)(r + i));
+        for (int k = 0; k < 3; ++k)
+        {
+            __m128i x = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(vb, m[k][0]), _mm_shuffle_epi8(vg, m[k][1])),
+                                     _mm_shuffle_epi8(vr, m[k][2]));
+            _mm_storeu_si128((__m128i *)(p + 3 * i + 16 * k), x);
+        }
+    }
+    pack_bgr24_scalar(b + i, g + i, r + i, n - i, dst + i);
+}
+
+// Gris Q16 de 8 pixeles (r, g, b en u16). madd es con signo: el peso de G se parte en
+// (wg - 16384) junto a R y 16384 junto a B, y todos quedan en [0, 32767] para los tres estandares.
+static inline BMP_TARGET("ssse3") __m128i gray_q16_8_ssse3(__m128i r16, __m128i g16, __m128i b16, __m128i crg,
+                                                           __m128i cbg)
+{
+    const __m128i rnd = _mm_set1_epi32(32768);
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r16, g16), crg),
+                               _mm_madd_epi16(_mm_unpacklo_epi16(b16, g16), cbg));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r16, g16), crg),
+                               _mm_madd_epi16(_mm_unpackhi_epi16(b16, g16), cbg));
+    lo = _mm_srli_epi32(_mm_add_epi32(lo, rnd), 16);
+    hi = _mm_srli_epi32(_mm_add_epi32(hi, rnd), 16);
+    return _mm_packs_epi32(lo, hi);
+}
+
+static inline BMP_TARGET("ssse3") void gray_q16_ssse3(Pixel24 *pixels, size_t n, int wr, int wg, int wb)
+{
+    uint8_t dei[3][3][16], itl[3][3][16];
+    bgr_shuffle_masks(dei, itl);
+    __m128i md[3][3], mi[3];
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < 3; ++k)
+            md[c][k] = _mm_loadu_si128((const __m128i *)dei[c][k]);
+    // El gris va a los tres canales: las mascaras de salida son las del plano B (todas iguales)
+    for (int k = 0; k < 3; ++k)
+    {
+        uint8_t idx[16];
+        for (int t = 0; t < 16; ++t)
+            idx[t] = (uint8_t)((16 * k + t) / 3);
+        mi[k] = _mm_loadu_si128((const __m128i *)idx);
+    }
+    const __m128i crg = _mm_set1_epi32((int32_t)(((uint32_t)(wg - 16384) << 16) | (uint32_t)wr));
+    const __m128i cbg = _mm_set1_epi32((int32_t)((16384u << 16) | (uint32_t)wb));
+    const __m128i zero = _mm_setzero_si128();
+    uint8_t *p = (uint8_t *)pixels;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(p + 3 * i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 3 * i + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 3 * i + 32));
+        __m128i pl[3];
+        for (int c = 0; c < 3; ++c)
+            pl[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, md[c][0]), _mm_shuffle_epi8(v1, md[c][1])),
+                                 _mm_shuffle_epi8(v2, md[c][2]));
+        __m128i ylo = gray_q16_8_ssse3(_mm_unpacklo_epi8(pl[2], zero), _mm_unpacklo_epi8(pl[1], zero),
+                                       _mm_unpacklo_epi8(pl[0], zero), crg, cbg);
+        __m128i yhi = gray_q16_8_ssse3(_mm_unpackhi_epi8(pl[2], zero), _mm_unpackhi_epi8(pl[1], zero),
+                                       _mm_unpackhi_epi8(pl[0], zero), crg, cbg);
+        __m128i y = _mm_packus_epi16(ylo, yhi);
+        for (int k = 0; k < 3; ++k)
+            _mm_storeu_si128((__m128i *)(p + 3 * i + 16 * k), _mm_shuffle_epi8(y, mi[k]));
+    }
+    for (; i < n; ++i)
+    {
+        int r = pixels[i].r, g = pixels[i].g, b = pixels[i].b;
+        pixels[i].r = pixels[i].g = pixels[i].b = (uint8_t)((wr * r + wg * g + wb * b + 32768) >> 16);
+    }
+}
+
+// Mismos pesos Q16 que gray_bt601 / gray_bt709 / gray_bt2020
+static BMP_TARGET("ssse3") void gray_bt601_ssse3(Pixel24 *pixels, size_t n)
+{
+    gray_q16_ssse3(pixels, n, 19595, 38470, 7471);
+}
+
+static BMP_TARGET("ssse3") void gray_bt709_ssse3(Pixel24 *pixels, size_t n)
+{
+    gray_q16_ssse3(pixels, n, 13933, 46871, 4732);
+}
+
+static BMP_TARGET("ssse3") void gray_bt2020_ssse3(Pixel24 *pixels, size_t n)
+{
+    gray_q16_ssse3(pixels, n, 17216, 44433, 3887);
+}
+
+// SSE4.1: pmovzxbd ahorra los dos unpack por carga en la convolucion.
+
+static BMP_TARGET("sse4.1") BMP_NO_FMA void conv3x3_row_sse41(const uint8_t *src, uint8_t *dst, int width,
+                                                             const float *k, float sumk)
+{
+    __m128 kk[9];
+    for (int t = 0; t < 9; ++t)
+        kk[t] = _mm_set1_ps(k[t]);
+    const __m128 vs = _mm_set1_ps(sumk), half = _mm_set1_ps(0.5f);
+    int x = 1;
+    for (; x + 4 <= width - 1; x += 4)
+    {
+        __m128 acc = _mm_setzero_ps();
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                int32_t w4;
+                memcpy(&w4, src + dy * width + x + dx, 4);
+                __m128i v = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(w4));
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_cvtepi32_ps(v), kk[(dy + 1) * 3 + dx + 1]));
+            }
+        }
+        __m128i r = _mm_packus_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(acc, vs), half)), _mm_setzero_si128());
+        int32_t o = _mm_cvtsi128_si32(_mm_packus_epi16(r, r));
+        memcpy(dst + x, &o, 4);
+    }
+    conv3x3_cols_scalar(src, dst, width, x, width - 1, k, sumk);
+}
+
+// AVX2. Los shuffles trabajan por carril de 128 bits, asi que los datos entrelazados se cargan
+// "partidos": el carril bajo toma los pixeles 0..15 y el alto los 16..31 de un bloque de 96 bytes.
+
+static inline BMP_TARGET("avx2") __m256i load_lanes_avx2(const uint8_t *lo, const uint8_t *hi)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+                                   _mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+static inline BMP_TARGET("avx2") void store_lanes_avx2(uint8_t *lo, uint8_t *hi, __m256i v)
+{
+    _mm_storeu_si128((__m128i *)lo, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *)hi, _mm256_extracti128_si256(v, 1));
+}
+
+static inline BMP_TARGET("avx2") __m256i bcast_mask_avx2(const uint8_t idx[16])
+{
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)idx));
+}
+
+static BMP_TARGET("avx2") void unpack_bgr24_avx2(const Pixel24 *src, size_t n, uint8_t *b, uint8_t *g, uint8_t *r)
+{
+    uint8_t dei[3][3][16], itl[3][3][16];
+    bgr_shuffle_masks(dei, itl);
+    __m256i m[3][3];
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < 3; ++k)
+            m[c][k] = bcast_mask_avx2(dei[c][k]);
+    const uint8_t *p = (const uint8_t *)src;
+    uint8_t *out[3] = {b, g, r};
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const uint8_t *q = p + 3 * i;
+        __m256i v0 = load_lanes_avx2(q, q + 48);
+        __m256i v1 = load_lanes_avx2(q + 16, q + 64);
+        __m256i v2 = load_lanes_avx2(q + 32, q + 80);
+        for (int c = 0; c < 3; ++c)
+        {
+            __m256i x = _mm256_or_si256(
+                _mm256_or_si256(_mm256_shuffle_epi8(v0, m[c][0]), _mm256_shuffle_epi8(v1, m[c][1])),
+                _mm256_shuffle_epi8(v2, m[c][2]));
+            _mm256_storeu_si256((__m256i *)(out[c] + i), x);
+        }
+    }
+    unpack_bgr24_scalar(src + i, n - i, b + i, g + i, r + i);
+}
+
+static BMP_TARGET("avx2") void pack_bgr24_avx2(const uint8_t *b, const uint8_t *g, const uint8_t *r, size_t n,
+                                               Pixel24 *dst)
+{
+    uint8_t dei[3][3][16], itl[3][3][16];
+    bgr_shuffle_masks(dei, itl);
+    __m256i m[3][3];
+    for (int k = 0; k < 3; ++k)
+        for (int c = 0; c < 3; ++c)
+            m[k][c] = bcast_mask_avx2(itl[k][c]);
+    uint8_t *p = (uint8_t *)dst;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i vg = _mm256_loadu_si256((const __m256i *)(g + i));
+        __m256i vr = _mm256_loadu_si256((const __m256i *)(r + i));
+        uint8_t *q = p + 3 * i;
+        for (int k = 0; k < 3; ++k)
+        {
+            __m256i x = _mm256_or_si256(
+                _mm256_or_si256(_mm256_shuffle_epi8(vb, m[k][0]), _mm256_shuffle_epi8(vg, m[k][1])),
+                _mm256_shuffle_epi8(vr, m[k][2]));
+            store_lanes_avx2(q + 16 * k, q + 48 + 16 * k, x);
+        }
+    }
+    pack_bgr24_scalar(b + i, g + i, r + i, n - i, dst + i);
+}
+
+static inline BMP_TARGET("avx2") __m256i gray_q16_16_avx2(__m256i r16, __m256i g16, __m256i b16, __m256i crg,
+                                                          __m256i cbg)
+{
+    const __m256i rnd = _mm256_set1_epi32(32768);
+    __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r16, g16), crg),
+                                  _mm256_madd_epi16(_mm256_unpacklo_epi16(b16, g16), cbg));
+    __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r16, g16), crg),
+                                  _mm256_madd_epi16(_mm256_unpackhi_epi16(b16, g16), cbg));
+    lo = _mm256_srli_epi32(_mm256_add_epi32(lo, rnd), 16);
+    hi = _mm256_srli_epi32(_mm256_add_epi32(hi, rnd), 16);
+    return _mm256_packs_epi32(lo, hi);
+}
+
+static inline BMP_TARGET("avx2") void gray_q16_avx2(Pixel24 *pixels, size_t n, int wr, int wg, int wb)
+{
+    uint8_t dei[3][3][16], itl[3][3][16];
+    bgr_shuffle_masks(dei, itl);
+    __m256i md[3][3], mi[3];
+    for (int c = 0; c < 3; ++c)
+        for (int k = 0; k < 3; ++k)
+            md[c][k] = bcast_mask_avx2(dei[c][k]);
+    for (int k = 0; k < 3; ++k)
+    {
+        uint8_t idx[16];
+        for (int t = 0; t < 16; ++t)
+            idx[t] = (uint8_t)((16 * k + t) / 3);
+        mi[k] = bcast_mask_avx2(idx);
+    }
+    const __m256i crg = _mm256_set1_epi32((int32_t)(((uint32_t)(wg - 16384) << 16) | (uint32_t)wr));
+    const __m256i cbg = _mm256_set1_epi32((int32_t)((16384u << 16) | (uint32_t)wb));
+    const __m256i zero = _mm256_setzero_si256();
+    uint8_t *p = (uint8_t *)pixels;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        uint8_t *q = p + 3 * i;
+        __m256i v0 = load_lanes_avx2(q, q + 48);
+        __m256i v1 = load_lanes_avx2(q + 16, q + 64);
+        __m256i v2 = load_lanes_avx2(q + 32, q + 80);
+        __m256i pl[3];
+        for (int c = 0; c < 3; ++c)
+            pl[c] = _mm256_or_si256(
+                _mm256_or_si256(_mm256_shuffle_epi8(v0, md[c][0]), _mm256_shuffle_epi8(v1, md[c][1])),
+                _mm256_shuffle_epi8(v2, md[c][2]));
+        __m256i ylo = gray_q16_16_avx2(_mm256_unpacklo_epi8(pl[2], zero), _mm256_unpacklo_epi8(pl[1], zero),
+                                       _mm256_unpacklo_epi8(pl[0], zero), crg, cbg);
+        __m256i yhi = gray_q16_16_avx2(_mm256_unpackhi_epi8(pl[2], zero), _mm256_unpackhi_epi8(pl[1], zero),
+                                       _mm256_unpackhi_epi8(pl[0], zero), crg, cbg);
+        __m256i y = _mm256_packus_epi16(ylo, yhi);
+        for (int k = 0; k < 3; ++k)
+            store_lanes_avx2(q + 16 * k, q + 48 + 16 * k, _mm256_shuffle_epi8(y, mi[k]));
+    }
+    for (; i < n; ++i)
+    {
+        int r = pixels[i].r, g = pixels[i].g, b = pixels[i].b;
+        pixels[i].r = pixels[i].g = pixels[i].b = (uint8_t)((wr * r + wg * g + wb * b + 32768) >> 16);
+    }
+}
+
+static BMP_TARGET("avx2") void gray_bt601_avx2(Pixel24 *pixels, size_t n)
+{
+    gray_q16_avx2(pixels, n, 19595, 38470, 7471);
+}
+
+static BMP_TARGET("avx2") void gray_bt709_avx2(Pixel24 *pixels, size_t n)
+{
+    gray_q16_avx2(pixels, n, 13933, 46871, 4732);
+}
+
+static BMP_TARGET("avx2") void gray_bt2020_avx2(Pixel24 *pixels, size_t n)
+{
+    gray_q16_avx2(pixels, n, 17216, 44433, 3887);
+}
+
+// Busqueda de 256 entradas con pshufb: se parte el byte en nibble alto/bajo y se recorren
+// las 16 sub-tablas de 16 bytes. v - 16h cae en [0,16) solo cuando el nibble alto es h;
+// sumando 0x70 con saturacion el resto queda con el bit 7 activo y pshufb devuelve 0.
+// Son 4 instrucciones por sub-tabla: con 16 bytes por vector pierde contra la busqueda escalar,
+// por eso solo hay variantes de 256 y 512 bits, y solo para tablas iguales en los tres canales
+// (con tablas distintas habria que buscar tres veces y mezclar, y tampoco compensa).
+static inline BMP_TARGET("avx2") __m256i lut_lookup_avx2(__m256i x, const __m256i tbl[16])
+{
+    const __m256i c70 = _mm256_set1_epi8(0x70);
+    const __m256i c16 = _mm256_set1_epi8(16);
+    __m256i res = _mm256_setzero_si256();
+    for (int h = 0; h < 16; ++h)
+    {
+        res = _mm256_or_si256(res, _mm256_shuffle_epi8(tbl[h], _mm256_adds_epu8(x, c70)));
+        x = _mm256_sub_epi8(x, c16);
+    }
+    return res;
+}
+
+static BMP_TARGET("avx2") void lut_apply_avx2(uint8_t *p, size_t n, const PointLUT *lut, int uniform)
+{
+    size_t i = 0;
+    if (uniform)
+    {
+        __m256i tb[16];
+        for (int h = 0; h < 16; ++h)
+            tb[h] = bcast_mask_avx2(lut->b + 16 * h);
+        for (; i + 96 <= n; i += 96)
+            for (int k = 0; k < 3; ++k)
+            {
+                __m256i x = _mm256_loadu_si256((const __m256i *)(p + i + 32 * k));
+                _mm256_storeu_si256((__m256i *)(p + i + 32 * k), lut_lookup_avx2(x, tb));
+            }
+    }
+    lut_apply_scalar(p + i, n - i, lut, uniform);
+}
+
+static BMP_TARGET("avx2") void minmax_rows_avx2(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t n,
+                                                int is_max)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(d + i), is_max ? _mm256_max_epu8(va, vb) : _mm256_min_epu8(va, vb));
+    }
+    minmax_rows_scalar(d + i, a + i, b + i, n - i, is_max);
+}
+
+static BMP_TARGET("avx2") void accum_u8_u16_avx2(uint16_t *acc, const uint8_t *row, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row + i)));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi16(a, v));
+    }
+    accum_u8_u16_scalar(acc + i, row + i, n - i);
+}
+
+static BMP_TARGET("avx2") BMP_NO_FMA void conv3x3_row_avx2(const uint8_t *src, uint8_t *dst, int width,
+                                                           const float *k, float sumk)
+{
+    __m256 kk[9];
+    for (int t = 0; t < 9; ++t)
+        kk[t] = _mm256_set1_ps(k[t]);
+    const __m256 vs = _mm256_set1_ps(sumk), half = _mm256_set1_ps(0.5f);
+    int x = 1;
+    for (; x + 8 <= width - 1; x += 8)
+    {
+        __m256 acc = _mm256_setzero_ps();
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + dy * width + x + dx)));
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_cvtepi32_ps(v), kk[(dy + 1) * 3 + dx + 1]));
+            }
+        }
+        __m256i r = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(acc, vs), half));
+        __m128i r16 = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+        _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(r16, r16));
+    }
+    conv3x3_cols_scalar(src, dst, width, x, width - 1, k, sumk);
+}
+
+// 16 pixeles por vuelta. Los unpack y packs son por carril, pero se compensan: el resultado
+// de packs queda [0..7 | 8..15] y permute4x64 junta las dos mitades empaquetadas.
+static BMP_TARGET("avx2") void color_matrix_avx2(const ColorMatrix *cm, const uint8_t *i0, const uint8_t *i1,
+                                                 const uint8_t *i2, uint8_t *o0, uint8_t *o1, uint8_t *o2, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i off0 = _mm256_set1_epi16(cm->in_off[0]);
+    const __m256i off1 = _mm256_set1_epi16(cm->in_off[1]);
+    const __m256i off2 = _mm256_set1_epi16(cm->in_off[2]);
+    __m256i c01[3], c2[3], oo[3];
+    for (int r = 0; r < 3; ++r)
+    {
+        c01[r] = _mm256_set1_epi32((int32_t)(((uint32_t)(uint16_t)cm->m[3 * r + 1] << 16) | (uint16_t)cm->m[3 * r]));
+        c2[r] = _mm256_set1_epi32((int32_t)(uint16_t)cm->m[3 * r + 2]);
+        oo[r] = _mm256_set1_epi32(cm->out_off[r]);
+    }
+    uint8_t *outs[3] = {o0, o1, o2};
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i a = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(i0 + i))), off0);
+        __m256i b = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(i1 + i))), off1);
+        __m256i c = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(i2 + i))), off2);
+        __m256i ab_lo = _mm256_unpacklo_epi16(a, b), ab_hi = _mm256_unpackhi_epi16(a, b);
+        __m256i c_lo = _mm256_unpacklo_epi16(c, zero), c_hi = _mm256_unpackhi_epi16(c, zero);
+        for (int r = 0; r < 3; ++r)
+        {
+            __m256i lo = _mm256_add_epi32(
+                _mm256_add_epi32(_mm256_madd_epi16(ab_lo, c01[r]), _mm256_madd_epi16(c_lo, c2[r])), oo[r]);
+            __m256i hi = _mm256_add_epi32(
+                _mm256_add_epi32(_mm256_madd_epi16(ab_hi, c01[r]), _mm256_madd_epi16(c_hi, c2[r])), oo[r]);
+            lo = _mm256_srai_epi32(lo, cm->shift);
+            hi = _mm256_srai_epi32(hi, cm->shift);
+            __m256i v = _mm256_packus_epi16(_mm256_packs_epi32(lo, hi), zero);
+            v = _mm256_permute4x64_epi64(v, 0x08); // qwords 0 y 2 al carril bajo
+            _mm_storeu_si128((__m128i *)(outs[r] + i), _mm256_castsi256_si128(v));
+        }
+    }
+    color_matrix_scalar(cm, i0 + i, i1 + i, i2 + i, o0 + i, o1 + i, o2 + i, n - i);
+}
+
+// AVX-512BW: solo donde el ancho extra se nota (bucles de bytes y la convolucion en float).
+// Los intrinsecos de 512 bits de GCC 12 disparan falsos avisos de variable sin inicializar en C++.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+static BMP_TARGET("avx512bw") void minmax_rows_avx512(uint8_t *d, const uint8_t *a, const uint8_t *b, size_t n,
+                                                      int is_max)
+{
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+    {
+        __m512i va = _mm512_loadu_si512((const void *)(a + i));
+        __m512i vb = _mm512_loadu_si512((const void *)(b + i));
+        _mm512_storeu_si512((void *)(d + i), is_max ? _mm512_max_epu8(va, vb) : _mm512_min_epu8(va, vb));
+    }
+    minmax_rows_scalar(d + i, a + i, b + i, n - i, is_max);
+}
+
+static BMP_TARGET("avx512bw") void accum_u8_u16_avx512(uint16_t *acc, const uint8_t *row, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m512i v = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(row + i)));
+        __m512i a = _mm512_loadu_si512((const void *)(acc + i));
+        _mm512_storeu_si512((void *)(acc + i), _mm512_add_epi16(a, v));
+    }
+    accum_u8_u16_scalar(acc + i, row + i, n - i);
+}
+
+static inline BMP_TARGET("avx512bw") __m512i lut_lookup_avx512(__m512i x, const __m512i tbl[16])
+{
+    const __m512i c70 = _mm512_set1_epi8(0x70);
+    const __m512i c16 = _mm512_set1_epi8(16);
+    __m512i res = _mm512_setzero_si512();
+    for (int h = 0; h < 16; ++h)
+    {
+        res = _mm512_or_si512(res, _mm512_shuffle_epi8(tbl[h], _mm512_adds_epu8(x, c70)));
+        x = _mm512_sub_epi8(x, c16);
+    }
+    return res;
+}
+
+static BMP_TARGET("avx512bw") void lut_apply_avx512(uint8_t *p, size_t n, const PointLUT *lut, int uniform)
+{
+    size_t i = 0;
+    if (uniform)
+    {
+        __m512i tb[16];
+        for (int h = 0; h < 16; ++h)
+            tb[h] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(lut->b + 16 * h)));
+        for (; i + 192 <= n; i += 192)
+            for (int k = 0; k < 3; ++k)
+            {
+                __m512i x = _mm512_loadu_si512((const void *)(p + i + 64 * k));
+                _mm512_storeu_si512((void *)(p + i + 64 * k), lut_lookup_avx512(x, tb));
+            }
+    }
+    lut_apply_scalar(p + i, n - i, lut, uniform);
+}
+
+static BMP_TARGET("avx512bw") BMP_NO_FMA void conv3x3_row_avx512(const uint8_t *src, uint8_t *dst, int width,
+                                                                 const float *k, float sumk)
+{
+    __m512 kk[9];
+    for (int t = 0; t < 9; ++t)
+        kk[t] = _mm512_set1_ps(k[t]);
+    const __m512 vs = _mm512_set1_ps(sumk), half = _mm512_set1_ps(0.5f);
+    int x = 1;
+    for (; x + 16 <= width - 1; x += 16)
+    {
+        __m512 acc = _mm512_setzero_ps();
+        for (int dy = -1; dy <= 1; ++dy)
+        {
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                __m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(src + dy * width + x + dx)));
+                acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_cvtepi32_ps(v), kk[(dy + 1) * 3 + dx + 1]));
+            }
+        }
+        __m512i r = _mm512_cvttps_epi32(_mm512_add_ps(_mm512_div_ps(acc, vs), half));
+        r = _mm512_max_epi32(r, _mm512_setzero_si512()); // vpmovusdb satura sin signo
+        _mm_storeu_si128((__m128i *)(dst + x), _mm512_cvtusepi32_epi8(r));
+    }
+    conv3x3_cols_scalar(src, dst, width, x, width - 1, k, sumk);
+}
+#pragma GCC diagnostic pop
+#endif // BMP_X86
+
+KernelTable g_kernels = {CPU_SCALAR,          gray_bt601,       gray_bt709,         gray_bt2020,
+                         lut_apply_scalar,    conv3x3_row_scalar, minmax_rows_scalar, accum_u8_u16_scalar,
+                         unpack_bgr24_scalar, pack_bgr24_scalar, color_matrix_scalar};
+
+static const char *const cpu_level_names[CPU_LEVELS] = {"scalar", "sse2", "ssse3", "sse4.1", "avx2", "avx512bw"};
+
+// Nivel SIMD mas alto que soportan la CPU y el sistema operativo.
+int cpu_detect(void)
+{
+#if BMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return CPU_AVX512BW;
+    if (__builtin_cpu_supports("avx2"))
+        return CPU_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return CPU_SSE41;
+    if (__builtin_cpu_supports("ssse3"))
+        return CPU_SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return CPU_SSE2;
+#endif
+    return CPU_SCALAR;
+}
+
+// Llena la tabla con las variantes de 'level': cada nivel pisa solo los kernels que mejora.
+static void kernel_table_for_level(int level, KernelTable *t)
+{
+    t->level = level;
+    t->gray_bt601 = gray_bt601;
+    t->gray_bt709 = gray_bt709;
+    t->gray_bt2020 = gray_bt2020;
+    t->lut_apply = lut_apply_scalar;
+    t->conv3x3_row = conv3x3_row_scalar;
+    t->minmax_rows = minmax_rows_scalar;
+    t->accum_u8_u16 = accum_u8_u16_scalar;
+    t->unpack_bgr = unpack_bgr24_scalar;
+    t->pack_bgr = pack_bgr24_scalar;
+    t->color_matrix = color_matrix_scalar;
+#if BMP_X86
+    if (level >= CPU_SSE2)
+    {
+        t->minmax_rows = minmax_rows_sse2;
+        t->accum_u8_u16 = accum_u8_u16_sse2;
+        t->color_matrix = color_matrix_sse2;
+        t->conv3x3_row = conv3x3_row_sse2;
+    }
+    if (level >= CPU_SSSE3)
+    {
+        t->gray_bt601 = gray_bt601_ssse3;
+        t->gray_bt709 = gray_bt709_ssse3;
+        t->gray_bt2020 = gray_bt2020_ssse3;
+        t->unpack_bgr = unpack_bgr24_ssse3;
+        t->pack_bgr = pack_bgr24_ssse3;
+    }
+    if (level >= CPU_SSE41)
+        t->conv3x3_row = conv3x3_row_sse41;
+    if (level >= CPU_AVX2)
+    {
+        t->gray_bt601 = gray_bt601_avx2;
+        t->gray_bt709 = gray_bt709_avx2;
+        t->gray_bt2020 = gray_bt2020_avx2;
+        t->unpack_bgr = unpack_bgr24_avx2;
+        t->pack_bgr = pack_bgr24_avx2;
+        t->lut_apply = lut_apply_avx2;
+        t->minmax_rows = minmax_rows_avx2;
+        t->accum_u8_u16 = accum_u8_u16_avx2;
+        t->conv3x3_row = conv3x3_row_avx2;
+        t->color_matrix = color_matrix_avx2;
+    }
+    if (level >= CPU_AVX512BW)
+    {
+        t->minmax_rows = minmax_rows_avx512;
+        t->accum_u8_u16 = accum_u8_u16_avx512;
+        t->lut_apply = lut_apply_avx512;
+        t->conv3x3_row = conv3x3_row_avx512;
+    }
+#endif
+}
+
+// Nivel por nombre (--cpu=...), -1 si no se reconoce.
+int cpu_level_from_name(const char *name)
+{
+    for (int l = 0; l < CPU_LEVELS; ++l)
+        if (strcmp(name, cpu_level_names[l]) == 0)
+            return l;
+    return -1;
+}
+
+const char *cpu_level_name(int level)
+{
+    return (level >= 0 && level < CPU_LEVELS) ? cpu_level_names[level] : "?";
+}
+
+// Elige las variantes del mejor nivel disponible, sin pasar de max_level (-1 = sin limite).
+// Devuelve el nivel efectivo.
+int cpu_dispatch_init(int max_level)
+{
+    int detected = cpu_detect();
+    int level = detected;
+    if (max_level >= 0 && max_level < detected)
+        level = max_level;
+    else if (max_level > detected)
+        fprintf(stderr, "Aviso: la CPU no soporta %s, se usa %s.\n", cpu_level_name(max_level),
+                cpu_level_name(detected));
+    kernel_table_for_level(level, &g_kernels);
+    return level;
+}
+
+// --check-kernels: cada variante soportada contra la escalar, con datos pseudoaleatorios y
+// longitudes que dejan restos de todos los tamanos. Devuelve 0 si todas coinciden.
+static uint32_t check_rng(uint32_t *s)
+{
+    *s = *s * 1664525u + 1013904223u;
+    return *s >> 8;
+}
+
+int check_kernels(void)
+{
+    static const size_t lens[] = {0, 1, 2, 15, 16, 17, 31, 32, 33, 63, 64, 65, 95, 191, 193, 1000, 4099};
+    const size_t nl = sizeof(lens) / sizeof(lens[0]);
+    const size_t maxn = 4099 + 2;
+    KernelTable ref, t;
+    kernel_table_for_level(CPU_SCALAR, &ref);
+    uint8_t *buf = (uint8_t *)bmp_malloc(maxn * 3 * 8);
+    uint16_t *acc = (uint16_t *)bmp_malloc(sizeof(uint16_t) * maxn * 2);
+    if (!buf || !acc)
+    {
+        fprintf(stderr, "Sin memoria para la verificacion.\n");
+        bmp_free(buf);
+        bmp_free(acc);
+        return 1;
+    }
+    uint8_t *in = buf, *a = buf + maxn * 3, *b = buf + maxn * 6, *pl = buf + maxn * 9;
+    uint8_t *out1 = buf + maxn * 12, *out2 = buf + maxn * 18;
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < maxn * 3; ++i)
+        in[i] = (uint8_t)check_rng(&seed);
+
+    PointLUT lut, lut_u;
+    for (int i = 0; i < 256; ++i)
+    {
+        lut.b[i] = (uint8_t)check_rng(&seed);
+        lut.g[i] = (uint8_t)check_rng(&seed);
+        lut.r[i] = (uint8_t)check_rng(&seed);
+        lut_u.b[i] = lut_u.g[i] = lut_u.r[i] = (uint8_t)(255 - i);
+    }
+    const float kerns[3][9] = {{1, 2, 1, 2, 4, 2, 1, 2, 1},
+                               {0, -1, 0, -1, 5, -1, 0, -1, 0},
+                               {0.1f, -0.35f, 0.7f, 1.3f, -2.25f, 0.05f, 0.9f, 0.33f, -0.2f}};
+    ColorMatrix cms[8];
+    for (int m = 0; m < 8; ++m)
+        ycc_matrix(&cms[m], m & 1 ? YCC_BT709 : YCC_BT601, (m >> 1) & 1, (m >> 2) & 1);
+
+    int detected = cpu_detect(), failures = 0;
+    for (int level = CPU_SSE2; level <= detected; ++level)
+    {
+        kernel_table_for_level(level, &t);
+        int bad = 0;
+        for (size_t li = 0; li < nl; ++li)
+        {
+            size_t n = lens[li];
+            const char *what = NULL;
+
+            void (*grays[3][2])(Pixel24 *, size_t) = {{ref.gray_bt601, t.gray_bt601},
+                                                      {ref.gray_bt709, t.gray_bt709},
+                                                      {ref.gray_bt2020, t.gray_bt2020}};
+            for (int s = 0; s < 3 && !what; ++s)
+            {
+                memcpy(a, in, n * 3);
+                memcpy(b, in, n * 3);
+                grays[s][0]((Pixel24 *)a, n);
+                grays[s][1]((Pixel24 *)b, n);
+                if (memcmp(a, b, n * 3))
+                    what = "gray";
+            }
+            for (int u = 0; u < 2 && !what; ++u)
+            {
+                memcpy(a, in, n * 3);
+                memcpy(b, in, n * 3);
+                ref.lut_apply(a, n * 3, u ? &lut_u : &lut, u);
+                t.lut_apply(b, n * 3, u ? &lut_u : &lut, u);
+                if (memcmp(a, b, n * 3))
+                    what = "lut_apply";
+            }
+            for (int s = 0; s < 3 && !what; ++s)
+            {
+                int w = (int)n + 2;
+                float sumk = 0.f;
+                for (int j = 0; j < 9; ++j)
+                    sumk += kerns[s][j];
+                if (sumk == 0.f)
+                    sumk = 1.f;
+                memset(a, 0, (size_t)w);
+                memset(b, 0, (size_t)w);
+                ref.conv3x3_row(in + w, a, w, kerns[s], sumk);
+                t.conv3x3_row(in + w, b, w, kerns[s], sumk);
+                if (memcmp(a, b, (size_t)w))
+                    what = "conv3x3_row";
+            }
+            for (int mx = 0; mx < 2 && !what; ++mx)
+            {
+                ref.minmax_rows(a, in, in + n, n, mx);
+                t.minmax_rows(b, in, in + n, n, mx);
+                if (memcmp(a, b, n))
+                    what = "minmax_rows";
+            }
+            if (!what)
+            {
+                for (size_t i = 0; i < n; ++i)
+                    acc[i] = acc[maxn + i] = (uint16_t)(check_rng(&seed) & 0xFFFF);
+                ref.accum_u8_u16(acc, in, n);
+                t.accum_u8_u16(acc + maxn, in, n);
+                if (memcmp(acc, acc + maxn, sizeof(uint16_t) * n))
+                    what = "accum_u8_u16";
+            }
+            if (!what)
+            {
+                ref.unpack_bgr((const Pixel24 *)in, n, out1, out1 + maxn, out1 + 2 * maxn);
+                t.unpack_bgr((const Pixel24 *)in, n, out2, out2 + maxn, out2 + 2 * maxn);
+                for (int c = 0; c < 3; ++c)
+                    if (memcmp(out1 + c * maxn, out2 + c * maxn, n))
+                        what = "unpack_bgr";
+            }
+            if (!what)
+            {
+                ref.pack_bgr(in, in + n, in + 2 * n, n, (Pixel24 *)a);
+                t.pack_bgr(in, in + n, in + 2 * n, n, (Pixel24 *)b);
+                if (memcmp(a, b, n * 3))
+                    what = "pack_bgr";
+            }
+            for (int m = 0; m < 8 && !what; ++m)
+            {
+                memcpy(pl, in, n * 3);
+                ref.color_matrix(&cms[m], pl, pl + n, pl + 2 * n, out1, out1 + maxn, out1 + 2 * maxn, n);
+                t.color_matrix(&cms[m], pl, pl + n, pl + 2 * n, out2, out2 + maxn, out2 + 2 * maxn, n);
+                for (int c = 0; c < 3; ++c)
+                    if (memcmp(out1 + c * maxn, out2 + c * maxn, n))
+                        what = "color_matrix";
+            }
+            if (what)
+            {
+                printf("  %-9s FALLA en %s (n = %zu)\n", cpu_level_name(level), what, n);
+                bad = 1;
+                break;
+            }
+        }
+        if (!bad)
+            printf("  %-9s ok\n", cpu_level_name(level));
+        failures += bad;
+    }
+    printf("CPU detectada: %s; %s\n", cpu_level_name(detected),
+           failures ? "hay variantes que no coinciden con la escalar" : "todas las variantes coinciden");
+    bmp_free(buf);
+    bmp_free(acc);
+    return failures ? 1 : 0;
+}
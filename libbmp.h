@@ -0,0 +1,394 @@
+/* libbmp.h : API publica de libbmp (BMP 24bpp: lectura/escritura y operaciones sobre pixeles en memoria).
+   Compilar (estatica):   gcc -std=c11 -Wall -Wextra -O2 -pthread -c libbmp.c && ar rcs libbmp.a libbmp.o
+   Compilar (compartida): gcc -std=c11 -Wall -Wextra -O2 -pthread -fPIC -fvisibility=hidden -shared libbmp.c -o libbmp.so -lm
+   Usar: #include "libbmp.h" y enlazar con libbmp.a (o -lbmp) -lm -pthread. Se puede incluir desde C++.
+
+   - Las imagenes son arreglos Pixel24 de ARRIBA hacia ABAJO, width * height, sin relleno.
+   - Las funciones que devuelven int dan 1 si todo salio bien y 0 si no (el motivo va a stderr).
+   - Toda la memoria (resultados y temporales) pasa por bmp_malloc/bmp_free; con bmp_set_allocator
+     el llamador pone su propio asignador. Lo que devuelve la biblioteca se libera con bmp_free.
+   - Al arrancar los kernels son los escalares: cpu_dispatch_init(-1) elige las variantes SIMD
+     de la CPU. Los resultados son identicos byte a byte en todos los niveles.
+   - Los nombres y las estructuras de este archivo son estables dentro de una misma version mayor.
+*/
+
+#ifndef LIBBMP_H
+#define LIBBMP_H
+
+#include <stdio.h>  // FILE
+#include <stdint.h> // uint8_t, uint16_t, uint32_t
+#include <stddef.h> // size_t
+
+#define LIBBMP_VERSION_MAJOR 1
+#define LIBBMP_VERSION_MINOR 6
+#define LIBBMP_VERSION_PATCH 0
+#define LIBBMP_VERSION (LIBBMP_VERSION_MAJOR * 10000 + LIBBMP_VERSION_MINOR * 100 + LIBBMP_VERSION_PATCH)
+
+#if defined(__GNUC__)
+#define LIBBMP_API __attribute__((visibility("default")))
+#else
+#define LIBBMP_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// --- Estructuras de cabecera BMP ---
+#pragma pack(push, 1)
+typedef struct
+{
+    uint16_t bfType;      // Debe ser 0x4D42 = 'BM'
+    uint32_t bfSize;      // Tamaño total del archivo en bytes
+    uint16_t bfReserved1; // 0
+    uint16_t bfReserved2; // 0
+    uint32_t bfOffBits;   // Offset donde comienzan los datos de píxeles
+} BMPHeader;
+
+typedef struct
+{
+    uint32_t biSize;         // Tamaño de este header (40 bytes para BITMAPINFOHEADER)
+    int32_t biWidth;         // Ancho en píxeles
+    int32_t biHeight;        // Alto en píxeles (positivo = bottom-up)
+    uint16_t biPlanes;       // Debe ser 1
+    uint16_t biBitCount;     // Bits por píxel (esperamos 24)
+    uint32_t biCompression;  // 0 = BI_RGB (sin compresión)
+    uint32_t biSizeImage;    // Tamaño de la imagen (puede ser 0 para BI_RGB)
+    int32_t biXPelsPerMeter; // Resolución X
+    int32_t biYPelsPerMeter; // Resolución Y
+    uint32_t biClrUsed;      // Colores usados (0 = todos)
+    uint32_t biClrImportant; // Colores importantes (0 = todos)
+} BMPInfoHeader;
+#pragma pack(pop)
+
+// Estructura de un píxel BGR de 24 bits
+typedef struct
+{
+    uint8_t b, g, r;
+} Pixel24;
+
+// --- Version y memoria ---
+// Asignador del llamador. alloc debe devolver memoria alineada como malloc (o NULL si no hay);
+// user se pasa tal cual a ambas funciones.
+typedef struct
+{
+    void *(*alloc)(size_t size, void *user);
+    void (*release)(void *ptr, void *user);
+    void *user;
+} BmpAllocator;
+
+LIBBMP_API int libbmp_version(void); // LIBBMP_VERSION con la que se compilo la biblioteca
+// NULL vuelve a malloc/free (con BMP_HUGEPAGES=1|populate los bloques de 8 MB o mas salen de mmap
+// con paginas de 2 MB). Cambiarlo solo cuando no haya bloques vivos ni llamadas en curso.
+LIBBMP_API void bmp_set_allocator(const BmpAllocator *allocator);
+LIBBMP_API void *bmp_malloc(size_t size);
+LIBBMP_API void bmp_free(void *ptr);
+
+// --- CPU, hilos e instrumentacion ---
+#define CPU_SCALAR 0
+#define CPU_SSE2 1
+#define CPU_SSSE3 2
+#define CPU_SSE41 3
+#define CPU_AVX2 4
+#define CPU_AVX512BW 5
+#define CPU_LEVELS 6
+
+LIBBMP_API int cpu_detect(void);
+LIBBMP_API int cpu_level_from_name(const char *name); // -1 si no se reconoce
+LIBBMP_API const char *cpu_level_name(int level);
+LIBBMP_API int cpu_dispatch_init(int max_level); // -1 = sin limite; devuelve el nivel efectivo
+LIBBMP_API int check_kernels(void);              // 0 si todas las variantes coinciden con la escalar
+LIBBMP_API int bmp_num_threads(void);            // BMP_THREADS o nucleos en linea (leido una vez)
+LIBBMP_API void bmp_set_num_threads(int n);      // cambia ese numero; n <= 0 vuelve a leer BMP_THREADS
+LIBBMP_API int stats_enable(const char *jsonl_path);
+
+// Planificador de tareas con robo de trabajo: todas las operaciones reparten su trabajo en un unico
+// conjunto de bmp_num_threads() - 1 hilos, cada uno con su cola; los ociosos roban de las demas.
+// Un grupo cuenta sus tareas pendientes (iniciar pending en 0). Quien espera ejecuta tareas
+// mientras tanto, asi una tarea puede a su vez repartir trabajo (p. ej. una imagen de un lote).
+// BMP_NUMA=1 (o sim:N para simular N nodos) fija cada hilo a las CPU de un nodo, manda cada tesela
+// al nodo de sus filas y reparte entre los nodos las paginas de las imagenes nuevas; el trabajo que
+// lanza una tarea (una imagen de un lote) queda en el nodo de quien la ejecuta. La unica excepcion
+// es el hilo lector de pipeline_bmp24, que pasa casi todo el tiempo esperando al disco.
+typedef struct BmpTaskGroup
+{
+    int pending;
+} BmpTaskGroup;
+typedef struct BmpTask
+{
+    void (*run)(struct BmpTask *t); // lo fija quien encola; t debe vivir hasta que termine
+    BmpTaskGroup *group;
+} BmpTask;
+LIBBMP_API void bmp_task_spawn(BmpTaskGroup *g, BmpTask *t);
+LIBBMP_API int bmp_task_help(void); // ejecuta una tarea pendiente (propia o robada); 1 si hubo
+LIBBMP_API int bmp_task_pending(const BmpTaskGroup *g);
+LIBBMP_API void bmp_task_wait(BmpTaskGroup *g);
+
+// --- Lectura/escritura ---
+// Las filas se entregan y se reciben en el orden del archivo: de ABAJO hacia ARRIBA.
+// Todas las funciones con nombre de archivo aceptan "-" para stdin/stdout (sin fseek: tuberias).
+typedef struct
+{
+    FILE *f;
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    int width, height, padding;
+    int rows_done;
+} BMPReader;
+
+typedef struct
+{
+    FILE *f;
+    int width, height, padding;
+    int rows_done;
+} BMPWriter;
+
+LIBBMP_API int bmp_reader_open(BMPReader *rd, const char *filename);
+LIBBMP_API int bmp_reader_next_row(BMPReader *rd, Pixel24 *row);
+LIBBMP_API void bmp_reader_close(BMPReader *rd);
+LIBBMP_API int bmp_writer_open(BMPWriter *wr, const char *filename, const BMPInfoHeader *src_ih);
+LIBBMP_API int bmp_writer_put_row(BMPWriter *wr, const Pixel24 *row);
+LIBBMP_API int bmp_writer_close(BMPWriter *wr);
+
+// Lector por bloques grandes: read() de buf_size bytes (0 = BMP_READ_MB o 1 MB) sobre un buffer
+// alineado, posix_fadvise SEQUENTIAL/WILLNEED y, con BMP_STREAM_DIRECT, O_DIRECT (si el archivo no
+// lo admite se lee sin el y flags lo refleja). Mismo orden de filas que BMPReader.
+#define BMP_STREAM_DIRECT 1
+typedef struct
+{
+    int fd;
+    int flags; // BMP_STREAM_* en uso
+    BMPHeader fh;
+    BMPInfoHeader ih;
+    int width, height, padding;
+    int rows_done;
+    uint8_t *raw, *area;       // bloque reservado y area de lectura alineada dentro de el
+    uint8_t *data, *end;       // bytes leidos y aun sin consumir
+    size_t slack, area_size;   // lugar para bytes pendientes antes de area; tamano de cada read()
+    uint64_t file_pos;         // bytes leidos del archivo
+} BmpStreamReader;
+
+LIBBMP_API int bmp_stream_open(BmpStreamReader *sr, const char *filename, size_t buf_size, int flags);
+LIBBMP_API int bmp_stream_next_row(BmpStreamReader *sr, Pixel24 *row);
+LIBBMP_API void bmp_stream_close(BmpStreamReader *sr);
+
+// Orientacion aplicada al guardar, sin pasada extra sobre la imagen
+#define SAVE_FLIP_V 1 // espejo vertical: se invierte el orden de filas
+#define SAVE_FLIP_H 2 // espejo horizontal: cada fila se invierte al escribirla
+#define SAVE_ROTATE_180 (SAVE_FLIP_V | SAVE_FLIP_H)
+
+// *out_pixels queda de ARRIBA hacia ABAJO; se libera con bmp_free. Lee con BmpStreamReader
+// (BMP_READ_MB fija el buffer, BMP_DIRECT=1 usa O_DIRECT).
+LIBBMP_API int load_bmp24(const char *filename, BMPHeader *out_fh, BMPInfoHeader *out_ih, Pixel24 **out_pixels);
+// Igual, pero las filas se decodifican en cuanto llega cada bloque y on_rows recibe las ya listas:
+// [y0, y1) de la imagen ARRIBA-ABAJO, en orden de archivo (de abajo hacia arriba). El resto de
+// pixels aun no tiene datos. Devolver 0 cancela la carga.
+typedef int (*BmpRowsFn)(Pixel24 *pixels, int width, int height, int y0, int y1, void *user);
+LIBBMP_API int load_bmp24_stream(const char *filename, int flags, BmpRowsFn on_rows, void *user,
+                                 BMPHeader *out_fh, BMPInfoHeader *out_ih, Pixel24 **out_pixels);
+
+// Pipeline dentro de una imagen: un hilo lector decodifica, las bandas de band_rows filas (<= 0: 64)
+// se filtran como tareas del planificador en cuanto llegan con su halo (como mucho workers a la vez;
+// <= 0: bmp_num_threads) y el hilo llamador ayuda con ellas y escribe las terminadas en orden de
+// archivo. El lector es el unico hilo fuera del conjunto: espera al disco y solo corre prepare.
+// filter escribe las filas [y0, y1) de dst leyendo src, que ya tiene las filas [y0 - halo,
+// y1 + halo) dentro de la imagen. prepare (opcional) corre en el hilo lector sobre cada bloque
+// recien decodificado, para lo pixel a pixel que el filtro necesita ya hecho en el halo (p. ej.
+// el gris antes de convolve3x3_rows). Cualquiera de los dos devuelve 0 para abortar. Con in_place
+// (solo si halo es 0) no hay imagen aparte para la salida: el filtro recibe dst == src.
+typedef int (*BmpBandFilterFn)(const Pixel24 *src, Pixel24 *dst, int width, int height, int y0, int y1,
+                               void *user);
+typedef struct
+{
+    BmpRowsFn prepare;
+    BmpBandFilterFn filter;
+    int halo;
+    int in_place;
+    void *user;
+} BmpPipeline;
+LIBBMP_API int pipeline_bmp24(const char *in_name, const char *out_name, const BmpPipeline *p, int band_rows,
+                              int workers);
+LIBBMP_API int save_bmp24(const char *filename, const BMPInfoHeader *src_ih, const Pixel24 *pixels);
+LIBBMP_API int save_bmp24_oriented(const char *filename, const BMPInfoHeader *src_ih, const Pixel24 *pixels,
+                                   int flags);
+LIBBMP_API int save_bmp1(const char *filename, const BMPInfoHeader *src_ih, const uint8_t *mask);
+
+// Codificacion en memoria. bmp24_encoded_size da el tamano exacto a partir de la cabecera (0 si no
+// es valida): el buffer se reserva una vez y encode_bmp24 escribe directo en el.
+LIBBMP_API size_t bmp24_encoded_size(const BMPInfoHeader *ih);
+LIBBMP_API int encode_bmp24(const BMPInfoHeader *src_ih, const Pixel24 *pixels, uint8_t *buf, size_t buf_size,
+                            size_t *out_size);
+LIBBMP_API int decode_bmp24(const uint8_t *buf, size_t size, BMPHeader *out_fh, BMPInfoHeader *out_ih,
+                            Pixel24 **out_pixels);
+
+// --- Segmentos de memoria compartida ---
+// Cabecera de 64 bytes al inicio del segmento; los pixeles (Pixel24, ARRIBA hacia ABAJO, filas
+// contiguas) empiezan en data_offset. Un proceso crea el segmento, pasa el descriptor (SCM_RIGHTS
+// o herencia) y el siguiente lo filtra en el lugar con las funciones de siempre sobre seg.pixels.
+#define BMP_SHM_MAGIC 0x31484D42u // "BMH1"
+#define BMP_SHM_VERSION 1
+#define BMP_SHM_BGR24 1
+#define BMP_SHM_HEADER_SIZE 64
+
+typedef struct
+{
+    uint32_t magic, version, format;
+    int32_t width, height;
+    uint32_t stride;      // bytes por fila; hoy siempre 3 * width
+    uint64_t data_offset; // BMP_SHM_HEADER_SIZE
+    uint64_t capacity;    // bytes de pixeles disponibles (una imagen mas chica tambien entra)
+    uint64_t sequence;    // libre para el llamador (numero de cuadro, etc.)
+    uint8_t reserved[16];
+} BmpShmHeader;
+
+typedef struct
+{
+    int fd;
+    size_t size; // bytes mapeados
+    BmpShmHeader *hdr;
+    Pixel24 *pixels;
+    // Copia validada de la cabecera: usar estas y no hdr, que otro proceso puede reescribir
+    int width, height;
+    uint64_t capacity;
+} BmpShm;
+
+LIBBMP_API size_t bmp_shm_size(int width, int height);
+LIBBMP_API int bmp_shm_create(BmpShm *seg, int width, int height, const char *name);
+LIBBMP_API int bmp_shm_attach(BmpShm *seg, int fd);
+// Para segmentos de procesos no confiables: ademas exige F_SEAL_SHRINK (lo pone si el memfd admite
+// sellos, como los de bmp_shm_create sin nombre), asi el mapeo no puede quedar fuera del archivo.
+LIBBMP_API int bmp_shm_attach_sealed(BmpShm *seg, int fd);
+LIBBMP_API int bmp_shm_set_size(BmpShm *seg, int width, int height);
+LIBBMP_API void bmp_shm_detach(BmpShm *seg); // desmapea; cerrar seg.fd queda a cargo del llamador
+LIBBMP_API int check_shm(void);              // 0 si bmp_shm_attach rechaza las cabeceras hostiles
+
+// --- Escala de grises y convolucion ---
+#define LUMA_BT601 0     // 0.299, 0.587, 0.114 (el historico de to_grayscale)
+#define LUMA_BT709 1     // 0.2126, 0.7152, 0.0722 (HD)
+#define LUMA_BT2020 2    // 0.2627, 0.6780, 0.0593 (UHD)
+#define LUMA_AVERAGE 3   // (r + g + b) / 3
+#define LUMA_CHANNEL_R 4 // solo un canal
+#define LUMA_CHANNEL_G 5
+#define LUMA_CHANNEL_B 6
+#define LUMA_COUNT 7
+
+LIBBMP_API void to_grayscale(Pixel24 *pixels, int width, int height);
+LIBBMP_API void to_grayscale_ex(Pixel24 *pixels, int width, int height, int standard);
+LIBBMP_API void to_grayscale_reference(Pixel24 *pixels, int width, int height);
+LIBBMP_API void convolve3x3(Pixel24 *pixels, int width, int height, const float k[3][3]);
+// Filas [y0, y1) de convolve3x3 de src (ya en gris) escritas en dst; lee una fila de halo arriba
+// y abajo. Identico a convolve3x3 en esas filas. Pensado como filtro de pipeline_bmp24.
+LIBBMP_API int convolve3x3_rows(const Pixel24 *src, Pixel24 *dst, int width, int height, int y0, int y1,
+                                const float k[3][3]);
+
+// --- Operaciones puntuales por tabla (LUT) ---
+#define LUT_CH_B 1
+#define LUT_CH_G 2
+#define LUT_CH_R 4
+#define LUT_CH_ALL (LUT_CH_B | LUT_CH_G | LUT_CH_R)
+
+typedef struct PointLUT
+{
+    uint8_t b[256], g[256], r[256];
+} PointLUT;
+
+LIBBMP_API void lut_identity(PointLUT *lut);
+LIBBMP_API void lut_compose(PointLUT *lut, const uint8_t f[256], int mask);
+LIBBMP_API void lut_gamma(PointLUT *lut, double gamma, int mask);
+LIBBMP_API void lut_brightness_contrast(PointLUT *lut, int brightness, double contrast, int mask);
+LIBBMP_API void lut_levels(PointLUT *lut, int in_black, int in_white, double gamma, int out_black, int out_white,
+                           int mask);
+LIBBMP_API void lut_invert(PointLUT *lut, int mask);
+LIBBMP_API void lut_threshold(PointLUT *lut, int t, int mask);
+LIBBMP_API void lut_curve(PointLUT *lut, const uint8_t *xs, const uint8_t *ys, int n, int mask);
+LIBBMP_API void apply_lut24(Pixel24 *pixels, int width, int height, const PointLUT *lut);
+
+// --- Histogramas, ecualizacion y umbrales ---
+typedef struct
+{
+    uint32_t b[256], g[256], r[256], y[256]; // y = luminancia BT.601
+} Histogram24;
+
+typedef struct
+{
+    int min, max, median;
+    double mean, stddev;
+} ChannelStats;
+
+#define ADAPT_MEAN 0
+#define ADAPT_GAUSSIAN 1
+
+LIBBMP_API int compute_histogram24(const Pixel24 *pixels, int width, int height, Histogram24 *out);
+LIBBMP_API void histogram_channel_stats(const uint32_t hist[256], ChannelStats *st);
+LIBBMP_API int equalize_histogram24(Pixel24 *pixels, int width, int height, int per_channel);
+LIBBMP_API int clahe24(Pixel24 *pixels, int width, int height, int tiles_x, int tiles_y, double clip_limit);
+LIBBMP_API void extract_luma_plane(const Pixel24 *pixels, int width, int height, uint8_t *plane);
+LIBBMP_API int otsu_threshold(const uint32_t hist[256]);
+LIBBMP_API void threshold_plane(const uint8_t *gray, int width, int height, int t, uint8_t *mask);
+LIBBMP_API int box_mean_u8(const uint8_t *src, uint8_t *dst, int width, int height, int radius);
+LIBBMP_API int adaptive_threshold(const uint8_t *gray, int width, int height, int radius, int method, int offset,
+                                  uint8_t *mask);
+
+// --- Geometria: redimensionado, piramide, rotaciones ---
+#define RESIZE_AUTO 0     // caja si el factor es entero, si no Lanczos3
+#define RESIZE_BOX 1      // promedio de area, solo factores enteros de reduccion
+#define RESIZE_BILINEAR 2 // triangular (separable)
+#define RESIZE_LANCZOS3 3 // Lanczos a=3 (separable)
+
+#define ROTATE_TRANSPOSE 0
+#define ROTATE_90 1  // horario
+#define ROTATE_270 2 // antihorario
+
+// *out es un bloque nuevo (se libera con bmp_free).
+LIBBMP_API int resize_bmp24(const Pixel24 *src, int sw, int sh, int dw, int dh, int filter, Pixel24 **out);
+LIBBMP_API int rotate_bmp24(const Pixel24 *src, int width, int height, int mode, Pixel24 **out);
+LIBBMP_API int build_pyramid_bmp24(const char *in_name, const char *prefix, int max_levels);
+LIBBMP_API int build_pyramid_from_pixels(const Pixel24 *pixels, const BMPInfoHeader *ih, const char *prefix,
+                                         int max_levels);
+LIBBMP_API void flip_horizontal(Pixel24 *pixels, int width, int height);
+LIBBMP_API int flip_vertical(Pixel24 *pixels, int width, int height);
+LIBBMP_API void rotate180(Pixel24 *pixels, int width, int height);
+
+// --- Morfologia y filtros ---
+#define MORPH_ERODE 0
+#define MORPH_DILATE 1
+#define MORPH_OPEN 2
+#define MORPH_CLOSE 3
+#define MORPH_TOPHAT 4   // original - apertura
+#define MORPH_BLACKHAT 5 // cierre - original
+
+LIBBMP_API int morph_plane(uint8_t *plane, int width, int height, int se_w, int se_h, int op);
+LIBBMP_API int morph_bmp24(Pixel24 *pixels, int width, int height, int se_w, int se_h, int op);
+LIBBMP_API int gauss_blur_f32(float *plane, float *tmp, int width, int height, double sigma);
+LIBBMP_API int bilateral_filter_bmp24(Pixel24 *pixels, int width, int height, double sigma_s, double sigma_r,
+                                      int levels);
+LIBBMP_API int bilateral_reference_bmp24(Pixel24 *pixels, int width, int height, double sigma_s, double sigma_r);
+LIBBMP_API int unsharp_mask_bmp24(Pixel24 *pixels, int width, int height, double radius, double amount,
+                                  int threshold);
+
+// --- Espacios de color ---
+#define YCC_BT601 0
+#define YCC_BT709 1
+
+LIBBMP_API void unpack_bgr24(const Pixel24 *src, size_t n, uint8_t *b, uint8_t *g, uint8_t *r);
+LIBBMP_API void pack_bgr24(const uint8_t *b, const uint8_t *g, const uint8_t *r, size_t n, Pixel24 *dst);
+LIBBMP_API void bgr_to_ycbcr(const Pixel24 *src, size_t n, uint8_t *y, uint8_t *cb, uint8_t *cr, int standard,
+                             int full_range);
+LIBBMP_API void ycbcr_to_bgr(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, size_t n, Pixel24 *dst,
+                             int standard, int full_range);
+LIBBMP_API void bgr_to_hsv(const Pixel24 *src, size_t n, uint8_t *h, uint8_t *s, uint8_t *v);
+LIBBMP_API void hsv_to_bgr(const uint8_t *h, const uint8_t *s, const uint8_t *v, size_t n, Pixel24 *dst);
+LIBBMP_API void bgr_to_lab(const Pixel24 *src, size_t n, uint8_t *L, uint8_t *a, uint8_t *b);
+LIBBMP_API void lab_to_bgr(const uint8_t *L, const uint8_t *a, const uint8_t *b, size_t n, Pixel24 *dst);
+LIBBMP_API double mean_delta_e(const Pixel24 *a, const Pixel24 *b, size_t n);
+LIBBMP_API int adjust_hue_saturation(Pixel24 *pixels, int width, int height, double hue_shift, double sat_scale);
+
+// Filtro que recibe una imagen en gris (r = g = b = Y) y la modifica en el lugar.
+typedef int (*LumaFilterFn)(Pixel24 *gray, int width, int height, void *ctx);
+LIBBMP_API int filter_luma_only(Pixel24 *pixels, int width, int height, int standard, LumaFilterFn fn, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBBMP_H